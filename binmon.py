@@ -0,0 +1,262 @@
+#!/usr/bin/env python3
+#
+# Host-side client for the JOS binary monitor protocol (kern/binmon.h).
+#
+# Start JOS with its serial port on a socket, e.g.
+#	make qemu-binmon
+# and then
+#	./binmon.py jos-serial.sock kerninfo 'time help'
+#	./binmon.py --bench 100 jos-serial.sock kerninfo
+#	./binmon.py --perf jos-serial.sock kerninfo
+#
+# The address may be a UNIX socket path or host:port for a TCP chardev.
+# Import this file to drive the monitor from a test harness:
+#	with BinMon('jos-serial.sock') as m:
+#		rc, out = m.run('kerninfo')
+
+import os
+import socket
+import struct
+import sys
+
+MAGIC = b'\xa5\x5a'
+MAXPAYLOAD = 4096
+
+PING, RUN, PERF, BACKTRACE, BENCH, EXIT = 0x01, 0x02, 0x03, 0x04, 0x05, 0x0f
+RESPONSE, HELLO, NAK, ERROR = 0x80, 0x80, 0xfe, 0xff
+RUN_TRUNCATED = 0x1
+
+# Same order as the PMU_* enum in kern/pmu.h.
+PMU_EVENTS = ['cycles', 'instructions', 'LLC-misses', 'branch-misses',
+              'dTLB-load-misses']
+
+
+def crc16(data, crc=0xffff):
+    """CRC-16/CCITT-FALSE, as computed by crc16() in kern/binmon.c."""
+    for b in data:
+        x = ((crc >> 8) ^ b) & 0xff
+        x ^= x >> 4
+        crc = ((crc << 8) ^ (x << 12) ^ (x << 5) ^ x) & 0xffff
+    return crc
+
+
+class BinMonError(Exception):
+    pass
+
+
+class BinMon:
+    def __init__(self, addr, enter=True, retries=3):
+        if ':' in addr and not os.path.exists(addr):
+            host, port = addr.rsplit(':', 1)
+            self.sock = socket.create_connection((host, int(port)))
+        else:
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.connect(addr)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_KEEPALIVE, 1)
+        self.buf = b''
+        self.seq = 0
+        self.retries = retries
+        self.version = None
+        if enter:
+            self.enter()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    # Raw I/O
+
+    def _read(self, n):
+        while len(self.buf) < n:
+            data = self.sock.recv(65536)
+            if not data:
+                raise BinMonError('connection closed')
+            self.buf += data
+        out, self.buf = self.buf[:n], self.buf[n:]
+        return out
+
+    def _recv_frame(self):
+        # Skip anything before the start-of-frame marker, such as the
+        # text monitor's prompt and echo.
+        while True:
+            i = self.buf.find(MAGIC)
+            if i >= 0:
+                self.buf = self.buf[i + 2:]
+                break
+            # Keep a trailing 0xA5 in case the marker straddles two reads.
+            self.buf = self.buf[-1:] if self.buf.endswith(MAGIC[:1]) else b''
+            data = self.sock.recv(65536)
+            if not data:
+                raise BinMonError('connection closed')
+            self.buf += data
+        hdr = self._read(4)
+        typ, seq, length = struct.unpack('<BBH', hdr)
+        if length > MAXPAYLOAD:
+            return None
+        payload = self._read(length)
+        (crc,) = struct.unpack('<H', self._read(2))
+        if crc != crc16(hdr + payload):
+            return None
+        return typ, seq, payload
+
+    def _send_frame(self, typ, seq, payload):
+        hdr = struct.pack('<BBH', typ, seq, len(payload))
+        self.sock.sendall(MAGIC + hdr + payload +
+                          struct.pack('<H', crc16(hdr + payload)))
+
+    def request(self, typ, payload=b''):
+        """Send a request and return the response payload."""
+        if len(payload) > MAXPAYLOAD:
+            raise BinMonError('payload too large')
+        self.seq = (self.seq + 1) & 0xff
+        for _ in range(self.retries):
+            self._send_frame(typ, self.seq, payload)
+            frame = self._recv_frame()
+            if frame is None:
+                continue
+            rtyp, rseq, rpayload = frame
+            if rtyp == NAK:
+                continue
+            if rseq != self.seq:
+                raise BinMonError('sequence mismatch: sent %d, got %d'
+                                  % (self.seq, rseq))
+            if rtyp == ERROR:
+                (err,) = struct.unpack('<i', rpayload[:4])
+                raise BinMonError('error %d: %s'
+                                  % (err, rpayload[4:].decode(errors='replace')))
+            if rtyp != typ | RESPONSE:
+                raise BinMonError('unexpected response type 0x%02x' % rtyp)
+            return rpayload
+        raise BinMonError('no valid response after %d tries' % self.retries)
+
+    # Protocol operations
+
+    def enter(self):
+        """Switch the text monitor into binary mode."""
+        self.sock.sendall(b'\rbinmon\r')
+        while True:
+            frame = self._recv_frame()
+            if frame and frame[0] == HELLO:
+                (self.version,) = struct.unpack('<I', frame[2][:4])
+                return self.version
+
+    def ping(self, data=b''):
+        return self.request(PING, data)
+
+    def run(self, cmd):
+        """Run a monitor command; returns (rc, output, truncated)."""
+        p = self.request(RUN, cmd.encode())
+        rc, flags = struct.unpack('<iI', p[:8])
+        return rc, p[8:].decode(errors='replace'), bool(flags & RUN_TRUNCATED)
+
+    def perf(self, cmd):
+        """Count PMU events around a command; uncounted events are None."""
+        p = self.request(PERF, cmd.encode())
+        rc, valid, tsc = struct.unpack('<iIQ', p[:16])
+        counts = struct.unpack('<%dQ' % len(PMU_EVENTS), p[16:])
+        result = {'rc': rc, 'tsc': tsc}
+        for i, name in enumerate(PMU_EVENTS):
+            result[name] = counts[i] if valid & (1 << i) else None
+        return result
+
+    def backtrace(self):
+        """Return the kernel stack as a list of (eip, ebp, args)."""
+        p = self.request(BACKTRACE)
+        (n,) = struct.unpack('<I', p[:4])
+        frames = []
+        for i in range(n):
+            f = struct.unpack('<7I', p[4 + 28 * i:4 + 28 * (i + 1)])
+            frames.append((f[0], f[1], f[2:]))
+        return frames
+
+    def bench(self, cmd, iterations):
+        """Run a command repeatedly; returns (rc, [cycles per run])."""
+        p = self.request(BENCH, struct.pack('<I', iterations) + cmd.encode())
+        rc, n = struct.unpack('<iI', p[:8])
+        return rc, list(struct.unpack('<%dQ' % n, p[8:8 + 8 * n]))
+
+    def close(self):
+        try:
+            self.request(EXIT)
+        finally:
+            self.sock.close()
+
+
+def load_symbols(path='obj/kern/kernel.sym'):
+    """Read 'nm -n' output so backtraces can be symbolized."""
+    syms = []
+    try:
+        with open(path) as f:
+            for line in f:
+                parts = line.split()
+                if len(parts) == 3 and parts[1] in 'tT':
+                    syms.append((int(parts[0], 16), parts[2]))
+    except OSError:
+        pass
+    return syms
+
+
+def symbolize(syms, addr):
+    best = None
+    for a, name in syms:
+        if a > addr:
+            break
+        best = (a, name)
+    return '%s+%x' % (best[1], addr - best[0]) if best else '%08x' % addr
+
+
+def main(argv):
+    import argparse
+    import time
+
+    ap = argparse.ArgumentParser(
+        description='Drive the JOS kernel monitor over its binary protocol.')
+    ap.add_argument('addr', help='serial socket path or host:port')
+    ap.add_argument('commands', nargs='*')
+    ap.add_argument('--bench', type=int, metavar='N',
+                    help='run each command N times and report cycles')
+    ap.add_argument('--perf', action='store_true',
+                    help='report hardware counters for each command')
+    ap.add_argument('--backtrace', action='store_true')
+    ap.add_argument('--rate', type=int, metavar='N',
+                    help='measure round trips per second over N pings')
+    args = ap.parse_args(argv)
+
+    with BinMon(args.addr) as m:
+        for cmd in args.commands:
+            if args.bench:
+                rc, samples = m.bench(cmd, args.bench)
+                samples.sort()
+                print('%s: n=%d min=%d median=%d max=%d cycles'
+                      % (cmd, len(samples), samples[0],
+                         samples[len(samples) // 2], samples[-1]))
+            elif args.perf:
+                r = m.perf(cmd)
+                print('%s:' % cmd)
+                for name in PMU_EVENTS + ['tsc']:
+                    v = r[name]
+                    print('  %16s  %s' % ('<not counted>' if v is None
+                                          else v, name))
+            else:
+                rc, out, truncated = m.run(cmd)
+                sys.stdout.write(out)
+                if truncated:
+                    print('[output truncated]')
+        if args.backtrace:
+            syms = load_symbols()
+            for eip, ebp, fargs in m.backtrace():
+                print('  eip %08x  ebp %08x  %s'
+                      % (eip, ebp, symbolize(syms, eip)))
+        if args.rate:
+            t0 = time.time()
+            for _ in range(args.rate):
+                m.ping()
+            dt = time.time() - t0
+            print('%d round trips in %.3fs: %.0f/s'
+                  % (args.rate, dt, args.rate / dt))
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
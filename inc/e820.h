@@ -0,0 +1,39 @@
+#ifndef JOS_INC_E820_H
+#define JOS_INC_E820_H
+
+// The BIOS physical memory map (INT 15h, AX=E820h).
+//
+// boot/boot.S collects the map while still in real mode and leaves it
+// at physical address BOOT_E820: the signature E820_SMAP, a 32-bit
+// entry count, then the entries themselves.
+
+#define BOOT_E820	0x8000		// physical address of the boot map
+#define E820_MAX	32		// most entries we keep
+#define E820_SMAP	0x534D4150	// 'SMAP', in %edx/%eax for E820h
+
+// Address range types
+#define E820_RAM	1		// usable RAM
+#define E820_RESERVED	2		// reserved by the system
+#define E820_ACPI	3		// ACPI tables, reclaimable
+#define E820_NVS	4		// ACPI non-volatile storage
+#define E820_UNUSABLE	5		// defective memory
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+struct E820Entry {
+	uint64_t addr;
+	uint64_t len;
+	uint32_t type;
+} __attribute__((packed));
+
+struct E820Map {
+	uint32_t signature;		// E820_SMAP if boot.S filled it in
+	uint32_t count;
+	struct E820Entry entries[E820_MAX];
+} __attribute__((packed));
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_E820_H */
@@ -18,6 +18,7 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS    0x28     // Task segment selector
+#define GD_CPU    0x30     // Per-CPU data (struct CpuInfo), loaded in %fs
 
 /*
  * Virtual memory map:                                Permissions
@@ -36,22 +37,31 @@
  *    KERNBASE ----->  +------------------------------+ 0xf0000000
  *                     |  Cur. Page Table (Kern. RW)  | RW/--  PTSIZE
  *    VPT,KSTACKTOP--> +------------------------------+ 0xefc00000      --+
- *                     |         Kernel Stack         | RW/--  KSTKSIZE   |
+ *                     |     CPU0's Kernel Stack      | RW/--  KSTKSIZE   |
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     |     CPU1's Kernel Stack      | RW/--  KSTKSIZE   |
  *                     | - - - - - - - - - - - - - - -|                 PTSIZE
- *                     |      Invalid Memory (*)      | --/--             |
- *    ULIM     ------> +------------------------------+ 0xef800000      --+
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     :              .               :                   |
+ *                     :              .               :                   |
+ *    MMIOLIM ------>  +------------------------------+ 0xef800000      --+
+ *                     |       Memory-mapped I/O      | RW/--  PTSIZE
+ * ULIM, MMIOBASE -->  +------------------------------+ 0xef400000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
- *    UVPT      ---->  +------------------------------+ 0xef400000
+ *    UVPT      ---->  +------------------------------+ 0xef000000
  *                     |          RO PAGES            | R-/R-  PTSIZE
- *    UPAGES    ---->  +------------------------------+ 0xef000000
+ *    UPAGES    ---->  +------------------------------+ 0xeec00000
  *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ * UTOP,UENVS ------>  +------------------------------+ 0xee800000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xee7ff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xee7fe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xee7fd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -87,6 +97,11 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// The other CPUs start in real mode at this physical address, where
+// boot_aps() (init.c) copies the code in mpentry.S.  It is below 1MB
+// and page aligned, as the startup IPI requires.
+#define MPENTRY_PADDR	0x7000
+
 // Virtual page table.  Entry PDX[VPT] in the PD contains a pointer to
 // the page directory itself, thereby turning the PD into a page table,
 // which maps all the PTEs containing the page mappings for the entire
@@ -94,7 +109,14 @@
 #define VPT		(KERNBASE - PTSIZE)
 #define KSTACKTOP	VPT
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
-#define ULIM		(KSTACKTOP - PTSIZE) 
+#define KSTKGAP		(8*PGSIZE)   		// size of a kernel stack guard
+
+// Memory-mapped I/O: the local APIC, I/O APICs and any firmware
+// tables outside the direct map.  See mmio_map_region().
+#define MMIOLIM		(KSTACKTOP - PTSIZE)
+#define MMIOBASE	(MMIOLIM - PTSIZE)
+
+#define ULIM		(MMIOBASE)
 
 /*
  * User read-only mappings! Anything below here til UTOP are readonly to user.
@@ -177,7 +199,22 @@ struct Page {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// The buddy allocator in kern/pmap.c hands out blocks of
+	// 2^pp_order pages.  Only the first page of a block has a
+	// meaningful pp_order and pp_flags.
+	uint8_t pp_order;
+	uint8_t pp_flags;
+
+	// The CPU that last allocated the page (kern/pmap.c).  This also
+	// pads struct Page to 16 bytes, so indexing 'pages' is a shift.
+	uint8_t pp_cpu;
 };
 
+// pp_flags
+#define PP_FREE		0x01	/* first page of a block on a free list */
+#define PP_SLAB		0x02	/* page holds a slab (kern/slab.c) */
+#define PP_MALLOC	0x04	/* first page of a multi-page malloc block */
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
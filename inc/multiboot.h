@@ -0,0 +1,49 @@
+#ifndef JOS_INC_MULTIBOOT_H
+#define JOS_INC_MULTIBOOT_H
+
+// Just enough of the Multiboot 0.6.96 specification for the kernel to
+// find out how much memory it has when a Multiboot loader (GRUB, or
+// QEMU's -kernel option) starts it instead of boot/.
+
+// The header in kern/entry.S
+#define MULTIBOOT_HEADER_MAGIC		0x1BADB002
+#define MULTIBOOT_PAGE_ALIGN		0x00000001	// align modules
+#define MULTIBOOT_MEMORY_INFO		0x00000002	// want mem_* and mmap_*
+
+// Left in %eax by the loader
+#define MULTIBOOT_BOOTLOADER_MAGIC	0x2BADB002
+
+// multiboot_info flags
+#define MULTIBOOT_INFO_MEMORY		0x00000001	// mem_lower/mem_upper
+#define MULTIBOOT_INFO_MEM_MAP		0x00000040	// mmap_length/mmap_addr
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+// Pointed to by %ebx on entry
+struct MultibootInfo {
+	uint32_t flags;
+	uint32_t mem_lower;		// KB of memory below 1MB
+	uint32_t mem_upper;		// KB of memory from 1MB up to a hole
+	uint32_t boot_device;
+	uint32_t cmdline;
+	uint32_t mods_count;
+	uint32_t mods_addr;
+	uint32_t syms[4];
+	uint32_t mmap_length;		// bytes of MultibootMmap entries
+	uint32_t mmap_addr;		// physical address of the first
+};
+
+// One memory map entry.  'size' does not count itself, and entries
+// may be larger than this structure.  The types are those of E820.
+struct MultibootMmap {
+	uint32_t size;
+	uint64_t addr;
+	uint64_t len;
+	uint32_t type;
+} __attribute__((packed));
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_MULTIBOOT_H */
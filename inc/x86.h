@@ -34,6 +34,12 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
+static __inline uint64_t rdpmc(uint32_t counter) __attribute__((always_inline));
+static __inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval) __attribute__((always_inline));
+static __inline uint32_t xadd(volatile uint32_t *addr, uint32_t inc) __attribute__((always_inline));
+static __inline uint32_t cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -274,4 +280,63 @@ read_tsc(void)
         return tsc;
 }
 
+static __inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	__asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static __inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static __inline uint64_t
+rdpmc(uint32_t counter)
+{
+	uint64_t val;
+	__asm __volatile("rdpmc" : "=A" (val) : "c" (counter));
+	return val;
+}
+
+static __inline uint32_t
+xchg(volatile uint32_t *addr, uint32_t newval)
+{
+	uint32_t result;
+
+	// The + in "+m" denotes a read-modify-write operand.
+	__asm __volatile("lock; xchgl %0, %1"
+			 : "+m" (*addr), "=a" (result)
+			 : "1" (newval)
+			 : "cc");
+	return result;
+}
+
+// Atomically add 'inc' to *addr, returning the old value.
+static __inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	__asm __volatile("lock; xaddl %0, %1"
+			 : "+r" (inc), "+m" (*addr)
+			 : : "memory", "cc");
+	return inc;
+}
+
+// If *addr is 'oldval', atomically set it to 'newval'.  Returns what
+// *addr held, which is 'oldval' exactly when the swap happened.
+static __inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	__asm __volatile("lock; cmpxchgl %2, %1"
+			 : "=a" (result), "+m" (*addr)
+			 : "r" (newval), "0" (oldval)
+			 : "memory", "cc");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -0,0 +1,68 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/assert.h>
+
+#include <kern/arena.h>
+
+void
+arena_init(struct Arena *a, const char *name, void *base, size_t size)
+{
+	a->a_name = name;
+	a->a_base = a->a_cur = a->a_peak = base;
+	a->a_limit = (char *) base + size;
+}
+
+//
+// Allocate 'size' bytes aligned to 'align' (a power of 2).
+// Returns NULL, leaving the arena unchanged, if it is out of room.
+// With size 0, returns the next aligned address without using it up.
+//
+void *
+arena_alloc(struct Arena *a, size_t size, size_t align)
+{
+	char *p;
+
+	assert(align > 0 && (align & (align - 1)) == 0);
+	p = ROUNDUP(a->a_cur, align);
+	if (p < a->a_cur || p > a->a_limit || size > (size_t) (a->a_limit - p))
+		return NULL;
+	if (size == 0)
+		return p;
+	a->a_cur = p + size;
+	if (a->a_cur > a->a_peak)
+		a->a_peak = a->a_cur;
+	return p;
+}
+
+//
+// Free everything allocated since arena_mark() returned 'mark'.
+//
+void
+arena_release(struct Arena *a, void *mark)
+{
+	if ((char *) mark < a->a_base || (char *) mark > a->a_cur)
+		panic("arena_release: bad mark %08x for arena %s",
+		      mark, a->a_name);
+	a->a_cur = mark;
+}
+
+//
+// Round the arena up to 'align' and forbid further allocation: the
+// rest of the region now belongs to someone else.
+//
+void
+arena_seal(struct Arena *a, size_t align)
+{
+	a->a_cur = ROUNDUP(a->a_cur, align);
+	assert(a->a_cur <= a->a_limit);
+	a->a_limit = a->a_cur;
+}
+
+void
+arena_print(const struct Arena *a)
+{
+	cprintf("%-8s %08x-%08x  used %7u  peak %7u  free %7u\n", a->a_name,
+		a->a_base, a->a_limit, a->a_cur - a->a_base,
+		a->a_peak - a->a_base, a->a_limit - a->a_cur);
+}
@@ -0,0 +1,39 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_ARENA_H
+#define JOS_KERN_ARENA_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// A bump allocator over one contiguous region.  Allocations carry no
+// header and are never freed one by one; instead, take a mark and
+// later release everything allocated since.
+struct Arena {
+	const char *a_name;
+	char *a_base;
+	char *a_cur;			// next free byte
+	char *a_limit;			// end of the region
+	char *a_peak;			// highest a_cur ever reached
+};
+
+#define ARENA_INITIALIZER(name, buf, size) \
+	{ (name), (buf), (buf), (buf) + (size), (buf) }
+
+void arena_init(struct Arena *a, const char *name, void *base, size_t size);
+void *arena_alloc(struct Arena *a, size_t size, size_t align);
+void arena_release(struct Arena *a, void *mark);
+void arena_seal(struct Arena *a, size_t align);
+void arena_print(const struct Arena *a);
+
+// Everything allocated after arena_mark() is freed by passing the
+// mark to arena_release().  Marks nest.
+static inline void *
+arena_mark(const struct Arena *a)
+{
+	return a->a_cur;
+}
+
+#endif /* !JOS_KERN_ARENA_H */
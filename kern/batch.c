@@ -0,0 +1,169 @@
+// Unattended execution of monitor command scripts.
+//
+// A script is either linked into the kernel at build time
+// (make MONSCRIPT=file; run at boot) or pasted after the 'batch'
+// command and terminated by a line reading "end".  Pasted lines are not
+// echoed, command output is buffered and written out in bulk, and each
+// command is timed with the TSC.  A script's state lives in the
+// monitor's scratch arena for as long as it runs.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/batch.h>
+#include <kern/console.h>
+#include <kern/monitor.h>
+#include <kern/arena.h>
+
+struct Batch {
+	int ncmds;
+	char *cmds[BATCH_MAXCMDS];
+	uint64_t cycles[BATCH_MAXCMDS];
+	int rc[BATCH_MAXCMDS];
+	char text[BATCH_SCRIPTSZ];	// the commands, NUL-separated
+	size_t textlen;
+	char line[BATCH_SCRIPTSZ];	// copy of the command being run
+	char out[BATCH_OUTSZ];		// captured output
+};
+
+// Allocate an empty script from the monitor's scratch arena.
+static struct Batch *
+batch_new(void)
+{
+	struct Batch *b;
+
+	if (!(b = arena_alloc(&mon_arena, sizeof(*b), sizeof(uint64_t)))) {
+		cprintf("batch: not enough monitor scratch memory\n");
+		return NULL;
+	}
+	b->ncmds = 0;
+	b->textlen = 0;
+	return b;
+}
+
+// Append one script line, skipping blank lines and '#' comments.
+// Returns -1 if the script is full.
+static int
+batch_add(struct Batch *b, const char *line, size_t len)
+{
+	while (len > 0 && strchr(" \t\r", *line))
+		line++, len--;
+	if (len == 0 || *line == '#')
+		return 0;
+	if (b->ncmds == BATCH_MAXCMDS || b->textlen + len + 1 > BATCH_SCRIPTSZ)
+		return -1;
+	b->cmds[b->ncmds++] = b->text + b->textlen;
+	memmove(b->text + b->textlen, line, len);
+	b->text[b->textlen + len] = 0;
+	b->textlen += len + 1;
+	return 0;
+}
+
+static void
+batch_flush(struct Batch *b, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < MIN(n, (size_t) BATCH_OUTSZ); i++)
+		cputchar(b->out[i]);
+	if (n > BATCH_OUTSZ)
+		cprintf("[batch: %u bytes of output dropped]\n", n - BATCH_OUTSZ);
+}
+
+static void
+batch_run(struct Batch *b, struct Trapframe *tf)
+{
+	size_t used = 0, n;
+	uint64_t t0, total = 0;
+	int i, r = 0;
+
+	for (i = 0; i < b->ncmds && r >= 0; i++) {
+		// Keep at least a little room for the next command's output.
+		if (used > BATCH_OUTSZ - BATCH_OUTSZ / 8) {
+			batch_flush(b, used);
+			used = 0;
+		}
+		// runcmd() splits its argument in place; keep the script intact
+		// for the summary.
+		strcpy(b->line, b->cmds[i]);
+
+		cons_capture_begin(b->out + used, BATCH_OUTSZ - used);
+		t0 = read_tsc();
+		r = runcmd(b->line, tf);
+		b->cycles[i] = read_tsc() - t0;
+		n = cons_capture_end();
+
+		b->rc[i] = r;
+		total += b->cycles[i];
+		if (n > BATCH_OUTSZ - used) {
+			batch_flush(b, used + n);
+			used = 0;
+		} else
+			used += n;
+	}
+	batch_flush(b, used);
+
+	cprintf("batch: %d of %d commands, %llu cycles\n", i, b->ncmds, total);
+	cprintf("%16s  %4s  %s\n", "cycles", "rc", "command");
+	for (n = 0; n < i; n++)
+		cprintf("%16llu  %4d  %s\n", b->cycles[n], b->rc[n],
+			b->cmds[n]);
+}
+
+void
+batch_run_embedded(struct Trapframe *tf)
+{
+	extern char _binary_obj_kern_monscript_start[];
+	extern char _binary_obj_kern_monscript_end[];
+	const char *p = _binary_obj_kern_monscript_start;
+	const char *end = _binary_obj_kern_monscript_end;
+	const char *nl;
+	struct Batch *b;
+	void *mark;
+
+	if (p == end)
+		return;
+	// Also called from i386_init, outside any monitor command.
+	mark = arena_mark(&mon_arena);
+	if (!(b = batch_new()))
+		return;
+	for (; p < end; p = nl + 1) {
+		for (nl = p; nl < end && *nl != '\n'; nl++)
+			/* do nothing */;
+		if (batch_add(b, p, nl - p) < 0) {
+			cprintf("batch: embedded script too long, "
+				"truncated after %d commands\n", b->ncmds);
+			break;
+		}
+	}
+	batch_run(b, tf);
+	arena_release(&mon_arena, mark);
+}
+
+static int
+mon_batch(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Batch *b;
+	char *line;
+	int full = 0;
+
+	if (argc > 1 && strcmp(argv[1], "embedded") == 0) {
+		batch_run_embedded(tf);
+		return 0;
+	}
+
+	if (!(b = batch_new()))
+		return 0;
+	cprintf("batch: paste commands, finish with '%s'\n", BATCH_END);
+	while ((line = readline_noecho(NULL)) != NULL
+	       && strcmp(line, BATCH_END) != 0)
+		if (!full && batch_add(b, line, strlen(line)) < 0) {
+			cprintf("batch: script full after %d commands, "
+				"ignoring the rest\n", b->ncmds);
+			full = 1;
+		}
+	batch_run(b, tf);
+	return 0;
+}
+MONITOR_COMMAND("batch", "Run a pasted script (end with 'end') or 'batch embedded'", mon_batch);
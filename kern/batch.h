@@ -0,0 +1,17 @@
+#ifndef JOS_KERN_BATCH_H
+#define JOS_KERN_BATCH_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#define BATCH_MAXCMDS	128		// commands per script
+#define BATCH_SCRIPTSZ	8192		// bytes of script text
+#define BATCH_OUTSZ	32768		// buffered output before a flush
+#define BATCH_END	"end"		// terminates a pasted script
+
+struct Trapframe;
+
+// Run the script linked into the kernel at build time, if any.
+void batch_run_embedded(struct Trapframe *tf);
+
+#endif	// !JOS_KERN_BATCH_H
@@ -0,0 +1,305 @@
+// Binary monitor: a request/response protocol on COM1 for test
+// harnesses.  See kern/binmon.h for the frame format.
+//
+// Command output is captured into the response instead of being
+// formatted onto the CGA, parallel and serial consoles, which is what
+// makes driving the monitor from a script fast.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+
+#include <kern/binmon.h>
+#include <kern/console.h>
+#include <kern/idle.h>
+#include <kern/monitor.h>
+#include <kern/picirq.h>
+#include <kern/pmu.h>
+
+struct Frame {
+	uint8_t type;
+	uint8_t seq;
+	uint16_t len;
+	uint8_t payload[BM_MAXPAYLOAD];
+};
+
+static struct Frame req, resp;
+
+static uint16_t
+crc16(uint16_t crc, const uint8_t *p, int n)
+{
+	uint8_t x;
+
+	while (n-- > 0) {
+		x = (crc >> 8) ^ *p++;
+		x ^= x >> 4;
+		crc = (crc << 8) ^ ((uint16_t) x << 12) ^ ((uint16_t) x << 5) ^ x;
+	}
+	return crc;
+}
+
+static int
+bm_getc(void)
+{
+	int c;
+
+	// The serial interrupt is masked in binary mode, so poll rather
+	// than halt.
+	while ((c = serial_getc()) < 0)
+		idle();
+	return c;
+}
+
+static void
+bm_send(struct Frame *f)
+{
+	uint8_t hdr[4] = { f->type, f->seq, f->len & 0xFF, f->len >> 8 };
+	uint16_t crc;
+	int i;
+
+	crc = crc16(0xFFFF, hdr, 4);
+	crc = crc16(crc, f->payload, f->len);
+	serial_putc(BM_MAGIC0);
+	serial_putc(BM_MAGIC1);
+	for (i = 0; i < 4; i++)
+		serial_putc(hdr[i]);
+	for (i = 0; i < f->len; i++)
+		serial_putc(f->payload[i]);
+	serial_putc(crc & 0xFF);
+	serial_putc(crc >> 8);
+}
+
+// Receive one frame into 'f'.  Returns 0 on success, -E_INVAL if the
+// frame was malformed (the caller NAKs it).
+static int
+bm_recv(struct Frame *f)
+{
+	uint8_t hdr[4];
+	uint16_t crc;
+	int c, i;
+
+	// Hunt for the start-of-frame marker; this also skips any
+	// stray line noise from a terminal.
+	for (c = bm_getc(); ; ) {
+		if (c != BM_MAGIC0) {
+			c = bm_getc();
+			continue;
+		}
+		if ((c = bm_getc()) == BM_MAGIC1)
+			break;
+	}
+	for (i = 0; i < 4; i++)
+		hdr[i] = bm_getc();
+	f->type = hdr[0];
+	f->seq = hdr[1];
+	f->len = hdr[2] | (hdr[3] << 8);
+	if (f->len > BM_MAXPAYLOAD)
+		return -E_INVAL;
+	for (i = 0; i < f->len; i++)
+		f->payload[i] = bm_getc();
+	crc = bm_getc();
+	crc |= bm_getc() << 8;
+	if (crc != crc16(crc16(0xFFFF, hdr, 4), f->payload, f->len))
+		return -E_INVAL;
+	return 0;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void
+put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void
+bm_error(int err, const char *msg)
+{
+	resp.type = BM_ERROR;
+	put32(resp.payload, err);
+	resp.len = 4 + strlen(msg);
+	memmove(resp.payload + 4, msg, resp.len - 4);
+}
+
+// Copy the command line out of the request payload into a
+// NUL-terminated buffer that runcmd() may chop up.
+static char *
+bm_cmdline(const uint8_t *p, int n)
+{
+	static char line[BM_MAXPAYLOAD + 1];
+
+	memmove(line, p, n);
+	line[n] = 0;
+	return line;
+}
+
+static void
+bm_run(struct Trapframe *tf)
+{
+	char *line = bm_cmdline(req.payload, req.len);
+	size_t n;
+	int r;
+
+	cons_capture_begin((char *) resp.payload + 8, BM_MAXPAYLOAD - 8);
+	r = runcmd(line, tf);
+	n = cons_capture_end();
+	put32(resp.payload, r);
+	put32(resp.payload + 4, n > BM_MAXPAYLOAD - 8 ? BM_RUN_TRUNCATED : 0);
+	resp.len = 8 + MIN(n, (size_t) BM_MAXPAYLOAD - 8);
+}
+
+static void
+bm_perf(struct Trapframe *tf)
+{
+	static char discard[BM_MAXPAYLOAD];
+	char *line = bm_cmdline(req.payload, req.len);
+	struct PmuSample s;
+	int i, r;
+
+	cons_capture_begin(discard, sizeof(discard));
+	pmu_start();
+	r = runcmd(line, tf);
+	pmu_stop(&s);
+	cons_capture_end();
+
+	put32(resp.payload, r);
+	put32(resp.payload + 4, s.ps_valid);
+	put64(resp.payload + 8, s.ps_tsc);
+	for (i = 0; i < PMU_NEVENTS; i++)
+		put64(resp.payload + 16 + 8 * i, s.ps_count[i]);
+	resp.len = 16 + 8 * PMU_NEVENTS;
+}
+
+static void
+bm_backtrace(void)
+{
+	const int framesize = 7 * 4;
+	uint32_t *ebp = (uint32_t *) read_ebp();
+	int i, n = 0;
+
+	while (ebp && 4 + (n + 1) * framesize <= BM_MAXPAYLOAD) {
+		uint8_t *p = resp.payload + 4 + n * framesize;
+		put32(p, ebp[1]);
+		put32(p + 4, (uint32_t) ebp);
+		for (i = 0; i < 5; i++)
+			put32(p + 8 + 4 * i, ebp[2 + i]);
+		n++;
+		ebp = (uint32_t *) ebp[0];
+	}
+	put32(resp.payload, n);
+	resp.len = 4 + n * framesize;
+}
+
+static void
+bm_bench(struct Trapframe *tf)
+{
+	static char discard[BM_MAXPAYLOAD];
+	static char line[BM_MAXPAYLOAD + 1];
+	uint32_t iters, i;
+	uint64_t t0;
+	int r = 0;
+
+	if (req.len < 4) {
+		bm_error(-E_INVAL, "bench: missing iteration count");
+		return;
+	}
+	iters = MIN(get32(req.payload), (uint32_t) (BM_MAXPAYLOAD - 8) / 8);
+	cons_capture_begin(discard, sizeof(discard));
+	for (i = 0; i < iters; i++) {
+		// runcmd() splits the line in place, so start fresh each time.
+		memmove(line, req.payload + 4, req.len - 4);
+		line[req.len - 4] = 0;
+		t0 = read_tsc();
+		r = runcmd(line, tf);
+		put64(resp.payload + 8 + 8 * i, read_tsc() - t0);
+	}
+	cons_capture_end();
+	put32(resp.payload, r);
+	put32(resp.payload + 4, iters);
+	resp.len = 8 + 8 * iters;
+}
+
+void
+binmon(struct Trapframe *tf)
+{
+	resp.type = BM_HELLO;
+	resp.seq = 0;
+	resp.len = 4;
+	put32(resp.payload, BM_VERSION);
+	bm_send(&resp);
+
+	while (1) {
+		if (bm_recv(&req) < 0) {
+			resp.type = BM_NAK;
+			resp.seq = req.seq;
+			resp.len = 0;
+			bm_send(&resp);
+			continue;
+		}
+
+		resp.type = req.type | BM_RESPONSE;
+		resp.seq = req.seq;
+		resp.len = 0;
+		switch (req.type) {
+		case BM_PING:
+			memmove(resp.payload, req.payload, req.len);
+			resp.len = req.len;
+			break;
+		case BM_RUN:
+			bm_run(tf);
+			break;
+		case BM_PERF:
+			bm_perf(tf);
+			break;
+		case BM_BACKTRACE:
+			bm_backtrace();
+			break;
+		case BM_BENCH:
+			bm_bench(tf);
+			break;
+		case BM_EXIT:
+			bm_send(&resp);
+			return;
+		default:
+			bm_error(-E_INVAL, "unknown request type");
+			break;
+		}
+		bm_send(&resp);
+	}
+}
+
+static int
+mon_binmon(int argc, char **argv, struct Trapframe *tf)
+{
+	uint16_t masked;
+
+	if (!serial_exists) {
+		cprintf("binmon: no serial port\n");
+		return 0;
+	}
+	// bm_getc reads COM1 directly; keep the serial interrupt from
+	// stealing bytes into the console buffer meanwhile.
+	masked = irq_mask_8259A & (1 << IRQ_SERIAL);
+	irq_disable(IRQ_SERIAL);
+	binmon(tf);
+	if (!masked)
+		irq_enable(IRQ_SERIAL);
+	return 0;
+}
+MONITOR_COMMAND("binmon", "Switch COM1 to the framed binary protocol (see binmon.py)", mon_binmon);
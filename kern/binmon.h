@@ -0,0 +1,50 @@
+#ifndef JOS_KERN_BINMON_H
+#define JOS_KERN_BINMON_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+// Framed binary monitor protocol, spoken on COM1 after the 'binmon'
+// command.  Every frame, in either direction, looks like this
+// (multi-byte fields are little-endian):
+//
+//	+------+------+------+------+--------+---------------+--------+
+//	| 0xA5 | 0x5A | type | seq  | length | payload ...   | crc16  |
+//	+------+------+------+------+--------+---------------+--------+
+//	   1      1      1      1      2         length          2
+//
+// crc16 is CRC-16/CCITT-FALSE over type, seq, length and payload.
+// A response carries the request's seq and type | BM_RESPONSE.
+// binmon.py in the top-level directory is the host-side client;
+// keep the two in sync.
+
+#define BM_MAGIC0	0xA5
+#define BM_MAGIC1	0x5A
+#define BM_MAXPAYLOAD	4096
+#define BM_VERSION	1
+
+// Request types
+#define BM_PING		0x01	// payload echoed back
+#define BM_RUN		0x02	// payload: command line
+#define BM_PERF		0x03	// payload: command line
+#define BM_BACKTRACE	0x04	// no payload
+#define BM_BENCH	0x05	// payload: u32 iterations, command line
+#define BM_EXIT		0x0F	// leave binary mode
+
+#define BM_RESPONSE	0x80
+#define BM_HELLO	0x80	// sent unprompted on entry: u32 version
+#define BM_NAK		0xFE	// bad frame (CRC, length); resend
+#define BM_ERROR	0xFF	// payload: i32 error code, message
+
+// Response payloads
+//   BM_RUN:       i32 rc, u32 flags, output bytes
+//   BM_PERF:      i32 rc, u32 valid mask, u64 tsc, u64 count[PMU_NEVENTS]
+//   BM_BACKTRACE: u32 n, then n x { u32 eip, u32 ebp, u32 args[5] }
+//   BM_BENCH:     i32 rc, u32 n, then n x u64 TSC cycles
+#define BM_RUN_TRUNCATED	0x1	// output did not fit in the frame
+
+struct Trapframe;
+
+void binmon(struct Trapframe *tf);
+
+#endif	// !JOS_KERN_BINMON_H
@@ -7,6 +7,10 @@
 #include <inc/assert.h>
 
 #include <kern/console.h>
+#include <kern/idle.h>
+#include <kern/picirq.h>
+#include <kern/trap.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -45,7 +49,7 @@ delay(void)
 #define   COM_LSR_TXRDY	0x20	//   Transmit buffer avail
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
-static bool serial_exists;
+bool serial_exists;
 
 static int
 serial_proc_data(void)
@@ -55,6 +59,17 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// Raw, non-blocking read from COM1 that bypasses the console buffer,
+// so binary protocols see every byte (including NULs).
+// Returns -1 if no byte is waiting.
+int
+serial_getc(void)
+{
+	if (!serial_exists)
+		return -1;
+	return serial_proc_data();
+}
+
 void
 serial_intr(void)
 {
@@ -62,7 +77,7 @@ serial_intr(void)
 		cons_intr(serial_proc_data);
 }
 
-static void
+void
 serial_putc(int c)
 {
 	int i;
@@ -75,6 +90,12 @@ serial_putc(int c)
 	outb(COM1 + COM_TX, c);
 }
 
+static void
+serial_irq(struct IrqFrame *f)
+{
+	serial_intr();
+}
+
 static void
 serial_init(void)
 {
@@ -100,6 +121,10 @@ serial_init(void)
 	(void) inb(COM1+COM_IIR);
 	(void) inb(COM1+COM_RX);
 
+	if (serial_exists) {
+		irq_set_fast(IRQ_SERIAL, serial_irq);
+		irq_enable(IRQ_SERIAL);
+	}
 }
 
 
@@ -366,9 +391,20 @@ kbd_intr(void)
 	cons_intr(kbd_proc_data);
 }
 
+static void
+kbd_irq(struct IrqFrame *f)
+{
+	kbd_intr();
+}
+
 static void
 kbd_init(void)
 {
+	// Drain the kbd buffer so that the controller raises an
+	// interrupt for the next key.
+	kbd_intr();
+	irq_set_fast(IRQ_KBD, kbd_irq);
+	irq_enable(IRQ_KBD);
 }
 
 
@@ -386,13 +422,20 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+// Guards 'cons' and the input devices.  Interrupt handlers take it,
+// so it is held with interrupts disabled.
+static struct Spinlock cons_in_lock = SPINLOCK_INITIALIZER("cons_in");
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
 cons_intr(int (*proc)(void))
 {
+	uint32_t eflags = read_eflags();
 	int c;
 
+	__asm __volatile("cli");
+	spin_lock(&cons_in_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -400,28 +443,49 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	spin_unlock(&cons_in_lock);
+	write_eflags(eflags);
 }
 
 // return the next input character from the console, or 0 if none waiting
 int
 cons_getc(void)
 {
-	int c;
-
-	// poll for any pending input characters,
-	// so that this function works even when interrupts are disabled
-	// (e.g., when called from the kernel monitor).
-	serial_intr();
-	kbd_intr();
+	uint32_t eflags = read_eflags();
+	int c = 0;
+
+	// Once interrupts are on, the keyboard and serial interrupts fill
+	// the input buffer.  Poll a device only when its interrupt can't
+	// be delivered, so that this function still works with interrupts
+	// disabled (e.g., before trap_init or in the monitor after a
+	// panic) and the handlers and the poller never race for the
+	// device's data.
+	if (!(eflags & FL_IF) || (irq_mask_8259A & (1 << IRQ_SERIAL)))
+		serial_intr();
+	if (!(eflags & FL_IF) || (irq_mask_8259A & (1 << IRQ_KBD)))
+		kbd_intr();
 
 	// grab the next character from the input buffer.
+	__asm __volatile("cli");
+	spin_lock(&cons_in_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_in_lock);
+	write_eflags(eflags);
+	return c;
+}
+
+// Is there console input waiting, or might input arrive that no
+// interrupt will announce (so the caller must keep polling)?
+static bool
+cons_ready(void *arg)
+{
+	return cons.rpos != cons.wpos
+		|| (serial_exists && (irq_mask_8259A & (1 << IRQ_SERIAL)))
+		|| (irq_mask_8259A & (1 << IRQ_KBD));
 }
 
 // output a character to the console
@@ -446,12 +510,89 @@ cons_init(void)
 }
 
 
+// Output capture: while active, everything written through cputchar
+// goes into the caller's buffer instead of the console devices.
+// Output beyond the end of the buffer is counted but dropped.
+
+static struct {
+	char *buf;
+	size_t size;
+	size_t len;		// may exceed size if output was dropped
+} capture;
+
+void
+cons_capture_begin(char *buf, size_t size)
+{
+	capture.buf = buf;
+	capture.size = size;
+	capture.len = 0;
+}
+
+// Stop capturing and return the number of bytes written, which is
+// larger than the buffer size if output was truncated.
+size_t
+cons_capture_end(void)
+{
+	capture.buf = NULL;
+	return capture.len;
+}
+
+bool
+cons_capturing(void)
+{
+	return capture.buf != NULL;
+}
+
+
 // `High'-level console I/O.  Used by readline and cprintf.
 
+// Guards the output devices (crt_pos and the CGA buffer in particular)
+// and 'capture'.  Interrupt handlers can end up here, through
+// klog_flush(), so it is held with interrupts disabled.
+static struct Spinlock cons_out_lock = SPINLOCK_INITIALIZER("cons_out");
+
 void
 cputchar(int c)
 {
-	cons_putc(c);
+	uint32_t eflags = read_eflags();
+
+	__asm __volatile("cli");
+	spin_lock(&cons_out_lock);
+	if (capture.buf) {
+		if (capture.len < capture.size)
+			capture.buf[capture.len] = c;
+		capture.len++;
+	} else
+		cons_putc(c);
+	spin_unlock(&cons_out_lock);
+	write_eflags(eflags);
+}
+
+// Write 'n' bytes to the console at once.  The kernel log's drainer
+// uses this.  If this CPU already holds the output lock, it faulted or
+// panicked part way through printing, and the kernel log is flushing
+// what it knows before it dies: print anyway, rather than panic again
+// on the lock.
+void
+cons_write(const char *buf, size_t n)
+{
+	uint32_t eflags = read_eflags();
+	bool nested;
+	size_t i;
+
+	__asm __volatile("cli");
+	if (!(nested = spin_holding(&cons_out_lock)))
+		spin_lock(&cons_out_lock);
+	for (i = 0; i < n; i++)
+		if (capture.buf) {
+			if (capture.len < capture.size)
+				capture.buf[capture.len] = buf[i];
+			capture.len++;
+		} else
+			cons_putc(buf[i]);
+	if (!nested)
+		spin_unlock(&cons_out_lock);
+	write_eflags(eflags);
 }
 
 int
@@ -460,7 +601,7 @@ getchar(void)
 	int c;
 
 	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+		idle_wait(cons_ready, NULL);
 	return c;
 }
 
@@ -19,8 +19,19 @@
 
 void cons_init(void);
 int cons_getc(void);
+void cons_write(const char *buf, size_t n);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
 
+// Raw access to COM1, bypassing the CGA and parallel port.
+extern bool serial_exists;
+void serial_putc(int c);
+int serial_getc(void);
+
+// Divert cputchar output into a buffer (see console.c).
+void cons_capture_begin(char *buf, size_t size);
+size_t cons_capture_end(void);
+bool cons_capturing(void);
+
 #endif /* _CONSOLE_H_ */
@@ -0,0 +1,86 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// Maximum number of CPUs
+#define NCPU		8
+
+// Size of a cache line.  Per-CPU data is aligned to this so that
+// CPUs never write to the same line.
+#define CACHELINE	64
+
+// Number of descriptors in each CPU's GDT
+#define NGDT		(GD_CPU / sizeof(struct Segdesc) + 1)
+
+// Values of cpu_status in struct CpuInfo
+enum {
+	CPU_UNUSED = 0,
+	CPU_BOOTING,		// in mp_main(), on its own stack
+	CPU_STARTED,
+	CPU_FAILED,		// did not start in time; held in reset
+};
+
+// Per-CPU state.  Each CPU's %fs selects its own entry (GD_CPU), so
+// cpunum() is one load whichever CPU runs it.
+struct CpuInfo {
+	uint8_t cpu_id;			// Index into cpus[] below; must be first
+	uint8_t cpu_apicid;		// Local APIC ID
+	volatile unsigned cpu_status;	// The status of the CPU
+	uintptr_t cpu_kstacktop;	// Top of the stack the kernel runs on
+	struct Env *cpu_env;		// The currently-running environment.
+	struct Segdesc cpu_gdt[NGDT];	// This CPU's GDT
+	struct Taskstate cpu_ts;	// Used by x86 to find stack for interrupt
+} __attribute__((aligned(CACHELINE)));
+
+// Initialized in mpconfig.c
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;			// Total number of CPUs in the system
+extern struct CpuInfo *bootcpu;		// The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;		// Physical MMIO address of the local APIC
+extern uint8_t cpu_by_apicid[256];	// Local APIC ID -> index into cpus[]
+
+// Initialized in lapic.c; 'lapic' is also how to tell that interrupts
+// go through the APICs rather than the 8259A
+extern volatile uint32_t *lapic;	// NULL when there is no usable APIC
+extern uint32_t lapic_timer_hz;		// LAPIC timer ticks per second
+
+// The current CPU's number, an index into cpus[].  The boot CPU is
+// always 0.  Only valid after gdt_init_percpu() has loaded %fs.
+static inline int
+cpunum(void)
+{
+	uint8_t id;
+
+	__asm __volatile("movb %%fs:%c1, %0"
+	      : "=q" (id) : "i" (offsetof(struct CpuInfo, cpu_id)));
+	return id;
+}
+
+// The current CPU's struct CpuInfo
+#define thiscpu		(&cpus[cpunum()])
+
+// Per-CPU kernel stacks; CPU 0 runs on bootstack instead.
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+void mp_init(void);
+void gdt_init_percpu(struct CpuInfo *c);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, physaddr_t addr);
+void lapic_stopap(uint8_t apicid);
+void lapic_ipi(uint8_t apicid, int vector);
+void lapic_eoi(void);
+void lapic_error(void);
+void lapic_timer_start(unsigned hz);
+void lapic_timer_oneshot(uint32_t count);
+void lapic_timer_stop(void);
+
+#endif /* !JOS_KERN_CPU_H */
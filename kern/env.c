@@ -0,0 +1,487 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/sched.h>
+#include <kern/monitor.h>
+
+struct Env *envs = NULL;		// All environments (set up by mem_init)
+static struct Env *env_free_list;	// Free environment list
+static uint32_t env_nfree;		// Entries on env_free_list
+
+// Guards env_free_list and the allocation of environment IDs.
+static struct Spinlock env_lock = SPINLOCK_INITIALIZER("env");
+
+// The TLB state of each environment's address space, by ENVX.  Kept
+// apart from envs[] because users can read that.
+static struct TlbSpace env_spaces[NENV];
+
+//
+// Converts an envid to an env pointer.
+// If checkperm is set, the specified environment must be either the
+// current environment or an immediate child of the current environment.
+//
+// RETURNS
+//   0 on success, -E_BAD_ENV on error.
+//   On success, sets *env_store to the environment.
+//   On error, sets *env_store to NULL.
+//
+int
+envid2env(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+
+	// If envid is zero, return the current environment.
+	if (envid == 0) {
+		*env_store = curenv;
+		return 0;
+	}
+
+	// Look up the Env structure via the index part of the envid,
+	// then check the env_id field in that struct Env
+	// to ensure that the envid is not stale
+	// (i.e., does not refer to a _previous_ environment
+	// that used the same slot in the envs[] array).
+	e = &envs[ENVX(envid)];
+	if (e->env_status == ENV_FREE || e->env_id != envid) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+
+	// Check that the calling environment has legitimate permission
+	// to manipulate the specified environment.
+	// If checkperm is set, the specified environment
+	// must be either the current environment
+	// or an immediate child of the current environment.
+	if (checkperm && e != curenv
+	    && (!curenv || e->env_parent_id != curenv->env_id)) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+
+	*env_store = e;
+	return 0;
+}
+
+struct TlbSpace *
+env_tlbspace(struct Env *e)
+{
+	return &env_spaces[e - envs];
+}
+
+//
+// Mark all environments in 'envs' as free, set their env_ids to 0,
+// and insert them into the env_free_list, in order, so that the first
+// call to env_alloc() returns envs[0].
+//
+void
+env_init(void)
+{
+	int i;
+
+	static_assert(sizeof(struct Env) % ENV_ALIGN == 0);
+	assert((uintptr_t) envs % ENV_ALIGN == 0);
+
+	env_free_list = NULL;
+	for (i = NENV - 1; i >= 0; i--) {
+		envs[i].env_id = 0;
+		envs[i].env_status = ENV_FREE;
+		envs[i].env_link = env_free_list;
+		env_free_list = &envs[i];
+	}
+	env_nfree = NENV;
+}
+
+//
+// Initialize the kernel virtual memory layout for environment e.
+// Allocate a page directory, set e->env_pgdir accordingly,
+// and initialize the kernel portion of the new environment's address space.
+// Do NOT (yet) map anything into the user portion
+// of the environment's virtual address space.
+//
+// Everything at and above UTOP is the same in every address space, so
+// the new directory points at kern_pgdir's page tables (and 4MB pages)
+// instead of copying them: creating an address space costs one page
+// and a few dozen PDEs.  This relies on the kernel's PDEs being settled
+// before environments exist.  mem_init() and the device setup that
+// follows it create all of them; later kernel mappings only change
+// PTEs in those shared page tables, which every address space sees.
+//
+// Returns 0 on success, < 0 on error.  Errors include:
+//	-E_NO_MEM if page directory or table could not be allocated.
+//
+static int
+env_setup_vm(struct Env *e)
+{
+	struct Page *p;
+	struct TlbSpace *ts;
+
+	// The zero pool usually has a page cleared ahead of time.
+	if (!(p = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	p->pp_ref++;
+	e->env_pgdir = page2kva(p);
+
+	memmove(&e->env_pgdir[PDX(UTOP)], &kern_pgdir[PDX(UTOP)],
+		(NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
+
+	// VPT and UVPT map the env's own page table, with
+	// different permissions.
+	e->env_pgdir[PDX(VPT)] = PADDR(e->env_pgdir) | PTE_W | PTE_P;
+	e->env_pgdir[PDX(UVPT)] = PADDR(e->env_pgdir) | PTE_U | PTE_P;
+
+	ts = env_tlbspace(e);
+	ts->ts_pgdir = PADDR(e->env_pgdir);
+	ts->ts_gen = 0;
+	return 0;
+}
+
+//
+// Allocates and initializes a new environment.
+// On success, the new environment is stored in *newenv_store.
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if all NENV environments are allocated
+//	-E_NO_MEM on memory exhaustion
+//
+int
+env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	int32_t generation;
+	int r;
+	struct Env *e;
+
+	spin_lock(&env_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_lock);
+		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	env_nfree--;
+
+	// Generate an env_id for this environment.  The uniqueifier
+	// counts reuses of the slot, skipping 0 so that no ID is 0 or
+	// negative.
+	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
+	if (generation <= 0)	// Don't create a negative env_id.
+		generation = 1 << ENVGENSHIFT;
+	e->env_id = generation | (e - envs);
+	spin_unlock(&env_lock);
+
+	// Allocate and set up the page directory for this environment.
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		env_nfree++;
+		spin_unlock(&env_lock);
+		return r;
+	}
+
+	// Set the basic status variables.
+	e->env_parent_id = parent_id;
+	e->env_type = ENV_TYPE_USER;
+	e->env_status = ENV_NOT_RUNNABLE;	// until sched_wakeup()
+	e->env_runs = 0;
+	e->env_cpunum = -1;
+	e->env_prio = SCHED_PRIO_DEFAULT;
+	e->env_rqnext = NULL;
+
+	// Clear out all the saved register state,
+	// to prevent the register values
+	// of a prior environment inhabiting this Env structure
+	// from "leaking" into our new environment.
+	memset(&e->env_tf, 0, sizeof(e->env_tf));
+
+	// Set up appropriate initial values for the segment registers.
+	// GD_UD is the user data segment selector in the GDT, and
+	// GD_UT is the user text segment selector (see inc/memlayout.h).
+	// The low 2 bits of each segment register contains the
+	// Requestor Privilege Level (RPL); 3 means user mode.
+	e->env_tf.tf_ds = GD_UD | 3;
+	e->env_tf.tf_es = GD_UD | 3;
+	e->env_tf.tf_ss = GD_UD | 3;
+	e->env_tf.tf_esp = USTACKTOP;
+	e->env_tf.tf_cs = GD_UT | 3;
+	e->env_tf.tf_eflags = FL_IF;
+	// You will set e->env_tf.tf_eip later.
+
+	*newenv_store = e;
+	return 0;
+}
+
+//
+// Frees env e and all memory it uses.
+//
+// A CPU switches back to kern_tlbspace when it stops running an
+// environment, so only this CPU can have e's address space loaded.
+//
+void
+env_free(struct Env *e)
+{
+	pte_t *pt;
+	uint32_t pdeno, pteno;
+	physaddr_t pa;
+
+	// If freeing the current environment, switch to kern_pgdir
+	// before freeing the page directory, just in case the page
+	// gets reused.
+	if (tlb_current() == env_tlbspace(e))
+		tlb_switch(&kern_tlbspace);
+
+	// Flush all mapped pages in the user portion of the address space
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		// only look at mapped page tables
+		if (!(e->env_pgdir[pdeno] & PTE_P))
+			continue;
+
+		// A 4MB page maps raw physical memory; there are no
+		// reference counts to drop.
+		pa = PTE_ADDR(e->env_pgdir[pdeno]);
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			e->env_pgdir[pdeno] = 0;
+			continue;
+		}
+		e->env_pgdir[pdeno] = 0;
+
+		// unmap all PTEs in this page table
+		pt = (pte_t *) KADDR(pa);
+		for (pteno = 0; pteno < NPTENTRIES; pteno++)
+			if (pt[pteno] & PTE_P)
+				page_decref(pa2page(PTE_ADDR(pt[pteno])));
+
+		// free the page table itself
+		page_decref(pa2page(pa));
+	}
+
+	// free the page directory
+	pa = PADDR(e->env_pgdir);
+	e->env_pgdir = 0;
+	page_decref(pa2page(pa));
+
+	// return the environment to the free list
+	spin_lock(&env_lock);
+	e->env_status = ENV_FREE;
+	e->env_link = env_free_list;
+	env_free_list = e;
+	env_nfree++;
+	spin_unlock(&env_lock);
+}
+
+//
+// Frees environment e.
+// If e is running on another CPU, it is only marked ENV_DYING; it
+// is freed the next time it traps to the kernel.  Likewise, one on a
+// run queue is freed when the scheduler takes it off.  Other CPUs
+// change env_status too, so every change here is a cmpxchg.
+//
+void
+env_destroy(struct Env *e)
+{
+	unsigned s;
+
+	for (;;) {
+		s = e->env_status;
+		if (s == ENV_FREE || (s == ENV_DYING && e != curenv))
+			return;
+		if (cmpxchg((volatile uint32_t *) &e->env_status,
+			    s, ENV_DYING) != s)
+			continue;
+		if (e != curenv && (s == ENV_RUNNING || s == ENV_RUNNABLE))
+			return;
+		break;
+	}
+
+	env_free(e);
+
+	if (curenv == e) {
+		curenv = NULL;
+		sched_yield();
+	}
+}
+
+//
+// Restores the register values in the Trapframe with the 'iret' instruction.
+// This exits the kernel and starts executing some environment's code.
+//
+// This function does not return.
+//
+void
+env_pop_tf(struct Trapframe *tf)
+{
+	// No interrupt may arrive between loading the user's %ds and
+	// the iret: the handler would run with it.  iret restores IF.
+	__asm __volatile("cli\n"
+		"\tmovl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tiret"
+		: : "g" (tf) : "memory");
+	panic("iret failed");  /* mostly to placate the compiler */
+}
+
+//
+// Context switch from curenv to env e.
+// The scheduler has already marked e ENV_RUNNING and put whatever ran
+// here before back on a run queue.  Switching to e's address space
+// reloads %cr3 only if this CPU was in another one; global kernel
+// mappings survive either way.
+//
+// This function does not return.
+//
+void
+env_run(struct Env *e)
+{
+	curenv = e;
+	e->env_cpunum = cpunum();
+	e->env_runs++;
+	tlb_switch(env_tlbspace(e));
+	env_pop_tf(&e->env_tf);
+}
+
+
+/***** Monitor commands *****/
+
+static const char *
+env_status_name(unsigned status)
+{
+	static const char * const names[] = {
+		[ENV_FREE]		= "free",
+		[ENV_DYING]		= "dying",
+		[ENV_RUNNABLE]		= "runnable",
+		[ENV_RUNNING]		= "running",
+		[ENV_NOT_RUNNABLE]	= "blocked",
+	};
+
+	if (status < sizeof(names)/sizeof(names[0]))
+		return names[status];
+	return "?";
+}
+
+// There is no program loader yet.  "envs run" gives an environment
+// this endless loop to run instead, which is enough to keep a CPU busy
+// until its time slice ends and so to exercise the scheduler.
+static const uint8_t env_spin_code[] = {
+	0xf3, 0x90,		// 1: pause
+	0xeb, 0xfc,		//    jmp 1b
+};
+
+// Map a fresh zeroed page at 'va' in e's address space, which no CPU
+// has loaded yet.  env_free() undoes it.
+static struct Page *
+env_page_map(struct Env *e, uintptr_t va, int perm)
+{
+	pde_t *pde = &e->env_pgdir[PDX(va)];
+	struct Page *pp;
+
+	if (!(*pde & PTE_P)) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		pp->pp_ref++;
+		*pde = page2pa(pp) | PTE_U | PTE_W | PTE_P;
+	}
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return NULL;
+	pp->pp_ref++;
+	((pte_t *) KADDR(PTE_ADDR(*pde)))[PTX(va)] = page2pa(pp) | perm | PTE_P;
+	return pp;
+}
+
+// Load env_spin_code and a stack into the new environment 'e'.
+static int
+env_load_spin(struct Env *e)
+{
+	struct Page *pp;
+
+	if (!(pp = env_page_map(e, UTEXT, PTE_U)))
+		return -E_NO_MEM;
+	memmove(page2kva(pp), env_spin_code, sizeof(env_spin_code));
+	if (!env_page_map(e, USTACKTOP - PGSIZE, PTE_U | PTE_W))
+		return -E_NO_MEM;
+	e->env_tf.tf_eip = UTEXT;
+	return 0;
+}
+
+static int
+mon_envs(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+	envid_t envid;
+	int r;
+
+	if (argc == 2 && strcmp(argv[1], "new") == 0) {
+		if ((r = env_alloc(&e, 0)) < 0)
+			cprintf("env_alloc: %e\n", r);
+		else
+			cprintf("[%08x] new env\n", e->env_id);
+		return 0;
+	}
+	if (argc == 3 && strcmp(argv[1], "kill") == 0) {
+		envid = strtol(argv[2], NULL, 16);
+		if ((r = envid2env(envid, &e, 0)) < 0)
+			cprintf("%08x: %e\n", envid, r);
+		else
+			env_destroy(e);
+		return 0;
+	}
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "run") == 0) {
+		envid = strtol(argv[2], NULL, 16);
+		if ((r = envid2env(envid, &e, 0)) < 0) {
+			cprintf("%08x: %e\n", envid, r);
+			return 0;
+		}
+		if (e->env_status != ENV_NOT_RUNNABLE) {
+			cprintf("%08x is %s\n", e->env_id,
+				env_status_name(e->env_status));
+			return 0;
+		}
+		if (argc == 4) {
+			r = strtol(argv[3], NULL, 0);
+			if (r < 0 || r >= SCHED_NPRIO) {
+				cprintf("priority must be 0..%d\n",
+					SCHED_NPRIO - 1);
+				return 0;
+			}
+			e->env_prio = r;
+		}
+		if (!e->env_tf.tf_eip && (r = env_load_spin(e)) < 0) {
+			cprintf("%08x: %e\n", e->env_id, r);
+			env_destroy(e);
+			return 0;
+		}
+		if (sched_wakeup(e) < 0)
+			cprintf("no CPU runs environments; boot with CPUS=2 "
+				"or more\n");
+		else
+			cprintf("[%08x] runnable at priority %d\n",
+				e->env_id, e->env_prio);
+		return 0;
+	}
+	if (argc != 1) {
+		cprintf("usage: envs [new | run envid [prio] | kill envid]\n");
+		return 0;
+	}
+
+	cprintf("%-8s %-8s %-8s %4s %6s %3s %8s\n", "env", "parent",
+		"status", "prio", "runs", "cpu", "pgdir");
+	for (e = envs; e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("%08x %08x %-8s %4d %6u %3d %08x\n", e->env_id,
+			e->env_parent_id, env_status_name(e->env_status),
+			e->env_prio, e->env_runs, e->env_cpunum,
+			e->env_pgdir ? PADDR(e->env_pgdir) : 0);
+	}
+	cprintf("%u of %u environments free\n", env_nfree, NENV);
+	return 0;
+}
+MONITOR_COMMAND("envs", "List environments: envs [new | run envid [prio] | kill envid]", mon_envs);
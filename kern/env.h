@@ -0,0 +1,28 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_ENV_H
+#define JOS_KERN_ENV_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+#include <kern/cpu.h>
+#include <kern/tlb.h>
+
+extern struct Env *envs;		// All environments
+#define curenv (thiscpu->cpu_env)	// Current environment
+
+void	env_init(void);
+int	env_alloc(struct Env **e, envid_t parent_id);
+void	env_free(struct Env *e);
+void	env_destroy(struct Env *e);
+
+void	env_run(struct Env *e) __attribute__((noreturn));
+void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
+
+int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+struct TlbSpace *env_tlbspace(struct Env *e);
+
+#endif // !JOS_KERN_ENV_H
@@ -0,0 +1,94 @@
+// Work done while the CPU has nothing better to do, such as while the
+// monitor waits for a keystroke.  Each call does at most one small
+// unit of work so that input latency stays low.
+//
+// When there is no work left, idle_wait() halts the CPU until the next
+// interrupt.  There is no periodic tick (see kern/timer.c), so an idle
+// CPU stays halted until a device interrupts or a timer comes due.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+
+#include <kern/idle.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/timer.h>
+#include <kern/monitor.h>
+
+struct IdleStat {
+	uint64_t is_halted_ns;		// time spent in hlt
+	uint32_t is_halts;		// times we halted
+	uint32_t is_skips;		// times ready() said not to
+} __attribute__((aligned(CACHELINE)));
+
+static struct IdleStat idle_stats[NCPU];
+
+void
+idle(void)
+{
+	if (page_zero_idle())
+		return;
+
+	// Nothing to do.  Be nice to a hyperthread sibling.
+	__asm __volatile("pause");
+}
+
+//
+// Like idle(), but once there is no work left, halt until an interrupt
+// arrives.  'ready' is checked with interrupts disabled, just before
+// halting: if the wakeup it stands for has already happened, we don't
+// halt.  Otherwise "sti; hlt" lets the next interrupt in only once hlt
+// is executing (sti takes effect after the next instruction), so the
+// wakeup can't slip in between the check and the halt.
+//
+// Without interrupts enabled nothing could wake us, so this is the
+// same as idle() then.
+//
+void
+idle_wait(bool (*ready)(void *), void *arg)
+{
+	struct IdleStat *st;
+	uint32_t eflags = read_eflags();
+	uint64_t t0;
+
+	if (page_zero_idle())
+		return;
+	if (!(eflags & FL_IF)) {
+		__asm __volatile("pause");
+		return;
+	}
+
+	__asm __volatile("cli");
+	st = &idle_stats[cpunum()];
+	if (ready(arg)) {
+		st->is_skips++;
+		write_eflags(eflags);
+		return;
+	}
+	st->is_halts++;
+	t0 = timer_ns();
+	__asm __volatile("sti; hlt");
+	st->is_halted_ns += timer_ns() - t0;
+}
+
+
+static int
+mon_idlestat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct IdleStat *st;
+	uint64_t now = timer_ns();
+	int i;
+
+	cprintf("cpu %10s %10s %12s %6s\n", "halts", "skipped", "halted ms",
+		"idle%");
+	for (i = 0; i < ncpu; i++) {
+		st = &idle_stats[i];
+		cprintf("%3d %10u %10u %12llu %5u%%\n", i, st->is_halts,
+			st->is_skips, st->is_halted_ns / NSEC_PER_MSEC,
+			now ? (uint32_t) (st->is_halted_ns * 100 / now) : 0);
+	}
+	return 0;
+}
+MONITOR_COMMAND("idlestat", "Display how long each CPU has spent halted", mon_idlestat);
@@ -0,0 +1,15 @@
+#ifndef JOS_KERN_IDLE_H
+#define JOS_KERN_IDLE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Do a little deferred work while the CPU is waiting for something.
+// Returns quickly so the caller can re-check what it is waiting for.
+void idle(void);
+// Same, but halt until an interrupt unless ready(arg) is already true.
+void idle_wait(bool (*ready)(void *), void *arg);
+
+#endif	// !JOS_KERN_IDLE_H
@@ -3,9 +3,27 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
+#include <kern/pmap.h>
+#include <kern/slab.h>
+#include <kern/trap.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/timer.h>
+#include <kern/pmu.h>
+#include <kern/batch.h>
+#include <kern/tlb.h>
+#include <kern/klog.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+
+// How long boot_aps() waits for each CPU to report in
+#define AP_TIMEOUT_MS	100
+
+static void boot_aps(void);
 
 // Test the stack backtrace function (lab 1 only)
 void
@@ -19,8 +37,9 @@ test_backtrace(int x)
 	cprintf("leaving test_backtrace %d\n", x);
 }
 
+// entry.S passes on what a Multiboot loader left in %eax and %ebx.
 void
-i386_init(void)
+i386_init(uint32_t mbmagic, physaddr_t mbinfo)
 {
 	extern char edata[], end[];
    	// Lab1 only
@@ -31,6 +50,9 @@ i386_init(void)
 	// This ensures that all static/global variables start out zero.
 	memset(edata, 0, end - edata);
 
+	// Load our own GDT, whose %fs segment cpunum() depends on.
+	gdt_init_percpu(&cpus[0]);
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -44,15 +66,112 @@ i386_init(void)
 	cprintf("chnum1: %d\n", chnum1);
 	cprintf("show me the sign: %+d, %+d\n", 1024, -1024);
 
+	// Lab 2 memory management initialization functions.  This must
+	// come before anything reuses the low memory the boot loader
+	// left its memory map in.
+	mem_init(mbmagic, mbinfo);
+	slab_init();
+
+	// Lab 3 user environment initialization functions
+	env_init();
+	sched_init();
+
+	// Interrupt setup.  Every device IRQ starts out masked, so it is
+	// safe to take interrupts from here on.
+	trap_init();
+	mp_init();
+	lapic_init();
+	ioapic_init();
+	pic_init();
+	timer_init();
+	__asm __volatile("sti");
+
+	// Starting non-boot CPUs
+	boot_aps();
+
+	pmu_init();
 
 	// Test the stack backtrace function (lab 1 only)
 	test_backtrace(5);
 
+	// Run the boot-time monitor script, if one was linked in.
+	batch_run_embedded(NULL);
+
 	// Drop into the kernel monitor.
 	while (1)
 		monitor(NULL);
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable, along with the page directory to switch to and the
+// CPU's struct CpuInfo.
+uintptr_t mpentry_kstack;
+physaddr_t mpentry_cr3;
+struct CpuInfo *mpentry_cpu;
+
+// Start the non-boot (AP) processors, one at a time.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct CpuInfo *c;
+	uint64_t t0;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu)  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use, and whose
+		mpentry_kstack = c->cpu_kstacktop;
+		mpentry_cr3 = PADDR(kern_pgdir);
+		mpentry_cpu = c;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_apicid, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main().
+		// If it is not even running mp_main() in time, give up on
+		// it, and stop it before the mpentry variables change under
+		// it: a late start would run on the next CPU's stack.
+		t0 = timer_ns();
+		while (c->cpu_status != CPU_STARTED)
+			if (timer_ns() - t0 > AP_TIMEOUT_MS * NSEC_PER_MSEC
+			    && cmpxchg(&c->cpu_status, CPU_UNUSED,
+				       CPU_FAILED) == CPU_UNUSED) {
+				lapic_stopap(c->cpu_apicid);
+				cprintf("SMP: CPU %d did not start\n",
+					c->cpu_apicid);
+				break;
+			}
+	}
+}
+
+// Setup code for APs
+void
+mp_main(struct CpuInfo *c)
+{
+	gdt_init_percpu(c);
+	// Too late: boot_aps() has given up on this CPU and is about to
+	// hold it in reset.
+	if (cmpxchg(&c->cpu_status, CPU_UNUSED, CPU_BOOTING) != CPU_UNUSED)
+		for (;;)
+			__asm __volatile("cli; hlt");
+	// mpentry.S loaded kern_pgdir; tell the TLB code.
+	tlb_switch(&kern_tlbspace);
+	cprintf("SMP: CPU %d starting\n", cpunum());
+
+	lapic_init();
+	trap_init_percpu();
+	xchg(&c->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Run environments, and idle in the scheduler when there are none.
+	sched_yield();
+}
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
@@ -76,6 +195,10 @@ _panic(const char *file, int line, const char *fmt,...)
 	// Be extra sure that the machine is in as reasonable state
 	__asm __volatile("cli; cld");
 
+	// Get out whatever the CPUs logged before the panic, and print
+	// directly from now on.
+	klog_panic();
+
 	va_start(ap, fmt);
 	cprintf("kernel panic at %s:%d: ", file, line);
 	vcprintf(fmt, ap);
@@ -0,0 +1,153 @@
+/* See COPYRIGHT for copyright information. */
+
+// The I/O APIC routes ISA IRQs to the local APICs, each to a CPU of
+// our choosing.  The rest of the kernel still masks and unmasks IRQs
+// with irq_enable() and friends in picirq.c, which call in here when
+// there is an I/O APIC.
+// See the Intel 82093AA I/O Advanced Programmable Interrupt
+// Controller (IOAPIC) datasheet.
+
+#include <inc/types.h>
+#include <inc/trap.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+#include <kern/monitor.h>
+
+// Registers: select one with IOREGSEL, then access it through IOWIN.
+#define IOREGSEL	(0x00/4)
+#define IOWIN		(0x10/4)
+
+#define IOAPICVER	0x01	// version and number of inputs
+#define IOREDTBL	0x10	// redirection table, two registers per input
+	#define INT_MASKED	0x00010000	// interrupt disabled
+	#define INT_LEVEL	0x00008000	// level-triggered (vs edge)
+	#define INT_ACTIVELOW	0x00002000	// active low (vs high)
+
+volatile uint32_t *ioapic;		// NULL when using the 8259A
+static uint32_t ioapic_maxpin;		// highest input number
+static uint8_t irq_cpu[MAX_IRQS];	// affinity: index into cpus[]
+
+static uint32_t
+ioapic_read(int reg)
+{
+	ioapic[IOREGSEL] = reg;
+	return ioapic[IOWIN];
+}
+
+static void
+ioapic_write(int reg, uint32_t data)
+{
+	ioapic[IOREGSEL] = reg;
+	ioapic[IOWIN] = data;
+}
+
+// Point ISA IRQ 'irq's input at its CPU, with the interrupt masked or
+// not.  IRQ_SLAVE, the 8259A's cascade, means nothing here.
+static void
+ioapic_route(int irq, bool masked)
+{
+	struct IrqRoute *r = &irq_routes[irq];
+	uint32_t lo;
+
+	if (irq == IRQ_SLAVE || r->ir_pin > ioapic_maxpin)
+		return;
+	lo = (IRQ_OFFSET + irq) | (masked ? INT_MASKED : 0)
+		| ((r->ir_flags & IRQ_LEVEL) ? INT_LEVEL : 0)
+		| ((r->ir_flags & IRQ_ACTIVE_LOW) ? INT_ACTIVELOW : 0);
+	// Mask while changing the destination so that the entry is
+	// never half written.
+	ioapic_write(IOREDTBL + 2 * r->ir_pin, INT_MASKED);
+	ioapic_write(IOREDTBL + 2 * r->ir_pin + 1,
+		     cpus[irq_cpu[irq]].cpu_apicid << 24);
+	ioapic_write(IOREDTBL + 2 * r->ir_pin, lo);
+}
+
+void
+ioapic_init(void)
+{
+	uint32_t pin;
+	int irq;
+
+	if (!lapic)
+		return;
+	ioapic = mmio_map_region(ioapicaddr, PGSIZE);
+	ioapic_maxpin = (ioapic_read(IOAPICVER) >> 16) & 0xFF;
+
+	// Mark all inputs masked, with no affinity to any CPU but the
+	// boot CPU.  irq_setmask_8259A() unmasks the ISA IRQs in use.
+	for (pin = 0; pin <= ioapic_maxpin; pin++) {
+		ioapic_write(IOREDTBL + 2 * pin, INT_MASKED);
+		ioapic_write(IOREDTBL + 2 * pin + 1,
+			     bootcpu->cpu_apicid << 24);
+	}
+	for (irq = 0; irq < MAX_IRQS; irq++)
+		irq_cpu[irq] = bootcpu->cpu_id;
+}
+
+// Mask the ISA IRQs set in 'mask' and unmask the others, touching only
+// those whose bit is set in 'changed'.
+void
+ioapic_setmask(uint16_t mask, uint16_t changed)
+{
+	int irq;
+
+	for (irq = 0; irq < MAX_IRQS; irq++)
+		if (changed & (1 << irq))
+			ioapic_route(irq, (mask & (1 << irq)) != 0);
+}
+
+//
+// Deliver IRQ 'irq' to CPU 'cpu' (an index into cpus[]).
+// Returns 0 on success, -E_INVAL if the IRQ or CPU doesn't exist or,
+// with only the 8259A, if 'cpu' is not the boot CPU.
+//
+int
+irq_setaffinity(int irq, int cpu)
+{
+	if (irq < 0 || irq >= MAX_IRQS || cpu < 0 || cpu >= ncpu)
+		return -E_INVAL;
+	if (!ioapic)
+		return cpu == 0 ? 0 : -E_INVAL;
+	irq_cpu[irq] = cpu;
+	ioapic_route(irq, (irq_mask_8259A & (1 << irq)) != 0);
+	return 0;
+}
+
+
+static int
+mon_irqaffinity(int argc, char **argv, struct Trapframe *tf)
+{
+	int irq, r;
+
+	if (argc == 3) {
+		irq = strtol(argv[1], NULL, 0);
+		if ((r = irq_setaffinity(irq, strtol(argv[2], NULL, 0))) < 0)
+			cprintf("irqaffinity: %e\n", r);
+		return 0;
+	}
+	if (argc != 1) {
+		cprintf("usage: irqaffinity [irq cpu]\n");
+		return 0;
+	}
+	if (!ioapic) {
+		cprintf("8259A: all IRQs go to CPU 0\n");
+		return 0;
+	}
+	cprintf("irq  pin  cpu  apic  flags\n");
+	for (irq = 0; irq < MAX_IRQS; irq++) {
+		if (irq == IRQ_SLAVE || (irq_mask_8259A & (1 << irq)))
+			continue;
+		cprintf("%3d %4d %4d %5d  %s %s\n", irq, irq_routes[irq].ir_pin,
+			irq_cpu[irq], cpus[irq_cpu[irq]].cpu_apicid,
+			irq_routes[irq].ir_flags & IRQ_LEVEL ? "level" : "edge",
+			irq_routes[irq].ir_flags & IRQ_ACTIVE_LOW ? "low" : "high");
+	}
+	return 0;
+}
+MONITOR_COMMAND("irqaffinity", "Display or set the CPU that receives each IRQ", mon_irqaffinity);
@@ -0,0 +1,80 @@
+/* See COPYRIGHT for copyright information. */
+
+// The PIT, or each CPU's local APIC timer when there is one, drives
+// IRQ 0.  Nothing ticks unless someone asks for it: the timer stays
+// masked until kclock_start() is called.
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+#include <inc/trap.h>
+
+#include <kern/kclock.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+
+// Interrupt 'hz' times a second on IRQ 0: program PIT counter 0 as a
+// rate generator and unmask IRQ 0, or start this CPU's LAPIC timer.
+void
+kclock_start(unsigned hz)
+{
+	unsigned divisor;
+
+	assert(hz > TIMER_FREQ / 65536 && hz <= TIMER_FREQ);
+	if (lapic) {
+		lapic_timer_start(hz);
+		return;
+	}
+	divisor = (TIMER_FREQ + hz / 2) / hz;
+
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
+	outb(TIMER_CNTR0, divisor % 256);
+	outb(TIMER_CNTR0, divisor / 256);
+	irq_enable(IRQ_TIMER);
+}
+
+// Interrupt once on IRQ 0 after 'count' PIT input clocks (at most
+// 65535), using counter 0 in mode 0.
+void
+kclock_oneshot(uint32_t count)
+{
+	assert(count > 0 && count <= 65535);
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_INTTC | TIMER_16BIT);
+	outb(TIMER_CNTR0, count % 256);
+	outb(TIMER_CNTR0, count / 256);
+	irq_enable(IRQ_TIMER);
+}
+
+void
+kclock_stop(void)
+{
+	if (lapic)
+		lapic_timer_stop();
+	else
+		irq_disable(IRQ_TIMER);
+}
+
+// Busy-wait for 'us' microseconds, at most 54925, on PIT counter 2.
+// Its gate is under software control, so timing with it disturbs
+// neither counter 0 nor anything else.
+void
+pit_delay(unsigned us)
+{
+	unsigned count = us * (TIMER_FREQ / 1000) / 1000;
+
+	assert(count > 0 && count <= 65535);
+	outb(IO_PPI, (inb(IO_PPI) & ~PPI_SPKR) & ~PPI_GATE2);
+	outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+	outb(TIMER_CNTR2, count % 256);
+	outb(TIMER_CNTR2, count / 256);
+	outb(IO_PPI, inb(IO_PPI) | PPI_GATE2);
+	while (!(inb(IO_PPI) & PPI_OUT2))
+		;
+	outb(IO_PPI, inb(IO_PPI) & ~PPI_GATE2);
+}
+
+unsigned
+mc146818_read(unsigned reg)
+{
+	outb(IO_RTC, reg);
+	return inb(IO_RTC+1);
+}
@@ -0,0 +1,54 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KCLOCK_H
+#define JOS_KERN_KCLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+// 8253/8254 programmable interval timer (PIT).
+#define IO_TIMER1	0x040		// 8253 Timer #1
+#define TIMER_FREQ	1193182		// Input clock, in Hz
+
+#define TIMER_CNTR0	(IO_TIMER1 + 0)	// timer 0 counter port
+#define TIMER_CNTR2	(IO_TIMER1 + 2)	// timer 2 counter port
+#define TIMER_MODE	(IO_TIMER1 + 3)	// timer mode port
+#define   TIMER_SEL0	0x00		// select counter 0
+#define   TIMER_SEL2	0x80		// select counter 2
+#define   TIMER_INTTC	0x00		// mode 0, intr on terminal cnt
+#define   TIMER_RATEGEN	0x04		// mode 2, rate generator
+#define   TIMER_16BIT	0x30		// r/w counter 16 bits, LSB first
+
+// Counter 2's gate and output are wired to the keyboard controller's
+// port B, which it shares with the PC speaker.
+#define IO_PPI		0x061		// 8255 port B
+#define   PPI_GATE2	0x01		// counter 2 gate
+#define   PPI_SPKR	0x02		// speaker data enable
+#define   PPI_OUT2	0x20		// counter 2 output (read only)
+
+// MC146818 real-time clock and its CMOS NVRAM.
+#define	IO_RTC		0x070		// RTC port
+
+#define	MC_NVRAM_START	0xe		// start of NVRAM: offset 14
+#define	MC_NVRAM_SIZE	50		// 50 bytes of NVRAM
+
+// NVRAM bytes 7 & 8: base memory size, in KB
+#define NVRAM_BASELO	(MC_NVRAM_START + 7)	// low byte; RTC off. 0x15
+#define NVRAM_BASEHI	(MC_NVRAM_START + 8)	// high byte; RTC off. 0x16
+
+// NVRAM bytes 9 & 10: extended memory size (between 1MB and 16MB), in KB
+#define NVRAM_EXTLO	(MC_NVRAM_START + 9)	// low byte; RTC off. 0x17
+#define NVRAM_EXTHI	(MC_NVRAM_START + 10)	// high byte; RTC off. 0x18
+
+// NVRAM bytes 38 and 39: extended memory above 16MB, in 64KB units
+#define NVRAM_EXT16LO	(MC_NVRAM_START + 38)	// low byte; RTC off. 0x34
+#define NVRAM_EXT16HI	(MC_NVRAM_START + 39)	// high byte; RTC off. 0x35
+
+unsigned mc146818_read(unsigned reg);
+
+void kclock_start(unsigned hz);
+void kclock_stop(void);
+void kclock_oneshot(uint32_t count);
+void pit_delay(unsigned us);
+
+#endif	// !JOS_KERN_KCLOCK_H
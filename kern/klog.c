@@ -0,0 +1,302 @@
+// Per-CPU kernel log rings, drained to the console in timestamp order.
+//
+// A CPU reserves a record by advancing its ring's kc_head, fills it in,
+// then commits it by storing kr_seq.  Interrupts are off while it
+// formats, but a fault in the middle (and then a panic) can still nest
+// a second writer on the same CPU, so the reservation is a cmpxchg;
+// without the lock prefix it is atomic against anything on this CPU
+// and costs no more than an ordinary read-modify-write.  Other CPUs
+// only ever read the ring, except for kc_tail, which only the drainer
+// writes.  x86 keeps stores in order, and loads in order, so a drainer
+// that sees kr_seq also sees the text stored before it, and a writer
+// that sees kc_tail move past a record may reuse it.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/klog.h>
+#include <kern/cpu.h>
+#include <kern/console.h>
+#include <kern/spinlock.h>
+#include <kern/monitor.h>
+
+#define barrier()	__asm __volatile("" : : : "memory")
+
+struct KlogCpu {
+	volatile uint32_t kc_head;	// next index to reserve
+	uint32_t kc_records;		// records committed
+	uint32_t kc_bytes;		// bytes committed
+	uint32_t kc_direct;		// bytes printed directly past a full ring
+	// Written by the drainer
+	volatile uint32_t kc_tail __attribute__((aligned(CACHELINE)));
+	uint32_t kc_lost;		// records a panic flush skipped
+	struct KlogRec kc_recs[KLOG_NREC] __attribute__((aligned(CACHELINE)));
+} __attribute__((aligned(CACHELINE)));
+
+static struct KlogCpu klog_cpus[NCPU];
+
+// One CPU at a time copies records to the console.
+static struct Spinlock klog_lock = SPINLOCK_INITIALIZER("klog");
+// The CPU whose message the drainer is part way through, or NULL.
+// Guarded by klog_lock, or owned by the panicking CPU.
+static struct KlogCpu *klog_cont;
+// Set once a panic flush has begun: from then on only the panicking
+// CPU (cpunum() + 1 here) drains, and it doesn't wait for anything.
+static volatile uint32_t klog_panicking;
+
+// cmpxchg without the lock prefix: atomic only with respect to this
+// CPU, which is all a ring's owner needs.
+static inline uint32_t
+local_cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	__asm __volatile("cmpxchgl %2, %1"
+			 : "=a" (result), "+m" (*addr)
+			 : "r" (newval), "0" (oldval)
+			 : "memory", "cc");
+	return result;
+}
+
+// Reserve the next record in this CPU's ring, or return NULL if the
+// ring is full.
+static struct KlogRec *
+klog_reserve(struct KlogCpu *kc, uint32_t *idx)
+{
+	uint32_t h;
+
+	do {
+		h = kc->kc_head;
+		if (h - kc->kc_tail >= KLOG_NREC)
+			return NULL;
+	} while (local_cmpxchg(&kc->kc_head, h, h + 1) != h);
+	*idx = h;
+	return &kc->kc_recs[h % KLOG_NREC];
+}
+
+static void
+klog_commit(struct KlogWriter *w, bool more)
+{
+	struct KlogCpu *kc = &klog_cpus[cpunum()];
+
+	kc->kc_records++;
+	kc->kc_bytes += w->kw_rec->kr_len;
+	w->kw_rec->kr_more = more;
+	barrier();
+	w->kw_rec->kr_seq = w->kw_idx + 1;
+	w->kw_rec = NULL;
+}
+
+//
+// Start a log message on this CPU.  Interrupts stay off until
+// klog_end(), so that formatting is never interleaved with another
+// message's on the same CPU.
+//
+void
+klog_begin(struct KlogWriter *w)
+{
+	w->kw_eflags = read_eflags();
+	__asm __volatile("cli");
+	w->kw_rec = NULL;
+	w->kw_tsc = read_tsc();
+	w->kw_len = 0;
+}
+
+// This CPU's ring is full and waiting will not empty it: either this
+// CPU is the drainer, or the oldest record is one this CPU reserved and
+// has not committed, because this message is nested inside another.
+static bool
+klog_stuck(struct KlogCpu *kc)
+{
+	uint32_t t = kc->kc_tail;
+
+	return spin_holding(&klog_lock)
+		|| kc->kc_recs[t % KLOG_NREC].kr_seq != t + 1;
+}
+
+void
+klog_putc(struct KlogWriter *w, int c)
+{
+	struct KlogCpu *kc = &klog_cpus[cpunum()];
+	struct KlogRec *r;
+	char ch = c;
+
+	w->kw_len++;
+	if (w->kw_rec && w->kw_rec->kr_len == KLOG_TEXTSZ)
+		klog_commit(w, 1);
+	if (!w->kw_rec) {
+		// Make room by printing, or wait for whoever is.  If
+		// that can't work, print this byte straight away: out of
+		// order, but not lost.
+		while (!(r = klog_reserve(kc, &w->kw_idx))) {
+			if (klog_stuck(kc)) {
+				kc->kc_direct++;
+				cons_write(&ch, 1);
+				return;
+			}
+			klog_flush();
+			__asm __volatile("pause");
+		}
+		r->kr_tsc = w->kw_tsc;
+		r->kr_len = 0;
+		w->kw_rec = r;
+	}
+	r = w->kw_rec;
+	r->kr_text[r->kr_len++] = c;
+}
+
+// Finish the message and restore interrupts.  Returns its length.
+int
+klog_end(struct KlogWriter *w)
+{
+	if (w->kw_rec)
+		klog_commit(w, 0);
+	write_eflags(w->kw_eflags);
+	return w->kw_len;
+}
+
+// The next record to drain from 'kc', or NULL if there is none yet.
+// With 'force', records that were reserved but never committed are
+// skipped rather than waited for.
+static struct KlogRec *
+klog_next(struct KlogCpu *kc, bool force)
+{
+	struct KlogRec *r;
+	uint32_t t;
+
+	while ((t = kc->kc_tail) != kc->kc_head) {
+		r = &kc->kc_recs[t % KLOG_NREC];
+		if (r->kr_seq == t + 1) {
+			barrier();
+			return r;
+		}
+		if (!force)
+			return NULL;
+		kc->kc_lost++;
+		kc->kc_tail = t + 1;
+	}
+	return NULL;
+}
+
+// Copy everything committed so far to the console, oldest first.  A
+// message split over several records is printed whole before anything
+// else; if its next record is not committed yet, draining stops there
+// (unless 'force', which gives up on it).  Stops early if a panic
+// begins on another CPU, which then drains alone.
+static void
+klog_drain(bool force)
+{
+	struct KlogCpu *kc, *best;
+	struct KlogRec *r, *bestr;
+	int i;
+
+	for (;;) {
+		if (klog_panicking && klog_panicking != cpunum() + 1)
+			return;
+		best = klog_cont;
+		bestr = best ? klog_next(best, force) : NULL;
+		if (best && !bestr) {
+			if (!force)
+				return;
+			best = klog_cont = NULL;
+		}
+		for (i = 0; i < NCPU && !klog_cont; i++) {
+			kc = &klog_cpus[i];
+			if ((r = klog_next(kc, force))
+			    && (!bestr || r->kr_tsc < bestr->kr_tsc)) {
+				best = kc;
+				bestr = r;
+			}
+		}
+		if (!best)
+			return;
+		cons_write(bestr->kr_text, bestr->kr_len);
+		klog_cont = bestr->kr_more ? best : NULL;
+		barrier();
+		best->kc_tail++;
+	}
+}
+
+static bool
+klog_pending(void)
+{
+	struct KlogCpu *cont = klog_cont;
+	int i;
+
+	// Nothing else can print until the split message goes on.
+	if (cont)
+		return klog_next(cont, 0) != NULL;
+	// Not just ncpu: the boot CPU logs before mp_init() counts CPUs.
+	for (i = 0; i < NCPU; i++)
+		if (klog_next(&klog_cpus[i], 0))
+			return 1;
+	return 0;
+}
+
+//
+// Print what the rings hold.  If another CPU is already printing,
+// leave it to that CPU: it checks for new records after it lets go of
+// the lock, so nothing committed before this call is left behind.
+//
+void
+klog_flush(void)
+{
+	if (klog_panicking) {
+		if (klog_panicking == cpunum() + 1)
+			klog_drain(1);
+		return;
+	}
+	while (klog_pending()) {
+		if (!spin_trylock(&klog_lock))
+			return;
+		klog_drain(0);
+		spin_unlock(&klog_lock);
+		// Our check for new records must not be done before the
+		// unlock is visible, or a CPU whose trylock just failed
+		// could be missed by both of us.
+		__asm __volatile("mfence" : : : "memory");
+	}
+}
+
+//
+// Print everything in every CPU's ring now, whatever state the other
+// CPUs are in.  Called by panic().  Records that another CPU never
+// finished are skipped.  After this, this CPU's flushes print directly
+// and other CPUs' leave it to this one; a second CPU to panic prints
+// nothing itself.
+//
+void
+klog_panic(void)
+{
+	int i;
+
+	if (cmpxchg(&klog_panicking, 0, cpunum() + 1) != 0
+	    && klog_panicking != cpunum() + 1)
+		return;
+	// Give a CPU that is printing a moment to notice and stop.
+	for (i = 0; i < 1000000 && klog_lock.lk_cpu
+		     && !spin_holding(&klog_lock); i++)
+		__asm __volatile("pause");
+	klog_drain(1);
+}
+
+
+static int
+mon_klogstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct KlogCpu *kc;
+	int i;
+
+	cprintf("cpu %9s %10s %8s %8s %6s\n", "records", "bytes", "direct",
+		"lost", "queued");
+	for (i = 0; i < ncpu; i++) {
+		kc = &klog_cpus[i];
+		cprintf("%3d %9u %10u %8u %8u %6u\n", i, kc->kc_records,
+			kc->kc_bytes, kc->kc_direct, kc->kc_lost,
+			kc->kc_head - kc->kc_tail);
+	}
+	return 0;
+}
+MONITOR_COMMAND("klogstat", "Display per-CPU kernel log statistics", mon_klogstat);
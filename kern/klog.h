@@ -0,0 +1,48 @@
+#ifndef JOS_KERN_KLOG_H
+#define JOS_KERN_KLOG_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/cpu.h>
+
+// The kernel log: everything cprintf() prints goes through it.
+//
+// Each CPU appends records to its own ring with no lock and no bus-
+// locked instruction, so CPUs never wait for each other or for the
+// console to print.  Whoever holds the drain lock copies records to the
+// console in timestamp order.  Timestamps come from read_tsc(), so
+// this assumes the CPUs' TSCs are synchronized.
+
+#define KLOG_NREC	64		// records per CPU; a power of 2
+#define KLOG_TEXTSZ	112		// text bytes per record (128 in all)
+
+// One stretch of output from one cprintf().  Longer output continues
+// in the next record, with the same timestamp, and is printed before
+// anything from another CPU.
+struct KlogRec {
+	volatile uint32_t kr_seq;	// ring index + 1 once committed
+	uint16_t kr_len;
+	bool kr_more;			// the message continues in the next
+	uint64_t kr_tsc;		// when the cprintf() began
+	char kr_text[KLOG_TEXTSZ];
+};
+
+// A cprintf() in progress; see klog_begin().
+struct KlogWriter {
+	struct KlogRec *kw_rec;		// record being filled, if any
+	uint32_t kw_idx;		// its ring index
+	uint64_t kw_tsc;
+	uint32_t kw_eflags;
+	int kw_len;			// bytes written so far
+};
+
+void klog_begin(struct KlogWriter *w);
+void klog_putc(struct KlogWriter *w, int c);
+int klog_end(struct KlogWriter *w);
+void klog_flush(void);
+void klog_panic(void);
+
+#endif	// !JOS_KERN_KLOG_H
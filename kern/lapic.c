@@ -0,0 +1,221 @@
+/* See COPYRIGHT for copyright information. */
+
+// The local APIC manages internal (non-I/O) interrupts and, with an
+// I/O APIC, delivers device interrupts.  Its registers are memory
+// mapped, so an EOI is one store instead of port I/O.
+// See Chapter 10 of Intel Software Developer's Manual, Volume 3A.
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/kclock.h>
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+	#define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+	#define INIT       0x00000500   // INIT/RESET
+	#define STARTUP    0x00000600   // Startup IPI
+	#define DELIVS     0x00001000   // Delivery status
+	#define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+	#define LEVEL      0x00008000   // Level triggered
+	#define BCAST      0x00080000   // Send to all APICs, including self.
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+	#define PERIODIC   0x00020000   // Periodic
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+	#define MASKED     0x00010000   // Interrupt masked
+#define TICR    (0x0380/4)   // Timer Initial Count
+#define TCCR    (0x0390/4)   // Timer Current Count
+#define TDCR    (0x03E0/4)   // Timer Divide Configuration
+	#define TDIV16     0x00000003   // divide bus clock by 16
+
+// How long lapic_init() watches the timer count down to calibrate it
+#define CALIBRATE_US	10000
+
+physaddr_t lapicaddr;        // Initialized in mpconfig.c
+volatile uint32_t *lapic;
+uint32_t lapic_timer_hz;
+
+static void
+lapicw(int index, int value)
+{
+	lapic[index] = value;
+	lapic[ID];  // wait for write to finish, by reading
+}
+
+void
+lapic_init(void)
+{
+	if (!lapicaddr)
+		return;
+
+	// lapicaddr is the physical address of the LAPIC's 4K MMIO
+	// region.  Map it in to virtual memory so we can access it.
+	// Every CPU's LAPIC appears at the same address.
+	if (!lapic)
+		lapic = mmio_map_region(lapicaddr, 4096);
+
+	// Enable local APIC; set spurious interrupt vector.
+	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+
+	// The timer counts down at the bus frequency / 16.  It stays
+	// masked until lapic_timer_start().  Calibrate it against the
+	// PIT once, on the boot CPU; the others run at the same rate.
+	lapicw(TDCR, TDIV16);
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	if (!lapic_timer_hz) {
+		lapicw(TICR, 0xFFFFFFFF);
+		pit_delay(CALIBRATE_US);
+		lapic_timer_hz = (0xFFFFFFFF - lapic[TCCR])
+			* (1000000 / CALIBRATE_US);
+		lapicw(TICR, 0);
+		cprintf("LAPIC timer: %u kHz\n", lapic_timer_hz / 1000);
+	}
+
+	// Device interrupts come from the I/O APIC, so the 8259A's
+	// virtual-wire connection to LINT0 stays off, and so does NMI.
+	lapicw(LINT0, MASKED);
+	lapicw(LINT1, MASKED);
+
+	// Disable performance counter overflow interrupts
+	// on machines that provide that interrupt entry.
+	if (((lapic[VER]>>16) & 0xFF) >= 4)
+		lapicw(PCINT, MASKED);
+
+	// Map error interrupt to IRQ_ERROR.
+	lapicw(ERROR, IRQ_OFFSET + IRQ_ERROR);
+
+	// Clear error status register (requires back-to-back writes).
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+
+	// Ack any outstanding interrupts.
+	lapicw(EOI, 0);
+
+	// Send an Init Level De-Assert to synchronize arbitration ID's.
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, BCAST | INIT | LEVEL);
+	while(lapic[ICRLO] & DELIVS)
+		;
+
+	// Enable interrupts on the APIC (but not on the processor).
+	lapicw(TPR, 0);
+}
+
+// Start additional processor running entry code at addr.
+// See Appendix B of MultiProcessor Specification.
+void
+lapic_startap(uint8_t apicid, physaddr_t addr)
+{
+	int i;
+	uint16_t *wrv;
+
+	// "The BSP must initialize CMOS shutdown code to 0AH
+	// and the warm reset vector (DWORD based at 40:67) to point at
+	// the AP startup code prior to the [universal startup algorithm]."
+	outb(IO_RTC, 0xF);  // offset 0xF is shutdown code
+	outb(IO_RTC+1, 0x0A);
+	wrv = (uint16_t *)KADDR((0x40 << 4 | 0x67));  // Warm reset vector
+	wrv[0] = 0;
+	wrv[1] = addr >> 4;
+
+	// "Universal startup algorithm."
+	// Send INIT (level-triggered) interrupt to reset other CPU.
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	pit_delay(200);
+	lapicw(ICRLO, INIT | LEVEL);
+	pit_delay(10000);	// 10ms, as the MP specification asks
+
+	// Send startup IPI (twice!) to enter code.
+	// Regular hardware is supposed to only accept a STARTUP
+	// when it is in the halted state due to an INIT.  So the second
+	// should be ignored, but it is part of the official Intel algorithm.
+	for (i = 0; i < 2; i++) {
+		lapicw(ICRHI, apicid << 24);
+		lapicw(ICRLO, STARTUP | (addr >> 12));
+		pit_delay(200);
+	}
+}
+
+// Hold the AP 'apicid' in reset: after an INIT it waits for a startup
+// IPI, running nothing.
+void
+lapic_stopap(uint8_t apicid)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	while (lapic[ICRLO] & DELIVS)
+		;
+	pit_delay(200);
+	lapicw(ICRLO, INIT | LEVEL);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Send interrupt 'vector' to the CPU whose local APIC ID is 'apicid'.
+// The two ICR writes must not be split by an interrupt that sends an
+// IPI of its own, so call this with interrupts disabled.
+void
+lapic_ipi(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, vector);		// fixed delivery, edge triggered
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Acknowledge interrupt.
+void
+lapic_eoi(void)
+{
+	if (lapic)
+		lapicw(EOI, 0);
+}
+
+// The local APIC reported an error through IRQ_ERROR.
+void
+lapic_error(void)
+{
+	lapicw(ESR, 0);		// latch the errors into ESR
+	cprintf("CPU %d: LAPIC error, ESR 0x%x\n", cpunum(), lapic[ESR]);
+	lapic_eoi();
+}
+
+// Interrupt this CPU 'hz' times a second on IRQ_TIMER's vector.
+void
+lapic_timer_start(unsigned hz)
+{
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, lapic_timer_hz / hz);
+}
+
+// Interrupt this CPU once, after 'count' timer ticks.
+void
+lapic_timer_oneshot(uint32_t count)
+{
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, count);
+}
+
+void
+lapic_timer_stop(void)
+{
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0);
+}
@@ -10,23 +10,132 @@
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
+#include <kern/prof.h>
+#include <kern/pmu.h>
+#include <kern/pmap.h>
+#include <kern/arena.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
+static char mon_scratch[MON_SCRATCHSZ] __attribute__((aligned(CACHELINE)));
+struct Arena mon_arena = ARENA_INITIALIZER("monitor", mon_scratch, MON_SCRATCHSZ);
 
-struct Command {
-	const char *name;
-	const char *desc;
-	// return -1 to force monitor to exit
-	int (*func)(int argc, char** argv, struct Trapframe* tf);
-};
 
-static struct Command commands[] = {
-	{ "help", "Display this list of commands", mon_help },
-	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
-	{ "time","Display time the function need", mon_time}
-};
-#define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
+/***** Command registry *****/
+
+// Commands are registered with MONITOR_COMMAND(), which drops a
+// struct Command into the .moncmds section.  At boot we index that
+// section twice: a hash table for dispatch and a name-sorted array
+// for 'help'.
+extern const struct Command __moncmds_start[], __moncmds_end[];
+
+#define MAXCMDS		64
+#define CMDHASH_SIZE	(2 * MAXCMDS)	// power of 2, at most half full
+
+// cmd_hash, cmd_sorted and ncmds are only written by monitor_init(),
+// but every CPU's monitor reads them.
+static struct RwLock cmd_lock = RWLOCK_INITIALIZER("moncmds");
+static const struct Command *cmd_hash[CMDHASH_SIZE];
+static const struct Command *cmd_sorted[MAXCMDS];
+static int ncmds;
+
+static uint32_t
+cmd_hashfn(const char *name)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619u;
+	return h;
+}
+
+void
+monitor_init(void)
+{
+	const struct Command *cmd;
+	uint32_t h;
+	int i;
+
+	write_lock(&cmd_lock);
+	memset(cmd_hash, 0, sizeof(cmd_hash));
+	ncmds = 0;
+	for (cmd = __moncmds_start; cmd < __moncmds_end; cmd++) {
+		// The panic monitor needs the lock back.
+		if (ncmds == MAXCMDS) {
+			write_unlock(&cmd_lock);
+			panic("too many monitor commands (max %d)", MAXCMDS);
+		}
+		for (h = cmd_hashfn(cmd->name); cmd_hash[h % CMDHASH_SIZE]; h++)
+			if (strcmp(cmd_hash[h % CMDHASH_SIZE]->name, cmd->name) == 0) {
+				write_unlock(&cmd_lock);
+				panic("monitor command '%s' registered twice",
+				      cmd->name);
+			}
+		cmd_hash[h % CMDHASH_SIZE] = cmd;
+
+		// insertion sort by name
+		for (i = ncmds++; i > 0
+			     && strcmp(cmd_sorted[i-1]->name, cmd->name) > 0; i--)
+			cmd_sorted[i] = cmd_sorted[i-1];
+		cmd_sorted[i] = cmd;
+	}
+	write_unlock(&cmd_lock);
+}
+
+static const struct Command *
+find_command(const char *name)
+{
+	const struct Command *cmd;
+	uint32_t h;
+
+	for (h = cmd_hashfn(name); (cmd = cmd_hash[h % CMDHASH_SIZE]); h++)
+		if (strcmp(cmd->name, name) == 0)
+			return cmd;
+	return NULL;
+}
+
+// Whether 'name' is a command, for wrappers that must know before they
+// start measuring.
+bool
+monitor_has_command(const char *name)
+{
+	const struct Command *cmd;
+
+	if (ncmds == 0)
+		monitor_init();
+	read_lock(&cmd_lock);
+	cmd = find_command(name);
+	read_unlock(&cmd_lock);
+	return cmd != NULL;
+}
+
+// Run an already-parsed command line.  Wrappers such as 'time' and
+// 'perf' call this with their own argv shifted by one.
+int
+monitor_dispatch(int argc, char **argv, struct Trapframe *tf)
+{
+	const struct Command *cmd;
+	void *mark;
+	int r;
+
+	if (ncmds == 0)
+		monitor_init();
+	// Commands are never unregistered, so 'cmd' stays good after
+	// the lock is dropped.
+	read_lock(&cmd_lock);
+	cmd = find_command(argv[0]);
+	read_unlock(&cmd_lock);
+	if (cmd == NULL) {
+		cprintf("Unknown command '%s'\n", argv[0]);
+		return 0;
+	}
+	mark = arena_mark(&mon_arena);
+	r = cmd->func(argc, argv, tf);
+	arena_release(&mon_arena, mark);
+	return r;
+}
 
 unsigned read_eip();
 
@@ -37,10 +146,13 @@ mon_help(int argc, char **argv, struct Trapframe *tf)
 {
 	int i;
 
-	for (i = 0; i < NCOMMANDS; i++)
-		cprintf("%s - %s\n", commands[i].name, commands[i].desc);
+	read_lock(&cmd_lock);
+	for (i = 0; i < ncmds; i++)
+		cprintf("%s - %s\n", cmd_sorted[i]->name, cmd_sorted[i]->desc);
+	read_unlock(&cmd_lock);
 	return 0;
 }
+MONITOR_COMMAND("help", "Display this list of commands", mon_help);
 
 int
 mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
@@ -56,28 +168,94 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 		(end-entry+1023)/1024);
 	return 0;
 }
+MONITOR_COMMAND("kerninfo", "Display information about the kernel", mon_kerninfo);
+
+static int
+mon_arenas(int argc, char **argv, struct Trapframe *tf)
+{
+	arena_print(&boot_arena);
+	arena_print(&mon_arena);
+	return 0;
+}
+MONITOR_COMMAND("arenas", "Display arena allocator usage", mon_arenas);
+
+/***** Wrappers that measure any other command *****/
 
 int
 mon_time(int argc, char **argv, struct Trapframe *tf)
 {
-	char* fn_name = argv[1];
-	int start = 0;
-	int end = 0;
-	if(strcmp(fn_name,"kerninfo") == 0)
-	{
-		start = read_tsc();
-		mon_kerninfo(argc,argv,tf);
-		end = read_tsc();
+	uint64_t start, end;
+	int r;
+
+	if (argc < 2) {
+		cprintf("usage: time <cmd> [args]\n");
+		return 0;
 	}
-	else if(strcmp(fn_name,"help") == 0)
-	{
-		start = read_tsc();
-		mon_help(argc,argv,tf);
-		end = read_tsc();
+	start = read_tsc();
+	r = monitor_dispatch(argc - 1, argv + 1, tf);
+	end = read_tsc();
+	cprintf("%s cycles: %llu\n", argv[1], end - start);
+	return r;
+}
+MONITOR_COMMAND("time", "Display time the function need: time <cmd> [args]", mon_time);
+
+int
+mon_profile(int argc, char **argv, struct Trapframe *tf)
+{
+	long hz;
+	int r;
+
+	if (argc < 2)
+		prof_status();
+	else if (strcmp(argv[1], "start") == 0) {
+		hz = argc > 2 ? strtol(argv[2], NULL, 0) : PROF_HZ;
+		if (hz < 19 || hz > 100000) {
+			cprintf("profile: rate must be between 19 and 100000 Hz\n");
+			return 0;
+		}
+		prof_start(hz);
+	} else if (strcmp(argv[1], "stop") == 0)
+		prof_stop();
+	else if (strcmp(argv[1], "reset") == 0)
+		prof_reset();
+	else if (strcmp(argv[1], "dump") == 0)
+		prof_dump();
+	else {
+		// profile <cmd> [args]: a fresh profile of just that
+		// command.  A mistyped one leaves the last profile alone.
+		if (!monitor_has_command(argv[1])) {
+			cprintf("Unknown command '%s'\n", argv[1]);
+			return 0;
+		}
+		prof_reset();
+		prof_start(PROF_HZ);
+		r = monitor_dispatch(argc - 1, argv + 1, tf);
+		prof_stop();
+		prof_status();
+		prof_dump();
+		return r;
 	}
-	cprintf("kerninfo cycles: %d\n",end-start);
 	return 0;
 }
+MONITOR_COMMAND("profile", "Sample the kernel: profile [start [hz]|stop|reset|dump|<cmd> [args]]", mon_profile);
+
+int
+mon_perf(int argc, char **argv, struct Trapframe *tf)
+{
+	struct PmuSample s;
+	int r;
+
+	if (argc < 2) {
+		pmu_info();
+		return 0;
+	}
+	pmu_start();
+	r = monitor_dispatch(argc - 1, argv + 1, tf);
+	pmu_stop(&s);
+	pmu_print(argv[1], &s);
+	return r;
+}
+MONITOR_COMMAND("perf", "Count hardware events around a command: perf <cmd> [args]", mon_perf);
 
 // Lab1 only
 // read the pointer to the retaddr on the stack
@@ -193,12 +371,11 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 #define WHITESPACE "\t\r\n "
 #define MAXARGS 16
 
-static int
+int
 runcmd(char *buf, struct Trapframe *tf)
 {
 	int argc;
 	char *argv[MAXARGS];
-	int i;
 
 	// Parse the command buffer into whitespace-separated arguments
 	argc = 0;
@@ -224,12 +401,7 @@ runcmd(char *buf, struct Trapframe *tf)
 	// Lookup and invoke the command
 	if (argc == 0)
 		return 0;
-	for (i = 0; i < NCOMMANDS; i++) {
-		if (strcmp(argv[0], commands[i].name) == 0)
-			return commands[i].func(argc, argv, tf);
-	}
-	cprintf("Unknown command '%s'\n", argv[0]);
-	return 0;
+	return monitor_dispatch(argc, argv, tf);
 }
 
 void
@@ -5,16 +5,50 @@
 #endif
 
 struct Trapframe;
+struct Arena;
+
+struct Command {
+	const char *name;
+	const char *desc;
+	// return -1 to force monitor to exit
+	int (*func)(int argc, char** argv, struct Trapframe* tf);
+};
+
+// Register 'func' as the monitor command 'name'.  Works from any kernel
+// source file; the entry is placed in the .moncmds section declared in
+// kern/kernel.ld and picked up by monitor_init().
+#define MONITOR_COMMAND(name, desc, func)				\
+	static const struct Command __moncmd_##func			\
+	__attribute__((__used__, __section__(".moncmds"), __aligned__(4))) \
+		= { name, desc, func }
+
+// Scratch memory for commands, instead of big stack or static
+// buffers: whatever a command allocates from mon_arena is released
+// when it returns.
+#define MON_SCRATCHSZ	(64 * 1024)
+extern struct Arena mon_arena;
+
+// Index the registered commands.  Called on first dispatch.
+void monitor_init(void);
 
 // Activate the kernel monitor,
 // optionally providing a trap frame indicating the current state
 // (NULL if none).
 void monitor(struct Trapframe *tf);
 
+// Split 'buf' into arguments in place and run the command.
+int runcmd(char *buf, struct Trapframe *tf);
+// Whether 'name' is a command.
+bool monitor_has_command(const char *name);
+// Look up argv[0] and run it.
+int monitor_dispatch(int argc, char **argv, struct Trapframe *tf);
+
 // Functions implementing monitor commands.
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_time(int argc, char **argv, struct Trapframe *tf);
+int mon_profile(int argc, char **argv, struct Trapframe *tf);
+int mon_perf(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -0,0 +1,493 @@
+/* See COPYRIGHT for copyright information. */
+
+// Find the CPUs, the local and I/O APICs, and how ISA IRQs are wired
+// to I/O APIC inputs.  The ACPI MADT is preferred; the older Intel
+// MultiProcessor Specification tables are the fallback.  QEMU's PC
+// machine provides both.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+
+struct CpuInfo cpus[NCPU];
+struct CpuInfo *bootcpu;
+int ncpu;
+uint8_t cpu_by_apicid[256];
+
+physaddr_t ioapicaddr;
+uint32_t ioapic_gsibase;
+struct IrqRoute irq_routes[MAX_IRQS];
+
+// Interrupt polarity and trigger mode, as encoded in both MP I/O
+// interrupt entries and MADT interrupt source overrides: 0 means
+// "conforms to the bus", which for ISA is active high, edge triggered.
+#define MPS_POLARITY(f)		((f) & 3)
+#define MPS_TRIGGER(f)		(((f) >> 2) & 3)
+#define MPS_LOW			3
+#define MPS_LEVEL		3
+
+
+/***** Intel MultiProcessor Specification tables *****/
+
+// See MultiProcessor Specification Version 1.[14]
+
+struct mp {             // floating pointer [MP 4.1]
+	uint8_t signature[4];           // "_MP_"
+	physaddr_t physaddr;            // phys addr of MP config table
+	uint8_t length;                 // 1
+	uint8_t specrev;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t type;                   // MP system config type
+	uint8_t imcrp;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct mpconf {         // configuration table header [MP 4.2]
+	uint8_t signature[4];           // "PCMP"
+	uint16_t length;                // total table length
+	uint8_t version;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t product[20];            // product id
+	physaddr_t oemtable;            // OEM table pointer
+	uint16_t oemlength;             // OEM table length
+	uint16_t entry;                 // entry count
+	physaddr_t lapicaddr;           // address of local APIC
+	uint16_t xlength;               // extended table length
+	uint8_t xchecksum;              // extended table checksum
+	uint8_t reserved;
+	uint8_t entries[0];             // table entries
+} __attribute__((__packed__));
+
+struct mpproc {         // processor table entry [MP 4.3.1]
+	uint8_t type;                   // entry type (0)
+	uint8_t apicid;                 // local APIC id
+	uint8_t version;                // local APIC version
+	uint8_t flags;                  // CPU flags
+	uint8_t signature[4];           // CPU signature
+	uint32_t feature;               // feature flags from CPUID instruction
+	uint8_t reserved[8];
+} __attribute__((__packed__));
+
+struct mpbus {          // bus entry [MP 4.3.2]
+	uint8_t type;                   // entry type (1)
+	uint8_t busid;
+	uint8_t bustype[6];             // "ISA   ", "PCI   ", ...
+} __attribute__((__packed__));
+
+struct mpioapic {       // I/O APIC entry [MP 4.3.3]
+	uint8_t type;                   // entry type (2)
+	uint8_t apicid;
+	uint8_t version;
+	uint8_t flags;                  // MPIOAPIC_EN
+	physaddr_t addr;
+} __attribute__((__packed__));
+
+struct mpioint {        // I/O interrupt assignment entry [MP 4.3.4]
+	uint8_t type;                   // entry type (3)
+	uint8_t irqtype;                // MPINT_INT, ...
+	uint16_t flags;                 // polarity and trigger mode
+	uint8_t srcbus;
+	uint8_t srcirq;
+	uint8_t dstapic;
+	uint8_t dstpin;
+} __attribute__((__packed__));
+
+// mpproc flags
+#define MPPROC_EN	0x01		// This processor is usable
+#define MPPROC_BOOT	0x02		// This mpproc is the bootstrap processor
+
+// mpioapic flags
+#define MPIOAPIC_EN	0x01
+
+// mpioint irqtype
+#define MPINT_INT	0x00		// vectored interrupt
+
+// Table entry types
+#define MPPROC		0x00		// One per processor
+#define MPBUS		0x01		// One per bus
+#define MPIOAPIC	0x02		// One per I/O APIC
+#define MPIOINTR	0x03		// One per bus interrupt source
+#define MPLINTR		0x04		// One per system interrupt source
+
+static uint8_t
+sum(void *addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += ((uint8_t *) addr)[i];
+	return sum;
+}
+
+// Return a kernel virtual address for 'len' bytes of firmware table
+// at physical address 'pa'.  Tables beyond the direct map of RAM
+// (ACPI likes the top of memory) get an MMIO mapping.
+static void *
+fw_map(physaddr_t pa, size_t len)
+{
+	if (pa + len <= (physaddr_t) npages * PGSIZE)
+		return KADDR(pa);
+	return mmio_map_region(pa, len);
+}
+
+// Look for an MP structure in the len bytes at physical address addr.
+static struct mp *
+mpsearch1(physaddr_t a, int len)
+{
+	struct mp *mp = KADDR(a), *end = KADDR(a + len);
+
+	for (; mp < end; mp++)
+		if (memcmp(mp->signature, "_MP_", 4) == 0 &&
+		    sum(mp, sizeof(*mp)) == 0)
+			return mp;
+	return NULL;
+}
+
+// Search for the MP Floating Pointer Structure, which according to
+// [MP 4] is in one of the following three locations:
+// 1) in the first KB of the EBDA;
+// 2) if there is no EBDA, in the last KB of system base memory;
+// 3) in the BIOS ROM between 0xE0000 and 0xFFFFF.
+static struct mp *
+mpsearch(void)
+{
+	uint8_t *bda;
+	uint32_t p;
+	struct mp *mp;
+
+	static_assert(sizeof(*mp) == 16);
+
+	// The BIOS data area lives in 16-bit segment 0x40.
+	bda = (uint8_t *) KADDR(0x40 << 4);
+
+	// [MP 4] The 16-bit segment of the EBDA is in the two bytes
+	// starting at byte 0x0E of the BDA.  0 if not present.
+	if ((p = *(uint16_t *) (bda + 0x0E))) {
+		p <<= 4;	// Translate from segment to PA
+		if ((mp = mpsearch1(p, 1024)))
+			return mp;
+	} else {
+		// The size of base memory, in KB is in the two bytes
+		// starting at 0x13 of the BDA.
+		p = *(uint16_t *) (bda + 0x13) * 1024;
+		if ((mp = mpsearch1(p - 1024, 1024)))
+			return mp;
+	}
+	return mpsearch1(0xE0000, 0x20000);
+}
+
+// Search for an MP configuration table.  For now, don't accept the
+// default configurations (physaddr == 0).
+// Check for the correct signature, checksum, and version.
+static struct mpconf *
+mpconfig(struct mp **pmp)
+{
+	struct mpconf *conf;
+	struct mp *mp;
+
+	if ((mp = mpsearch()) == 0)
+		return NULL;
+	if (mp->physaddr == 0 || mp->type != 0) {
+		cprintf("SMP: Default configurations not implemented\n");
+		return NULL;
+	}
+	conf = fw_map(mp->physaddr, sizeof(*conf));
+	if (memcmp(conf, "PCMP", 4) != 0) {
+		cprintf("SMP: Incorrect MP configuration table signature\n");
+		return NULL;
+	}
+	conf = fw_map(mp->physaddr, conf->length);
+	if (sum(conf, conf->length) != 0) {
+		cprintf("SMP: Bad MP configuration checksum\n");
+		return NULL;
+	}
+	if (conf->version != 1 && conf->version != 4) {
+		cprintf("SMP: Unsupported MP version %d\n", conf->version);
+		return NULL;
+	}
+	*pmp = mp;
+	return conf;
+}
+
+
+/***** ACPI *****/
+
+struct rsdp {           // root system description pointer [ACPI 5.2.5]
+	uint8_t signature[8];           // "RSD PTR "
+	uint8_t checksum;               // first 20 bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t revision;
+	physaddr_t rsdtaddr;
+} __attribute__((__packed__));
+
+struct acpihdr {        // system description table header [ACPI 5.2.6]
+	uint8_t signature[4];
+	uint32_t length;                // including this header
+	uint8_t revision;
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t oemtableid[8];
+	uint32_t oemrevision;
+	uint32_t creatorid;
+	uint32_t creatorrevision;
+} __attribute__((__packed__));
+
+struct madt {           // multiple APIC description table [ACPI 5.2.12]
+	struct acpihdr hdr;             // "APIC"
+	physaddr_t lapicaddr;
+	uint32_t flags;
+	uint8_t entries[0];             // type, length, ...
+} __attribute__((__packed__));
+
+struct madtlapic {      // processor local APIC
+	uint8_t type, length;           // 0, 8
+	uint8_t cpuid;
+	uint8_t apicid;
+	uint32_t flags;                 // MADT_EN
+} __attribute__((__packed__));
+
+struct madtioapic {     // I/O APIC
+	uint8_t type, length;           // 1, 12
+	uint8_t apicid;
+	uint8_t reserved;
+	physaddr_t addr;
+	uint32_t gsibase;
+} __attribute__((__packed__));
+
+struct madtiso {        // interrupt source override
+	uint8_t type, length;           // 2, 10
+	uint8_t bus;                    // 0: ISA
+	uint8_t srcirq;
+	uint32_t gsi;
+	uint16_t flags;                 // as in MP I/O interrupt entries
+} __attribute__((__packed__));
+
+#define MADT_LAPIC	0
+#define MADT_IOAPIC	1
+#define MADT_ISO	2
+#define MADT_EN		0x01		// processor is usable
+
+static struct rsdp *
+rsdpsearch1(physaddr_t a, int len)
+{
+	uint8_t *p = KADDR(a), *end = KADDR(a + len);
+
+	// The RSDP is on a 16-byte boundary.
+	for (; p < end; p += 16)
+		if (memcmp(p, "RSD PTR ", 8) == 0 && sum(p, 20) == 0)
+			return (struct rsdp *) p;
+	return NULL;
+}
+
+// Find the MADT through the RSDP, which is in the first KB of the
+// EBDA or in the BIOS ROM between 0xE0000 and 0xFFFFF [ACPI 5.2.5.1].
+static struct madt *
+madtsearch(void)
+{
+	struct rsdp *rsdp;
+	struct acpihdr *rsdt, *h;
+	physaddr_t *tables, p;
+	int i, n;
+
+	p = *(uint16_t *) KADDR(0x40E) << 4;
+	if (!(p && (rsdp = rsdpsearch1(p, 1024)))
+	    && !(rsdp = rsdpsearch1(0xE0000, 0x20000)))
+		return NULL;
+
+	rsdt = fw_map(rsdp->rsdtaddr, sizeof(*rsdt));
+	rsdt = fw_map(rsdp->rsdtaddr, rsdt->length);
+	if (memcmp(rsdt->signature, "RSDT", 4) != 0
+	    || sum(rsdt, rsdt->length) != 0)
+		return NULL;
+	tables = (physaddr_t *) (rsdt + 1);
+	n = (rsdt->length - sizeof(*rsdt)) / sizeof(physaddr_t);
+	for (i = 0; i < n; i++) {
+		h = fw_map(tables[i], sizeof(*h));
+		if (memcmp(h->signature, "APIC", 4) != 0)
+			continue;
+		h = fw_map(tables[i], h->length);
+		if (sum(h, h->length) == 0)
+			return (struct madt *) h;
+	}
+	return NULL;
+}
+
+
+/***** Putting it together *****/
+
+// Record a CPU.  The one we are running on always becomes cpus[0].
+static void
+add_cpu(uint8_t apicid, uint8_t bootid)
+{
+	struct CpuInfo *c;
+
+	if (apicid == bootid) {
+		c = &cpus[0];
+		bootcpu = c;
+	} else if (ncpu < NCPU - (bootcpu == NULL)) {
+		// Leave cpus[0] free for the boot CPU.
+		c = &cpus[ncpu + (bootcpu == NULL)];
+	} else {
+		cprintf("SMP: too many CPUs, CPU %d disabled\n", apicid);
+		return;
+	}
+	c->cpu_apicid = apicid;
+	ncpu++;
+}
+
+// Route ISA IRQ 'irq' to I/O APIC input 'pin'.
+static void
+add_route(int irq, uint32_t pin, uint16_t mpsflags)
+{
+	if (irq >= MAX_IRQS)
+		return;
+	irq_routes[irq].ir_pin = pin;
+	irq_routes[irq].ir_flags =
+		(MPS_POLARITY(mpsflags) == MPS_LOW ? IRQ_ACTIVE_LOW : 0)
+		| (MPS_TRIGGER(mpsflags) == MPS_LEVEL ? IRQ_LEVEL : 0);
+}
+
+static bool
+madt_init(uint8_t bootid)
+{
+	struct madt *madt;
+	struct madtlapic *l;
+	struct madtioapic *io;
+	struct madtiso *iso;
+	uint8_t *p, *e;
+
+	if (!(madt = madtsearch()))
+		return 0;
+	lapicaddr = madt->lapicaddr;
+	e = (uint8_t *) madt + madt->hdr.length;
+	for (p = madt->entries; p + 2 <= e && p[1] >= 2; p += p[1]) {
+		switch (p[0]) {
+		case MADT_LAPIC:
+			l = (struct madtlapic *) p;
+			if (l->flags & MADT_EN)
+				add_cpu(l->apicid, bootid);
+			break;
+		case MADT_IOAPIC:
+			// Use the I/O APIC that ISA IRQs are wired to.
+			io = (struct madtioapic *) p;
+			if (!ioapicaddr || io->gsibase == 0) {
+				ioapicaddr = io->addr;
+				ioapic_gsibase = io->gsibase;
+			}
+			break;
+		case MADT_ISO:
+			iso = (struct madtiso *) p;
+			if (iso->bus == 0)
+				add_route(iso->srcirq,
+					  iso->gsi - ioapic_gsibase, iso->flags);
+			break;
+		}
+	}
+	return 1;
+}
+
+static bool
+mptable_init(uint8_t bootid)
+{
+	struct mp *mp;
+	struct mpconf *conf;
+	struct mpproc *proc;
+	struct mpbus *bus;
+	struct mpioapic *io;
+	struct mpioint *intr;
+	uint8_t *p;
+	uint32_t isabuses = 0;
+	unsigned int i;
+
+	if ((conf = mpconfig(&mp)) == 0)
+		return 0;
+	lapicaddr = conf->lapicaddr;
+
+	for (p = conf->entries, i = 0; i < conf->entry; i++) {
+		switch (*p) {
+		case MPPROC:
+			proc = (struct mpproc *) p;
+			if (proc->flags & MPPROC_EN)
+				add_cpu(proc->apicid, bootid);
+			p += sizeof(struct mpproc);
+			continue;
+		case MPBUS:
+			bus = (struct mpbus *) p;
+			if (memcmp(bus->bustype, "ISA", 3) == 0
+			    && bus->busid < 32)
+				isabuses |= 1 << bus->busid;
+			p += 8;
+			continue;
+		case MPIOAPIC:
+			io = (struct mpioapic *) p;
+			if ((io->flags & MPIOAPIC_EN) && !ioapicaddr)
+				ioapicaddr = io->addr;
+			p += 8;
+			continue;
+		case MPIOINTR:
+			// The entries for ISA IRQs come after the bus entries.
+			intr = (struct mpioint *) p;
+			if (intr->irqtype == MPINT_INT && intr->srcbus < 32
+			    && (isabuses & (1 << intr->srcbus)))
+				add_route(intr->srcirq, intr->dstpin,
+					  intr->flags);
+			p += 8;
+			continue;
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			cprintf("mpinit: unknown config type %x\n", *p);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void
+mp_init(void)
+{
+	struct mp *mp;
+	uint32_t ebx, edx;
+	uint8_t bootid;
+	int i;
+
+	// Until we know better, ISA IRQ n is I/O APIC input n.
+	for (i = 0; i < MAX_IRQS; i++)
+		irq_routes[i].ir_pin = i;
+
+	cpuid(1, NULL, &ebx, NULL, &edx);
+	bootid = ebx >> 24;	// initial local APIC ID of this CPU
+	if (!(edx & (1 << 9)) || !(madt_init(bootid) || mptable_init(bootid))
+	    || !bootcpu || !ioapicaddr) {
+		// Not an APIC system, or one whose ISA IRQs only reach the
+		// 8259A: one CPU, interrupts from the 8259A.
+		ncpu = 1;
+		bootcpu = &cpus[0];
+		lapicaddr = ioapicaddr = 0;
+		cprintf("SMP: no APIC found, using the 8259A\n");
+		return;
+	}
+
+	for (i = 0; i < ncpu; i++) {
+		cpus[i].cpu_id = i;
+		cpu_by_apicid[cpus[i].cpu_apicid] = i;
+	}
+
+	if ((mp = mpsearch()) && mp->imcrp) {
+		// [MP 3.2.6.1] If the hardware implements PIC mode,
+		// switch to getting interrupts from the LAPIC.
+		outb(0x22, 0x70);   // Select IMCR
+		outb(0x23, inb(0x23) | 1);  // Mask external interrupts.
+	}
+	cprintf("SMP: CPU %d found %d CPU(s)\n", bootcpu->cpu_apicid, ncpu);
+}
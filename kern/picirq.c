@@ -0,0 +1,262 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/trap.h>
+
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/monitor.h>
+
+#define PIC_EOI		0x60	// OCW2: specific EOI, OR in the IRQ level
+#define PIC_READ_IRR	0x0a	// OCW3: next read of the command port
+#define PIC_READ_ISR	0x0b	//   returns the IRR or the ISR
+
+// Current IRQ mask, whichever controller delivers the IRQs.
+// Initial IRQ mask has interrupt 2 enabled (for slave 8259A).
+uint16_t irq_mask_8259A = 0xFFFF & ~(1<<IRQ_SLAVE);
+static uint16_t hw_mask;		// what the PICs' mask registers hold
+static uint32_t mask_writes, mask_skips;
+static bool didinit;
+
+// Each CPU counts the interrupts it takes; irqstat adds them up.
+struct IrqCpuStat {
+	struct IrqStat ic_irq[MAX_IRQS];
+} __attribute__((aligned(CACHELINE)));
+
+static struct IrqCpuStat irq_cpustats[NCPU];
+
+static inline struct IrqStat *
+irq_stat(int irq)
+{
+	return &irq_cpustats[cpunum()].ic_irq[irq];
+}
+
+/* Initialize the 8259A interrupt controllers.  With an I/O APIC, they
+ * are remapped like this anyway, so that a stray interrupt can't land
+ * on an exception vector, and then left masked. */
+void
+pic_init(void)
+{
+	didinit = 1;
+
+	// mask all interrupts
+	outb(IO_PIC1+1, 0xFF);
+	outb(IO_PIC2+1, 0xFF);
+	hw_mask = 0xFFFF;
+
+	// Set up master (8259A-1)
+
+	// ICW1:  0001g0hi
+	//    g:  0 = edge triggering, 1 = level triggering
+	//    h:  0 = cascaded PICs, 1 = master only
+	//    i:  0 = no ICW4, 1 = ICW4 required
+	outb(IO_PIC1, 0x11);
+
+	// ICW2:  Vector offset
+	outb(IO_PIC1+1, IRQ_OFFSET);
+
+	// ICW3:  bit mask of IR lines connected to slave PICs (master PIC),
+	//        3-bit No of IR line at which slave connects to master(slave PIC).
+	outb(IO_PIC1+1, 1<<IRQ_SLAVE);
+
+	// ICW4:  000nbmap
+	//    n:  1 = special fully nested mode
+	//    b:  1 = buffered mode
+	//    m:  0 = slave PIC, 1 = master PIC
+	//	  (ignored when b is 0, as the master/slave role
+	//	  can be hardwired).
+	//    a:  1 = Automatic EOI mode
+	//    p:  0 = MCS-80/85 mode, 1 = intel x86 mode
+	// Not automatic EOI: that would clear the in-service bit before
+	// the handler runs, and irq_spurious() needs it.
+	outb(IO_PIC1+1, 0x1);
+
+	// Set up slave (8259A-2)
+	outb(IO_PIC2, 0x11);			// ICW1
+	outb(IO_PIC2+1, IRQ_OFFSET + 8);	// ICW2
+	outb(IO_PIC2+1, IRQ_SLAVE);		// ICW3
+	// NB Automatic EOI mode doesn't tend to work on the slave.
+	// Linux source code says it's "to be investigated".
+	outb(IO_PIC2+1, 0x01);			// ICW4
+
+	// OCW3:  0ef01prs
+	//   ef:  0x = NOP, 10 = clear specific mask, 11 = set specific mask
+	//    p:  0 = no polling, 1 = polling mode
+	//   rs:  0x = NOP, 10 = read IRR, 11 = read ISR
+	outb(IO_PIC1, 0x68);             /* clear specific mask */
+	outb(IO_PIC1, 0x0a);             /* read IRR by default */
+
+	outb(IO_PIC2, 0x68);               /* OCW3 */
+	outb(IO_PIC2, 0x0a);               /* OCW3 */
+
+	if (irq_mask_8259A != 0xFFFF)
+		irq_setmask_8259A(irq_mask_8259A);
+}
+
+// Set the IRQ mask.  Port I/O to the PICs costs a microsecond or so
+// apiece, so only the halves that actually change are written.
+void
+irq_setmask_8259A(uint16_t mask)
+{
+	uint16_t diff;
+
+	irq_mask_8259A = mask;
+	if (!didinit)
+		return;
+	diff = mask ^ hw_mask;
+	if (ioapic) {
+		ioapic_setmask(mask, diff);
+		hw_mask = mask;
+		return;
+	}
+	if (diff & 0x00FF) {
+		outb(IO_PIC1+1, (char)mask);
+		mask_writes++;
+	} else
+		mask_skips++;
+	if (diff & 0xFF00) {
+		outb(IO_PIC2+1, (char)(mask >> 8));
+		mask_writes++;
+	} else
+		mask_skips++;
+	hw_mask = mask;
+}
+
+// Unmask a single IRQ line.
+void
+irq_enable(int irq)
+{
+	assert(irq >= 0 && irq < MAX_IRQS);
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<irq));
+}
+
+// Mask a single IRQ line.
+void
+irq_disable(int irq)
+{
+	assert(irq >= 0 && irq < MAX_IRQS);
+	irq_setmask_8259A(irq_mask_8259A | (1<<irq));
+}
+
+// Return true if IRQ 'irq' is a spurious IRQ 7 or 15: the PIC raised
+// it for a request that went away before it was acknowledged, and did
+// not mark it in service.  The handler must be skipped and, for the
+// slave, only the master's cascade input acknowledged.
+bool
+irq_spurious(int irq)
+{
+	int port = irq < 8 ? IO_PIC1 : IO_PIC2;
+	uint8_t isr;
+
+	if (ioapic) {
+		// The local APIC's own spurious vector, which needs no
+		// EOI.  (ISA IRQ 7 shares it, so is never enabled.)
+		if (irq != IRQ_SPURIOUS)
+			return 0;
+		irq_stat(irq)->is_spurious++;
+		return 1;
+	}
+	if ((irq & 7) != 7)
+		return 0;
+	outb(port, PIC_READ_ISR);
+	isr = inb(port);
+	outb(port, PIC_READ_IRR);
+	if (isr & 0x80)
+		return 0;
+	irq_stat(irq)->is_spurious++;
+	if (irq >= 8)
+		outb(IO_PIC1, PIC_EOI | IRQ_SLAVE);
+	return 1;
+}
+
+// Acknowledge IRQ 'irq': a single store to the local APIC, or specific
+// EOIs to the 8259A, which, unlike the non-specific kind, need not work
+// out which level is in service.
+void
+irq_eoi(int irq)
+{
+	if (ioapic) {
+		lapic_eoi();
+		return;
+	}
+	if (irq >= 8) {
+		outb(IO_PIC2, PIC_EOI | (irq & 7));
+		irq = IRQ_SLAVE;
+	}
+	outb(IO_PIC1, PIC_EOI | irq);
+}
+
+// Charge one interrupt taking 'cycles' cycles to IRQ 'irq', on this
+// CPU.  Interrupts must be off.
+void
+irq_account(int irq, uint64_t cycles)
+{
+	struct IrqStat *st = irq_stat(irq);
+	uint32_t c = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : cycles;
+	int b = (31 - __builtin_clz(c | 1)) - IRQ_HISTSHIFT;
+
+	st->is_count++;
+	st->is_cycles += cycles;
+	st->is_hist[b < 0 ? 0 : b >= IRQ_NHIST ? IRQ_NHIST - 1 : b]++;
+}
+
+
+// Add up every CPU's counts for IRQ 'irq'.
+static void
+irq_stat_sum(int irq, struct IrqStat *sum)
+{
+	struct IrqStat *st;
+	int c, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (c = 0; c < NCPU; c++) {
+		st = &irq_cpustats[c].ic_irq[irq];
+		sum->is_count += st->is_count;
+		sum->is_cycles += st->is_cycles;
+		sum->is_spurious += st->is_spurious;
+		for (i = 0; i < IRQ_NHIST; i++)
+			sum->is_hist[i] += st->is_hist[i];
+	}
+}
+
+static int
+mon_irqstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct IrqStat sum, *st = &sum;
+	char label[8];
+	int irq, i;
+
+	if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+		memset(irq_cpustats, 0, sizeof(irq_cpustats));
+		mask_writes = mask_skips = 0;
+		return 0;
+	}
+	if (ioapic)
+		cprintf("mask %04x  I/O APIC, %d CPU(s)\n", irq_mask_8259A, ncpu);
+	else
+		cprintf("mask %04x  8259A  mask writes %u, skipped %u\n",
+			irq_mask_8259A, mask_writes, mask_skips);
+	cprintf("irq %10s %8s %9s", "count", "spurious", "avg-cyc");
+	for (i = 0; i < IRQ_NHIST; i++) {
+		snprintf(label, sizeof(label), "%s2^%d", i == 0 ? "<" : "",
+			 i + IRQ_HISTSHIFT + (i == 0));
+		cprintf(" %7s", label);
+	}
+	cprintf("\n");
+	for (irq = 0; irq < MAX_IRQS; irq++) {
+		irq_stat_sum(irq, st);
+		if (st->is_count == 0 && st->is_spurious == 0
+		    && (irq_mask_8259A & (1 << irq)))
+			continue;
+		cprintf("%3d %10llu %8u %9llu", irq, st->is_count,
+			st->is_spurious,
+			st->is_count ? st->is_cycles / st->is_count : 0);
+		for (i = 0; i < IRQ_NHIST; i++)
+			cprintf(" %7u", st->is_hist[i]);
+		cprintf("\n");
+	}
+	return 0;
+}
+MONITOR_COMMAND("irqstat", "Display per-IRQ counts and handler cycle histograms [reset]", mon_irqstat);
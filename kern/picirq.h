@@ -0,0 +1,64 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PICIRQ_H
+#define JOS_KERN_PICIRQ_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#define MAX_IRQS	16	// Number of IRQs
+
+// I/O Addresses of the two 8259A programmable interrupt controllers
+#define IO_PIC1		0x20	// Master (IRQs 0-7)
+#define IO_PIC2		0xA0	// Slave (IRQs 8-15)
+
+#define IRQ_SLAVE	2	// IRQ at which slave connects to master
+
+// Handler cycle histograms: bucket i counts handlers that took
+// [2^(i+IRQ_HISTSHIFT), 2^(i+IRQ_HISTSHIFT+1)) cycles; the first and
+// last buckets also take everything below and above.
+#define IRQ_NHIST	12
+#define IRQ_HISTSHIFT	7
+
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+#include <inc/x86.h>
+
+struct IrqStat {
+	uint64_t is_count;		// handled interrupts
+	uint64_t is_cycles;		// total cycles in handlers
+	uint32_t is_spurious;		// spurious IRQ 7/15s
+	uint32_t is_hist[IRQ_NHIST];
+};
+
+// Where an ISA IRQ enters the I/O APIC, from mp_init() (kern/mpconfig.c)
+struct IrqRoute {
+	uint8_t ir_pin;			// I/O APIC input
+	uint8_t ir_flags;		// IRQ_ACTIVE_LOW, IRQ_LEVEL
+};
+
+#define IRQ_ACTIVE_LOW	0x01
+#define IRQ_LEVEL	0x02
+
+extern uint16_t irq_mask_8259A;
+extern struct IrqRoute irq_routes[MAX_IRQS];
+extern physaddr_t ioapicaddr;
+extern uint32_t ioapic_gsibase;
+extern volatile uint32_t *ioapic;
+
+void pic_init(void);
+void irq_setmask_8259A(uint16_t mask);
+void irq_enable(int irq);
+void irq_disable(int irq);
+bool irq_spurious(int irq);
+void irq_eoi(int irq);
+void irq_account(int irq, uint64_t cycles);
+int irq_setaffinity(int irq, int cpu);
+
+void ioapic_init(void);
+void ioapic_setmask(uint16_t mask, uint16_t changed);
+#endif // !__ASSEMBLER__
+
+#endif // !JOS_KERN_PICIRQ_H
@@ -0,0 +1,1194 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+#include <inc/multiboot.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kclock.h>
+#include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/tlb.h>
+#include <kern/spinlock.h>
+
+// These variables are set by i386_detect_memory()
+size_t npages;			// Amount of physical memory (in pages)
+size_t npages_basemem;		// Amount of base memory (in pages)
+struct E820Map phys_map;	// Where that memory is
+static const char *phys_map_source;
+
+// These variables are set in mem_init()
+pde_t *kern_pgdir;		// Kernel's initial page directory
+struct Page *pages;		// Physical page state array
+struct Arena boot_arena;	// Allocate-once memory before page_init()
+
+// Kernel stacks of the CPUs other than the boot CPU, which runs on
+// bootstack.  mem_init_mp() maps each below KSTACKTOP.
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+__attribute__ ((aligned(PGSIZE)));
+
+// Buddy allocator free lists: free_area[o] holds free blocks of 2^o
+// contiguous, naturally aligned pages.  buddy_lock guards them and
+// buddy_stats.  Every CPU's page cache refills from and drains to
+// them, so it is a queued lock; take it with interrupts disabled.
+static struct McsLock buddy_lock = MCSLOCK_INITIALIZER("buddy");
+static struct {
+	struct Page_list free_list;
+	size_t nfree;		// blocks on free_list
+} free_area[PAGE_MAXORDER + 1];
+
+static struct {
+	uint32_t nalloc;	// successful allocations
+	uint32_t nfail;		// allocations that found no block
+	uint32_t nsplit;	// blocks split in two on allocation
+	uint32_t nmerge;	// buddies coalesced on free
+} buddy_stats;
+
+// Per-CPU page caches.  Single pages are allocated and freed through
+// a magazine owned by the current CPU, which refills from and drains to
+// the buddy lists PCP_BATCH pages at a time.  pc_pages is ordered from
+// coldest ([0]) to hottest ([pc_count-1]): frees push on the hot end,
+// refills and drains use the cold end.  Only interrupts need to be
+// kept out of a CPU's own cache.
+#define PCP_HIGH	64	// drain when a cache holds this many
+#define PCP_BATCH	16	// pages moved per refill or drain
+
+struct PageCache {
+	struct Page *pc_pages[PCP_HIGH];
+	int pc_count;
+	uint32_t pc_alloc;	// allocations served
+	uint32_t pc_free;	// frees taken
+	uint32_t pc_refill;	// batches pulled from the buddy lists
+	uint32_t pc_drain;	// batches returned to the buddy lists
+	uint32_t pc_remote;	// frees of pages another CPU allocated
+} __attribute__((aligned(CACHELINE)));
+
+static struct PageCache page_caches[NCPU];
+
+// Pages zeroed ahead of time by the idle loop, for ALLOC_ZERO.  They
+// are zeroed with non-temporal stores when the CPU has them, so
+// filling the pool does not evict anything useful from the cache.
+#define ZPOOL_TARGET	64	// pages the idle loop keeps zeroed
+
+static struct {
+	struct Spinlock lock;
+	struct Page_list pages;
+	size_t count;
+	uint32_t hits;		// ALLOC_ZERO served from the pool
+	uint32_t misses;	// ALLOC_ZERO that found the pool empty
+	uint32_t zeroed;	// pages zeroed at idle time
+} zero_pool = { SPINLOCK_INITIALIZER("zero_pool") };
+static bool cpu_has_movnti;
+
+static void zero_pool_drain(void);
+static void check_page_alloc(void);
+static void check_map_range(void);
+static void mem_init_mp(void);
+
+
+// --------------------------------------------------------------
+// Detect machine's physical memory setup.
+// --------------------------------------------------------------
+
+// Low physical memory is still reachable through entry_pgdir's direct
+// map, so the boot-time tables can be read in place.
+#define BOOTPTR(pa)	((void *) (KERNBASE + (pa)))
+
+static void
+phys_map_add(uint64_t addr, uint64_t len, uint32_t type)
+{
+	if (len == 0)
+		return;
+	if (phys_map.count == E820_MAX) {
+		cprintf("memory map: too many entries, dropping %llx+%llx\n",
+			addr, len);
+		return;
+	}
+	phys_map.entries[phys_map.count].addr = addr;
+	phys_map.entries[phys_map.count].len = len;
+	phys_map.entries[phys_map.count].type = type;
+	phys_map.count++;
+}
+
+// Use the map a Multiboot loader passed in, if any.  Falls back to its
+// mem_lower/mem_upper sizes if it has no full map.
+static bool
+multiboot_detect(uint32_t mbmagic, physaddr_t mbinfo)
+{
+	struct MultibootInfo *mbi;
+	struct MultibootMmap *mm;
+	physaddr_t pa;
+
+	if (mbmagic != MULTIBOOT_BOOTLOADER_MAGIC || mbinfo >= MAXPHYSMEM)
+		return 0;
+	mbi = BOOTPTR(mbinfo);
+
+	if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+		for (pa = mbi->mmap_addr;
+		     pa < mbi->mmap_addr + mbi->mmap_length;
+		     pa += mm->size + sizeof(mm->size)) {
+			mm = BOOTPTR(pa);
+			phys_map_add(mm->addr, mm->len, mm->type);
+		}
+	} else if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+		phys_map_add(0, mbi->mem_lower * 1024, E820_RAM);
+		phys_map_add(EXTPHYSMEM, mbi->mem_upper * 1024, E820_RAM);
+	}
+	return phys_map.count > 0;
+}
+
+// Use the map boot/boot.S collected with INT 15h, AX=E820h.
+static bool
+e820_detect(void)
+{
+	struct E820Map *bootmap = BOOTPTR(BOOT_E820);
+	uint32_t i;
+
+	if (bootmap->signature != E820_SMAP || bootmap->count > E820_MAX)
+		return 0;
+	for (i = 0; i < bootmap->count; i++)
+		phys_map_add(bootmap->entries[i].addr,
+			     bootmap->entries[i].len,
+			     bootmap->entries[i].type);
+	return phys_map.count > 0;
+}
+
+static int
+nvram_read(int r)
+{
+	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
+}
+
+// Last resort: the sizes recorded in the CMOS NVRAM.
+static void
+nvram_detect(void)
+{
+	size_t basemem, extmem, ext16mem;
+
+	// Use CMOS calls to measure available base & extended memory.
+	// (CMOS calls return results in kilobytes.)
+	basemem = nvram_read(NVRAM_BASELO);
+	extmem = nvram_read(NVRAM_EXTLO);
+	ext16mem = nvram_read(NVRAM_EXT16LO) * 64;
+
+	// Above 16MB the 1MB-16MB count saturates; use the 64K count.
+	if (ext16mem)
+		extmem = 16 * 1024 + ext16mem - 1024;
+
+	phys_map_add(0, basemem * 1024, E820_RAM);
+	phys_map_add(EXTPHYSMEM, extmem * 1024, E820_RAM);
+}
+
+void
+i386_detect_memory(uint32_t mbmagic, physaddr_t mbinfo)
+{
+	struct E820Entry *e, tmp;
+	uint64_t top, totalmem = 0;
+	uint32_t i, j;
+
+	memset(&phys_map, 0, sizeof(phys_map));
+	if (multiboot_detect(mbmagic, mbinfo))
+		phys_map_source = "multiboot";
+	else if (e820_detect())
+		phys_map_source = "BIOS E820";
+	else {
+		nvram_detect();
+		phys_map_source = "CMOS";
+	}
+	phys_map.signature = E820_SMAP;
+
+	// Firmware need not return the map in address order.
+	for (i = 1; i < phys_map.count; i++) {
+		tmp = phys_map.entries[i];
+		for (j = i; j > 0 && phys_map.entries[j-1].addr > tmp.addr; j--)
+			phys_map.entries[j] = phys_map.entries[j-1];
+		phys_map.entries[j] = tmp;
+	}
+
+	// npages covers up to the end of the highest usable RAM that
+	// the direct map can reach; holes below it stay out of the
+	// allocator because the map says they are not RAM.
+	npages = npages_basemem = 0;
+	for (i = 0; i < phys_map.count; i++) {
+		e = &phys_map.entries[i];
+		if (e->type != E820_RAM || e->addr >= MAXPHYSMEM)
+			continue;
+		top = MIN(e->addr + e->len, (uint64_t) MAXPHYSMEM);
+		totalmem += top - e->addr;
+		npages = MAX(npages, (size_t) (top / PGSIZE));
+		if (e->addr == 0)
+			npages_basemem = MIN(top, (uint64_t) IOPHYSMEM) / PGSIZE;
+	}
+	if (npages == 0)
+		panic("i386_detect_memory: no usable memory");
+
+	cprintf("Physical memory: %lluK available, base = %uK, top = %uK (%s)\n",
+		totalmem / 1024, npages_basemem * PGSIZE / 1024,
+		npages * PGSIZE / 1024, phys_map_source);
+}
+
+
+// --------------------------------------------------------------
+// Set up memory management.
+// --------------------------------------------------------------
+
+// This simple physical memory allocator is used only while JOS is setting
+// up its virtual memory system.  page_alloc() is the real allocator.
+//
+// If n>0, allocates enough pages of contiguous physical memory to hold 'n'
+// bytes.  Doesn't initialize the memory.  Returns a kernel virtual address.
+//
+// If n==0, returns the address of the next free page without allocating
+// anything.
+//
+// If we're out of memory, boot_alloc should panic.
+// This function may ONLY be used during initialization,
+// before the free page list has been set up.
+//
+// Smaller allocate-once structures can be packed into boot_arena
+// directly with arena_alloc().
+static void *
+boot_alloc(uint32_t n)
+{
+	void *result;
+
+	if (!(result = arena_alloc(&boot_arena, ROUNDUP(n, PGSIZE), PGSIZE)))
+		panic("boot_alloc: out of memory");
+	return result;
+}
+
+// Set up the physical page allocator.
+//
+// From UTOP to ULIM, the user is allowed to read but not write.
+// Above ULIM the user cannot read or write.
+void
+mem_init(uint32_t mbmagic, physaddr_t mbinfo)
+{
+	extern char end[];
+	extern pde_t entry_pgdir[];
+	struct Page *pp;
+	physaddr_t maptop;
+	uint32_t edx;
+
+	// Find out how much memory the machine has (npages & npages_basemem).
+	i386_detect_memory(mbmagic, mbinfo);
+
+	// Boot-time memory runs from 'end', a magic symbol the linker
+	// puts after the kernel's bss segment -- the first virtual
+	// address that the linker did *not* assign to any kernel code or
+	// global variables -- to the end of physical memory.
+	if (PADDR(end) >= npages * PGSIZE)
+		panic("mem_init: the kernel does not fit in memory");
+	arena_init(&boot_arena, "boot", end,
+		   npages * PGSIZE - PADDR(end));
+
+	// Allocate an array of npages 'struct Page's and store it in
+	// 'pages'.  The kernel uses this array to keep track of physical
+	// pages: for each physical page, there is a corresponding
+	// struct Page in this array.
+	pages = boot_alloc(npages * sizeof(struct Page));
+	memset(pages, 0, npages * sizeof(struct Page));
+
+	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
+	// boot_alloc() hands out whole pages, so each entry keeps to its
+	// own cache lines.
+	envs = boot_alloc(NENV * sizeof(struct Env));
+	memset(envs, 0, NENV * sizeof(struct Env));
+
+	// MOVNTI came with SSE2.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	cpu_has_movnti = (edx >> 26) & 1;
+	LIST_INIT(&zero_pool.pages);
+
+	// Now that we've allocated the initial kernel data structures,
+	// we set up the buddy free lists.  Once that's done, all further
+	// memory management will go through the page_* functions.
+	page_init();
+
+	check_page_alloc();
+
+	//////////////////////////////////////////////////////////////////////
+	// create initial page directory.
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no page for kern_pgdir");
+	pp->pp_ref++;
+	kern_pgdir = page2kva(pp);
+
+	//////////////////////////////////////////////////////////////////////
+	// Recursively insert PD in itself as a page table, to form
+	// a virtual page table at virtual address VPT.
+	// (For now, you don't have understand the greater purpose of the
+	// following two lines.)
+
+	// Permissions: kernel RW, user NONE
+	kern_pgdir[PDX(VPT)] = PADDR(kern_pgdir) | PTE_W | PTE_P;
+
+	// same for UVPT
+	// Permissions: kernel R, user R
+	kern_pgdir[PDX(UVPT)] = PADDR(kern_pgdir) | PTE_U | PTE_P;
+
+	// Start from entry_pgdir's direct map of [KERNBASE, 4GB) so that
+	// we can switch over, then edit it in place through vpd/vpt.
+	memmove(&kern_pgdir[PDX(KERNBASE)], &entry_pgdir[PDX(KERNBASE)],
+		(NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
+	kern_tlbspace.ts_pgdir = PADDR(kern_pgdir);
+	tlb_switch(&kern_tlbspace);
+
+	// Only map the physical memory that exists, so that stray
+	// pointers past it fault instead of reading nothing.
+	maptop = ROUNDUP(npages * PGSIZE, PTSIZE);
+	if (maptop < MAXPHYSMEM)
+		unmap_range(KERNBASE + maptop, MAXPHYSMEM - maptop);
+
+	// Map the 'envs' array read-only by the user at linear address
+	// UENVS.  It is the same in every address space, so it is global.
+	if (map_range(UENVS, PADDR(envs),
+		      ROUNDUP(NENV * sizeof(struct Env), PGSIZE),
+		      PTE_U | PTE_G) < 0)
+		panic("mem_init: out of memory mapping envs");
+
+	// Map the kernel stacks.
+	mem_init_mp();
+
+	check_map_range();
+}
+
+// Map the per-CPU kernel stacks in [KSTACKTOP-PTSIZE, KSTACKTOP).
+//
+// Each CPU's stack is KSTKSIZE bytes, and is followed by KSTKGAP bytes
+// of unmapped guard, so that overflowing one faults instead of
+// silently overwriting the next.  CPU 0's stack is bootstack, which it
+// keeps running on at its KERNBASE address; the other CPUs run on
+// their stack's address here, as set up by boot_aps().
+static void
+mem_init_mp(void)
+{
+	uintptr_t kstacktop_i;
+	physaddr_t pa;
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+		pa = i == 0 ? PADDR(bootstack) : PADDR(percpu_kstacks[i]);
+		if (map_range(kstacktop_i - KSTKSIZE, pa, KSTKSIZE,
+			      PTE_W | PTE_G) < 0)
+			panic("mem_init_mp: out of memory");
+		cpus[i].cpu_kstacktop =
+			i == 0 ? (uintptr_t) bootstacktop : kstacktop_i;
+	}
+}
+
+// --------------------------------------------------------------
+// Tracking of physical pages.
+// The 'pages' array has one 'struct Page' entry per physical page.
+// Free pages are kept by the buddy allocator in free_area.
+// --------------------------------------------------------------
+
+// Is physical page 'ppn' RAM according to the memory map?
+static bool
+page_is_ram(ppn_t ppn)
+{
+	uint64_t pa = (uint64_t) ppn * PGSIZE;
+	struct E820Entry *e;
+	uint32_t i;
+
+	for (i = 0; i < phys_map.count; i++) {
+		e = &phys_map.entries[i];
+		if (e->type == E820_RAM && e->addr <= pa
+		    && pa + PGSIZE <= e->addr + e->len)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+free_area_add(struct Page *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	LIST_INSERT_HEAD(&free_area[order].free_list, pp, pp_link);
+	free_area[order].nfree++;
+}
+
+static void
+free_area_remove(struct Page *pp, int order)
+{
+	LIST_REMOVE(pp, pp_link);
+	pp->pp_flags &= ~PP_FREE;
+	free_area[order].nfree--;
+}
+
+// Initialize page structures and the buddy free lists.
+// After this is done, NEVER use boot_alloc again.  ONLY use the page
+// allocator functions below to allocate and deallocate physical
+// memory via the free lists.
+//
+// Pages in use or not RAM keep pp_ref = 1 and never reach the
+// allocator:
+//  1) physical page 0, which holds the real-mode IDT and BIOS
+//     structures we may want later;
+//  1a) the page at MPENTRY_PADDR, where the other CPUs start;
+//  2) the IO hole [IOPHYSMEM, EXTPHYSMEM);
+//  3) the kernel and everything boot_alloc() handed out after it;
+//  4) holes and reserved ranges in the memory map.
+// Each run of free pages is carved into the largest naturally
+// aligned blocks that fit.
+void
+page_init(void)
+{
+	ppn_t ppn, start, kernlo, kernhi;
+	int o;
+
+	for (o = 0; o <= PAGE_MAXORDER; o++) {
+		LIST_INIT(&free_area[o].free_list);
+		free_area[o].nfree = 0;
+	}
+
+	// The page allocator owns everything after the boot arena.
+	arena_seal(&boot_arena, PGSIZE);
+	kernlo = PPN(EXTPHYSMEM);
+	kernhi = PPN(PADDR(boot_alloc(0)));
+	for (ppn = 0; ppn < npages; ppn++) {
+		pages[ppn].pp_ref = 1;
+		pages[ppn].pp_order = 0;
+		pages[ppn].pp_flags = 0;
+	}
+
+	for (ppn = 1; ppn < npages; ) {
+		if (ppn == PPN(IOPHYSMEM))
+			ppn = kernhi;
+		if (!page_is_ram(ppn) || ppn == PPN(MPENTRY_PADDR)
+		    || (ppn >= kernlo && ppn < kernhi)) {
+			ppn++;
+			continue;
+		}
+		for (start = ppn; ppn < npages && ppn != PPN(IOPHYSMEM)
+			     && ppn != PPN(MPENTRY_PADDR)
+			     && page_is_ram(ppn); ppn++)
+			pages[ppn].pp_ref = 0;
+		while (start < ppn) {
+			for (o = PAGE_MAXORDER; o > 0; o--)
+				if ((start & ((1 << o) - 1)) == 0
+				    && start + (1 << o) <= ppn)
+					break;
+			free_area_add(&pages[start], o);
+			start += 1 << o;
+		}
+	}
+}
+
+// Take a free block of 2^order pages off the free lists, splitting the
+// smallest one that is big enough and returning the unused halves to
+// the lower lists.  Returns NULL if there is none.
+// Call with buddy_lock held.
+static struct Page *
+buddy_alloc(int order)
+{
+	struct Page *pp;
+	int o;
+
+	for (o = order; o <= PAGE_MAXORDER; o++)
+		if (!LIST_EMPTY(&free_area[o].free_list))
+			break;
+	if (o > PAGE_MAXORDER)
+		return NULL;
+
+	pp = LIST_FIRST(&free_area[o].free_list);
+	free_area_remove(pp, o);
+	while (o > order) {
+		o--;
+		free_area_add(pp + (1 << o), o);
+		buddy_stats.nsplit++;
+	}
+	pp->pp_order = order;
+	pp->pp_link.le_next = NULL;
+	pp->pp_link.le_prev = NULL;
+	buddy_stats.nalloc++;
+	return pp;
+}
+
+// Return a block of 2^order pages to the free lists, merging it with
+// its buddy for as long as the buddy is free and whole.
+// Call with buddy_lock held.
+static void
+buddy_free(struct Page *pp, int order)
+{
+	ppn_t ppn = page2ppn(pp), buddy;
+
+	while (order < PAGE_MAXORDER) {
+		buddy = ppn ^ (1 << order);
+		if (buddy >= npages || !(pages[buddy].pp_flags & PP_FREE)
+		    || pages[buddy].pp_order != order)
+			break;
+		free_area_remove(&pages[buddy], order);
+		ppn &= ~(1 << order);
+		order++;
+		buddy_stats.nmerge++;
+	}
+	free_area_add(&pages[ppn], order);
+}
+
+//
+// Allocates a block of 2^order physically contiguous pages, aligned
+// to its own size.  If (alloc_flags & ALLOC_ZERO), fills the whole
+// block with '\0' bytes.  Does NOT increment the reference count of
+// the page - the caller must do these if necessary (either explicitly
+// or via page_insert).
+//
+// Takes the smallest free block that is big enough, splitting it in
+// halves and returning the unused halves to the lower free lists.
+// Multi-page requests that find nothing empty this CPU's page cache,
+// whose pages may complete a block, and try again.
+//
+// Returns NULL if out of free memory.
+//
+struct Page *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct McsNode node;
+	struct Page *pp;
+	uint32_t eflags = read_eflags();
+
+	assert(order >= 0 && order <= PAGE_MAXORDER);
+	__asm __volatile("cli");
+	mcs_lock(&buddy_lock, &node);
+	if (!(pp = buddy_alloc(order)) && order > 0) {
+		mcs_unlock(&buddy_lock, &node);
+		page_cache_drain();
+		zero_pool_drain();
+		mcs_lock(&buddy_lock, &node);
+		pp = buddy_alloc(order);
+	}
+	if (!pp)
+		buddy_stats.nfail++;
+	mcs_unlock(&buddy_lock, &node);
+	write_eflags(eflags);
+	if (!pp)
+		return NULL;
+
+	pp->pp_cpu = cpunum();
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+// Refill an empty cache with up to PCP_BATCH pages from the buddy
+// lists, taking buddy_lock once for the batch.
+// Call with interrupts disabled.
+static void
+pcp_refill(struct PageCache *pc)
+{
+	struct McsNode node;
+	struct Page *pp;
+
+	assert(pc->pc_count == 0);
+	mcs_lock(&buddy_lock, &node);
+	while (pc->pc_count < PCP_BATCH && (pp = buddy_alloc(0)))
+		pc->pc_pages[pc->pc_count++] = pp;
+	if (pc->pc_count == 0)
+		buddy_stats.nfail++;
+	mcs_unlock(&buddy_lock, &node);
+	if (pc->pc_count)
+		pc->pc_refill++;
+}
+
+// Return the 'n' coldest pages in 'pc' to the buddy lists.
+// Call with interrupts disabled.
+static void
+pcp_drain(struct PageCache *pc, int n)
+{
+	struct McsNode node;
+	int i;
+
+	n = MIN(n, pc->pc_count);
+	mcs_lock(&buddy_lock, &node);
+	for (i = 0; i < n; i++)
+		buddy_free(pc->pc_pages[i], 0);
+	mcs_unlock(&buddy_lock, &node);
+	pc->pc_count -= n;
+	memmove(pc->pc_pages, pc->pc_pages + n,
+		pc->pc_count * sizeof(pc->pc_pages[0]));
+	if (n)
+		pc->pc_drain++;
+}
+
+// Take a page from the zero pool.  Call with interrupts disabled.
+// With ALLOC_ZERO in 'alloc_flags', counts the hit or miss.
+static struct Page *
+zero_pool_take(int alloc_flags)
+{
+	struct Page *pp;
+
+	spin_lock(&zero_pool.lock);
+	if ((pp = LIST_FIRST(&zero_pool.pages))) {
+		LIST_REMOVE(pp, pp_link);
+		zero_pool.count--;
+	}
+	if (alloc_flags & ALLOC_ZERO) {
+		if (pp)
+			zero_pool.hits++;
+		else
+			zero_pool.misses++;
+	}
+	spin_unlock(&zero_pool.lock);
+	return pp;
+}
+
+//
+// Allocates a single physical page from the current CPU's cache.
+// Like page_alloc_order(0, alloc_flags), but normally touches no
+// shared data.  With ALLOC_COLD, takes the page that was freed longest
+// ago instead of the most recently freed one.  With ALLOC_ZERO, takes
+// a pre-zeroed page from the zero pool if there is one.
+//
+struct Page *
+page_alloc(int alloc_flags)
+{
+	struct PageCache *pc;
+	struct Page *pp = NULL;
+	uint32_t eflags = read_eflags();
+
+	__asm __volatile("cli");
+	if ((alloc_flags & ALLOC_ZERO) && (pp = zero_pool_take(alloc_flags))) {
+		pp->pp_cpu = cpunum();
+		write_eflags(eflags);
+		return pp;
+	}
+
+	pc = &page_caches[cpunum()];
+	if (pc->pc_count == 0)
+		pcp_refill(pc);
+	if (pc->pc_count == 0 && (pp = zero_pool_take(0))) {
+		// Out of memory but for the pool: no need to zero it again.
+		pp->pp_cpu = cpunum();
+		write_eflags(eflags);
+		return pp;
+	} else if (pc->pc_count > 0) {
+		pc->pc_count--;
+		if (alloc_flags & ALLOC_COLD) {
+			pp = pc->pc_pages[0];
+			memmove(pc->pc_pages, pc->pc_pages + 1,
+				pc->pc_count * sizeof(pc->pc_pages[0]));
+		} else
+			pp = pc->pc_pages[pc->pc_count];
+		pp->pp_cpu = cpunum();
+		pc->pc_alloc++;
+	}
+	write_eflags(eflags);
+
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE);
+	return pp;
+}
+
+// Zero a page with non-temporal stores, which go to memory through the
+// write-combining buffers instead of pulling the page into the cache.
+static void
+zero_page_nt(void *va)
+{
+	uint32_t *p, *end = (uint32_t *) va + PGSIZE / 4;
+
+	for (p = va; p < end; p += 8)
+		__asm __volatile("movnti %1, 0(%0)\n\t"
+				 "movnti %1, 4(%0)\n\t"
+				 "movnti %1, 8(%0)\n\t"
+				 "movnti %1, 12(%0)\n\t"
+				 "movnti %1, 16(%0)\n\t"
+				 "movnti %1, 20(%0)\n\t"
+				 "movnti %1, 24(%0)\n\t"
+				 "movnti %1, 28(%0)"
+				 : : "r" (p), "r" (0) : "memory");
+	// Non-temporal stores are weakly ordered; make them visible
+	// before the page can be handed out.
+	__asm __volatile("sfence" : : : "memory");
+}
+
+//
+// Zero one more page for the zero pool, if it is below its target.
+// Called from the idle loop; returns 1 if it did any work.
+//
+bool
+page_zero_idle(void)
+{
+	struct Page *pp;
+	uint32_t eflags;
+
+	if (zero_pool.count >= ZPOOL_TARGET)
+		return 0;
+	// A cold page: nothing is lost by not caching it.
+	if (!(pp = page_alloc(ALLOC_COLD)))
+		return 0;
+	if (cpu_has_movnti)
+		zero_page_nt(page2kva(pp));
+	else
+		memset(page2kva(pp), 0, PGSIZE);
+
+	eflags = read_eflags();
+	__asm __volatile("cli");
+	spin_lock(&zero_pool.lock);
+	LIST_INSERT_HEAD(&zero_pool.pages, pp, pp_link);
+	zero_pool.count++;
+	zero_pool.zeroed++;
+	spin_unlock(&zero_pool.lock);
+	write_eflags(eflags);
+	return 1;
+}
+
+// Give every page in the zero pool back to the buddy lists.
+static void
+zero_pool_drain(void)
+{
+	struct McsNode node;
+	struct Page *pp;
+	uint32_t eflags = read_eflags();
+
+	__asm __volatile("cli");
+	while ((pp = zero_pool_take(0))) {
+		mcs_lock(&buddy_lock, &node);
+		buddy_free(pp, 0);
+		mcs_unlock(&buddy_lock, &node);
+	}
+	write_eflags(eflags);
+}
+
+//
+// Return a block of 2^order pages to the free lists, merging it with
+// its buddy for as long as the buddy is free and whole.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free_order(struct Page *pp, int order)
+{
+	struct McsNode node;
+	uint32_t eflags = read_eflags();
+
+	if (pp->pp_ref != 0)
+		panic("page_free: page %08x still referenced", page2pa(pp));
+	if (pp->pp_flags & PP_FREE)
+		panic("page_free: page %08x already free", page2pa(pp));
+	if (pp->pp_order != order || (page2ppn(pp) & ((1 << order) - 1)) != 0)
+		panic("page_free: page %08x is not an order %d block",
+		      page2pa(pp), order);
+
+	__asm __volatile("cli");
+	mcs_lock(&buddy_lock, &node);
+	buddy_free(pp, order);
+	mcs_unlock(&buddy_lock, &node);
+	write_eflags(eflags);
+}
+
+//
+// Return a page to the current CPU's cache, draining the cache's cold
+// end if it is full.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct Page *pp)
+{
+	struct PageCache *pc;
+	uint32_t eflags = read_eflags();
+
+	if (pp->pp_ref != 0)
+		panic("page_free: page %08x still referenced", page2pa(pp));
+	if (pp->pp_order != 0 || (pp->pp_flags & PP_FREE))
+		panic("page_free: page %08x is not an allocated page",
+		      page2pa(pp));
+
+	__asm __volatile("cli");
+	pc = &page_caches[cpunum()];
+	if (pc->pc_count == PCP_HIGH)
+		pcp_drain(pc, PCP_BATCH);
+	pc->pc_pages[pc->pc_count++] = pp;
+	pc->pc_free++;
+	if (pp->pp_cpu != cpunum())
+		pc->pc_remote++;
+	write_eflags(eflags);
+}
+
+//
+// Return everything in the current CPU's page cache to the buddy
+// lists, so it can be coalesced into larger blocks.
+//
+void
+page_cache_drain(void)
+{
+	uint32_t eflags = read_eflags();
+
+	__asm __volatile("cli");
+	pcp_drain(&page_caches[cpunum()], PCP_HIGH);
+	write_eflags(eflags);
+}
+
+//
+// Decrement the reference count on a page,
+// freeing it if there are no more refs.
+//
+void
+page_decref(struct Page* pp)
+{
+	if (--pp->pp_ref == 0) {
+		if (pp->pp_order == 0)
+			page_free(pp);
+		else
+			page_free_order(pp, pp->pp_order);
+	}
+}
+
+
+// --------------------------------------------------------------
+// Mapping physical memory into the current address space.
+//
+// Every page directory maps itself at VPT (and, read-only, at UVPT),
+// so the current address space's PDEs are at vpd[] and its PTEs at
+// vpt[].  map_range() and unmap_range() edit them there directly and
+// batch the TLB maintenance for the whole range.  They map raw
+// physical memory and do not touch page reference counts.
+// --------------------------------------------------------------
+
+// Make sure 'va' is covered by a page table, splitting a 4MB page
+// into one if need be.  Returns -E_NO_MEM if no page is available.
+static int
+pgtable_get(uintptr_t va, struct TlbSpace *ts)
+{
+	pde_t pde = vpd[PDX(va)];
+	struct Page *pp;
+	pte_t *pt;
+	int i;
+
+	if ((pde & PTE_P) && !(pde & PTE_PS))
+		return 0;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	if (pde & PTE_PS) {
+		// Same mappings, same permissions, 4K at a time.
+		pt = page2kva(pp);
+		for (i = 0; i < NPTENTRIES; i++)
+			pt[i] = (PTE_ADDR(pde) & ~(PTSIZE - 1)) + i * PGSIZE
+				+ (pde & (PTE_AVAIL | PTE_G | PTE_D | PTE_A |
+					  PTE_PCD | PTE_PWT | PTE_U | PTE_W |
+					  PTE_P));
+		tlb_invalidate(ts, ROUNDDOWN(va, PTSIZE), pde);
+	}
+	vpd[PDX(va)] = page2pa(pp) | PTE_U | PTE_W | PTE_P;
+	// The new page table shows up at this address in vpt.
+	invlpg((void *) &vpt[PDX(va) * NPTENTRIES]);
+	return 0;
+}
+
+//
+// Map [va, va+size) to physical [pa, pa+size) with permissions
+// perm|PTE_P in the current address space.  Uses 4MB pages for
+// aligned stretches when the CPU has PSE and no page table is in the
+// way.  All three arguments must be page-aligned.
+//
+// Returns 0 on success, -E_NO_MEM if a page table could not be
+// allocated; the range is then mapped only up to that point.
+//
+int
+map_range(uintptr_t va, physaddr_t pa, size_t size, int perm)
+{
+	struct TlbSpace *ts = tlb_current();
+	bool pse = (rcr4() & CR4_PSE) != 0;
+	pte_t old;
+	int r = 0;
+
+	assert(PGOFF(va) == 0 && PGOFF(pa) == 0 && PGOFF(size) == 0);
+	while (size > 0) {
+		old = vpd[PDX(va)];
+		if (pse && va % PTSIZE == 0 && pa % PTSIZE == 0
+		    && size >= PTSIZE && (!(old & PTE_P) || (old & PTE_PS))) {
+			vpd[PDX(va)] = pa | perm | PTE_PS | PTE_P;
+			tlb_invalidate(ts, va, old);
+			va += PTSIZE, pa += PTSIZE, size -= PTSIZE;
+			continue;
+		}
+		if ((r = pgtable_get(va, ts)) < 0)
+			break;
+		old = vpt[VPN(va)];
+		vpt[VPN(va)] = pa | perm | PTE_P;
+		tlb_invalidate(ts, va, old);
+		va += PGSIZE, pa += PGSIZE, size -= PGSIZE;
+	}
+	tlb_flush_pending();
+	return r;
+}
+
+//
+// Remove any mappings in [va, va+size) from the current address
+// space.  'va' and 'size' must be page-aligned.  Page tables stay in
+// place.  Returns -E_NO_MEM if part of a 4MB page had to be unmapped
+// and there was no page to split it with; nothing past that point is
+// unmapped.
+//
+int
+unmap_range(uintptr_t va, size_t size)
+{
+	struct TlbSpace *ts = tlb_current();
+	pde_t pde;
+	size_t n;
+	int r = 0;
+
+	assert(PGOFF(va) == 0 && PGOFF(size) == 0);
+	while (size > 0) {
+		pde = vpd[PDX(va)];
+		if (!(pde & PTE_P)) {
+			n = MIN(size, PTSIZE - va % PTSIZE);
+		} else if ((pde & PTE_PS) && va % PTSIZE == 0 && size >= PTSIZE) {
+			vpd[PDX(va)] = 0;
+			tlb_invalidate(ts, va, pde);
+			n = PTSIZE;
+		} else if (pde & PTE_PS) {
+			if ((r = pgtable_get(va, ts)) < 0)
+				break;
+			continue;
+		} else {
+			tlb_invalidate(ts, va, vpt[VPN(va)]);
+			vpt[VPN(va)] = 0;
+			n = PGSIZE;
+		}
+		va += n, size -= n;
+	}
+	tlb_flush_pending();
+	return r;
+}
+
+//
+// Reserve 'size' bytes of virtual memory in the MMIO region and map
+// physical [pa,pa+size) there, uncached, for device registers.  Both
+// ends are rounded out to page boundaries; the returned pointer
+// corresponds to 'pa' itself.  Reservations are permanent.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	static uintptr_t base = MMIOBASE;
+	physaddr_t start = ROUNDDOWN(pa, PGSIZE);
+	uintptr_t va = base;
+
+	size = ROUNDUP(pa + size, PGSIZE) - start;
+	if (size > MMIOLIM - base)
+		panic("mmio_map_region: out of MMIO space mapping %08x", pa);
+	if (map_range(va, start, size, PTE_PCD | PTE_PWT | PTE_W | PTE_G) < 0)
+		panic("mmio_map_region: out of memory");
+	base += size;
+	return (void *) (va + PGOFF(pa));
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static size_t
+nfree_pages(void)
+{
+	size_t n = 0;
+	int o;
+
+	for (o = 0; o <= PAGE_MAXORDER; o++)
+		n += free_area[o].nfree << o;
+	return n;
+}
+
+static size_t
+page_cache_pages(void)
+{
+	size_t n = 0;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		n += page_caches[i].pc_count;
+	return n;
+}
+
+//
+// Check the buddy allocator: alignment, splitting, and that freeing
+// coalesces everything back to where it started.
+//
+static void
+check_page_alloc(void)
+{
+	struct Page *pp, *pp0, *pp1, *pp2;
+	size_t nfree = page_cache_pages() + nfree_pages();
+	int o;
+
+	if (!pages)
+		panic("'pages' is a null pointer!");
+
+	// free blocks are aligned, in range, and not reserved
+	for (o = 0; o <= PAGE_MAXORDER; o++)
+		LIST_FOREACH(pp, &free_area[o].free_list, pp_link) {
+			assert(pp->pp_flags & PP_FREE);
+			assert(pp->pp_order == o);
+			assert((page2ppn(pp) & ((1 << o) - 1)) == 0);
+			assert(page2ppn(pp) + (1 << o) <= npages);
+			assert(page2pa(pp) != 0);
+			assert(page2pa(pp) > MPENTRY_PADDR
+			       || page2pa(pp) + (PGSIZE << o) <= MPENTRY_PADDR);
+			assert(page2pa(pp) < IOPHYSMEM
+			       || page2pa(pp) >= PADDR(boot_alloc(0)));
+		}
+
+	pp0 = page_alloc(0);
+	pp1 = page_alloc_order(2, ALLOC_ZERO);
+	pp2 = page_alloc(0);
+	assert(pp0 && pp1 && pp2);
+	assert(pp0 != pp2 && (pp2 < pp1 || pp2 >= pp1 + 4));
+	assert((page2ppn(pp1) & 3) == 0);
+	assert(*(uint32_t *) ((char *) page2kva(pp1) + 3*PGSIZE) == 0);
+	assert(page_cache_pages() + nfree_pages() == nfree - 6);
+
+	page_free(pp0);
+	page_free_order(pp1, 2);
+	page_free(pp2);
+	assert(page_cache_pages() + nfree_pages() == nfree);
+
+	// the most recently freed page comes back first
+	pp1 = page_alloc(0);
+	assert(pp1 == pp2);
+	page_free(pp1);
+	page_cache_drain();
+	assert(page_cache_pages() == 0 && nfree_pages() == nfree);
+
+	cprintf("check_page_alloc() succeeded!\n");
+}
+
+
+//
+// Check map_range() and unmap_range() on an otherwise unused part of
+// the address space.
+//
+static void
+check_map_range(void)
+{
+	struct Page *pp0, *pp1;
+	uintptr_t va = (uintptr_t) UTEMP;
+
+	// the self-map
+	assert(PTE_ADDR(vpd[PDX(VPT)]) == PADDR(kern_pgdir));
+	assert(vpd[PDX(KERNBASE)] == kern_pgdir[PDX(KERNBASE)]);
+
+	pp0 = page_alloc(0);
+	pp1 = page_alloc(0);
+	assert(pp0 && pp1 && pp0 != pp1);
+	*(uint32_t *) page2kva(pp0) = 0x01010101;
+	*(uint32_t *) page2kva(pp1) = 0x02020202;
+
+	// two 4K pages, then replace the second
+	assert(map_range(va, page2pa(pp0), 2 * PGSIZE, PTE_W) == 0);
+	assert(*(uint32_t *) va == 0x01010101);
+	assert(PTE_ADDR(vpt[VPN(va + PGSIZE)]) == page2pa(pp0) + PGSIZE);
+	assert(map_range(va + PGSIZE, page2pa(pp1), PGSIZE, PTE_W) == 0);
+	assert(*(uint32_t *) (va + PGSIZE) == 0x02020202);
+
+	assert(unmap_range(va, 2 * PGSIZE) == 0);
+	assert(vpt[VPN(va)] == 0 && vpt[VPN(va + PGSIZE)] == 0);
+
+	page_free(pp0);
+	page_free(pp1);
+
+	// the direct map: large pages where aligned, and nothing past
+	// the end of physical memory
+	if (rcr4() & CR4_PSE)
+		assert(vpd[PDX(KERNBASE)] & PTE_PS);
+	if (ROUNDUP(npages * PGSIZE, PTSIZE) < MAXPHYSMEM)
+		assert(!(vpd[PDX(KERNBASE + ROUNDUP(npages * PGSIZE, PTSIZE))]
+			 & PTE_P));
+
+	cprintf("check_map_range() succeeded!\n");
+}
+
+
+// --------------------------------------------------------------
+// Monitor commands.
+// --------------------------------------------------------------
+
+static const char *
+phys_map_type(uint32_t type)
+{
+	static const char * const names[] = {
+		[E820_RAM]	= "usable",
+		[E820_RESERVED]	= "reserved",
+		[E820_ACPI]	= "ACPI data",
+		[E820_NVS]	= "ACPI NVS",
+		[E820_UNUSABLE]	= "unusable",
+	};
+
+	if (type < sizeof(names)/sizeof(names[0]) && names[type])
+		return names[type];
+	return "unknown";
+}
+
+static int
+mon_memmap(int argc, char **argv, struct Trapframe *tf)
+{
+	struct E820Entry *e;
+	uint32_t i;
+
+	cprintf("Physical memory map (from %s):\n", phys_map_source);
+	for (i = 0; i < phys_map.count; i++) {
+		e = &phys_map.entries[i];
+		cprintf("  %016llx-%016llx  %s\n",
+			e->addr, e->addr + e->len - 1, phys_map_type(e->type));
+	}
+	cprintf("%u pages, %u of base memory\n", npages, npages_basemem);
+	return 0;
+}
+MONITOR_COMMAND("memmap", "Display the physical memory map", mon_memmap);
+
+// Free blocks per order, and for each order the share of free memory
+// sitting in smaller blocks that cannot satisfy an allocation that
+// large (0% = no fragmentation).
+static int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t nfree = nfree_pages(), below = 0;
+	int o;
+
+	cprintf("order  pages  free blocks  unusable\n");
+	for (o = 0; o <= PAGE_MAXORDER; o++) {
+		cprintf("%5d  %5d  %11u  ", o, 1 << o, free_area[o].nfree);
+		if (nfree)
+			cprintf("%7u%%\n", below * 100 / nfree);
+		else
+			cprintf("      -\n");
+		below += free_area[o].nfree << o;
+	}
+	cprintf("%u of %u pages free, %u more in per-CPU caches\n",
+		nfree, npages, page_cache_pages());
+	cprintf("%u allocations, %u failed, %u splits, %u merges\n",
+		buddy_stats.nalloc, buddy_stats.nfail,
+		buddy_stats.nsplit, buddy_stats.nmerge);
+	cprintf("zero pool: %u of %u pages ready, %u hits, %u misses, "
+		"%u zeroed while idle (%s)\n", zero_pool.count, ZPOOL_TARGET,
+		zero_pool.hits, zero_pool.misses, zero_pool.zeroed,
+		cpu_has_movnti ? "movnti" : "memset");
+	return 0;
+}
+MONITOR_COMMAND("buddyinfo", "Display buddy allocator free lists and fragmentation", mon_buddyinfo);
+
+static int
+mon_pcpstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct PageCache *pc;
+	int i;
+
+	if (argc > 1 && strcmp(argv[1], "drain") == 0)
+		page_cache_drain();
+	cprintf("cpu  cached     allocs      frees  refills   drains  remote\n");
+	for (i = 0; i < NCPU; i++) {
+		pc = &page_caches[i];
+		if (pc->pc_count == 0 && pc->pc_alloc == 0 && pc->pc_free == 0)
+			continue;
+		cprintf("%3d  %6d  %9u  %9u  %7u  %7u  %6u\n", i, pc->pc_count,
+			pc->pc_alloc, pc->pc_free, pc->pc_refill,
+			pc->pc_drain, pc->pc_remote);
+	}
+	return 0;
+}
+MONITOR_COMMAND("pcpstat", "Display per-CPU page cache counters ('pcpstat drain' to empty this CPU's)", mon_pcpstat);
@@ -0,0 +1,107 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PMAP_H
+#define JOS_KERN_PMAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+#include <inc/assert.h>
+#include <inc/e820.h>
+
+#include <kern/arena.h>
+
+// Physical memory the kernel can reach through its [KERNBASE, 4GB)
+// direct map.  RAM above this is ignored.
+#define MAXPHYSMEM	((physaddr_t) -KERNBASE)
+
+// The buddy allocator's largest block: 2^PAGE_MAXORDER pages, one
+// large page's worth.
+#define PAGE_MAXORDER	(PDXSHIFT - PGSHIFT)
+
+/* This macro takes a kernel virtual address -- an address that points above
+ * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
+ * and returns the corresponding physical address.  It panics if you pass it a
+ * non-kernel virtual address.
+ */
+#define PADDR(kva)						\
+({								\
+	physaddr_t __m_kva = (physaddr_t) (kva);		\
+	if (__m_kva < KERNBASE)					\
+		panic("PADDR called with invalid kva %08lx", __m_kva);\
+	__m_kva - KERNBASE;					\
+})
+
+/* This macro takes a physical address and returns the corresponding kernel
+ * virtual address.  It panics if you pass an invalid physical address. */
+#define KADDR(pa)						\
+({								\
+	physaddr_t __m_pa = (pa);				\
+	uint32_t __m_ppn = PPN(__m_pa);				\
+	if (__m_ppn >= npages)					\
+		panic("KADDR called with invalid pa %08lx", __m_pa);\
+	(void*) (__m_pa + KERNBASE);				\
+})
+
+
+enum {
+	// For page_alloc, zero the returned physical page(s).
+	ALLOC_ZERO = 1<<0,
+	// For page_alloc, prefer a page that is unlikely to be in the
+	// CPU's caches, e.g. for a device to DMA into.
+	ALLOC_COLD = 1<<1,
+};
+
+extern char bootstacktop[], bootstack[];
+
+extern pde_t *kern_pgdir;
+extern struct Page *pages;
+extern struct Arena boot_arena;
+extern size_t npages;			// pages of physical address space
+extern size_t npages_basemem;		// pages of base memory (below 640K)
+extern struct E820Map phys_map;		// sorted physical memory map
+
+void	i386_detect_memory(uint32_t mbmagic, physaddr_t mbinfo);
+void	mem_init(uint32_t mbmagic, physaddr_t mbinfo);
+
+void	page_init(void);
+struct Page *page_alloc(int alloc_flags);
+struct Page *page_alloc_order(int order, int alloc_flags);
+void	page_free(struct Page *pp);
+void	page_free_order(struct Page *pp, int order);
+void	page_decref(struct Page *pp);
+void	page_cache_drain(void);
+
+int	map_range(uintptr_t va, physaddr_t pa, size_t size, int perm);
+int	unmap_range(uintptr_t va, size_t size);
+void *	mmio_map_region(physaddr_t pa, size_t size);
+bool	page_zero_idle(void);
+
+static inline ppn_t
+page2ppn(struct Page *pp)
+{
+	return pp - pages;
+}
+
+static inline physaddr_t
+page2pa(struct Page *pp)
+{
+	return page2ppn(pp) << PGSHIFT;
+}
+
+static inline struct Page*
+pa2page(physaddr_t pa)
+{
+	if (PPN(pa) >= npages)
+		panic("pa2page called with invalid pa");
+	return &pages[PPN(pa)];
+}
+
+static inline void*
+page2kva(struct Page *pp)
+{
+	return KADDR(page2pa(pp));
+}
+
+#endif /* !JOS_KERN_PMAP_H */
@@ -0,0 +1,200 @@
+// Driver for the Intel architectural performance monitoring unit.
+//
+// CPUID leaf 0xA tells us how many general-purpose counters exist and
+// which architectural events they support.  Each event we care about
+// gets a counter of its own for the duration of a measurement; events
+// without a counter, or that the CPU does not implement, are reported
+// as such rather than faked.  Under QEMU TCG there is usually no PMU at
+// all, in which case only the TSC is reported.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+
+#include <kern/pmu.h>
+
+struct PmuEvent {
+	const char *name;
+	uint8_t event;
+	uint8_t umask;
+	int arch_bit;		// CPUID.0AH:EBX bit, -1 if model-specific
+	const uint8_t *models;	// if model-specific, the family 6 models
+				// that use this encoding, 0-terminated
+};
+
+// DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK is 0x08/0x01 from Sandy Bridge
+// through Skylake and its refreshes.  Earlier models count something
+// else there, and Ice Lake and later dropped the umask.
+static const uint8_t dtlb_walk_models[] = {
+	0x2A, 0x2D,			// Sandy Bridge
+	0x3A, 0x3E,			// Ivy Bridge
+	0x3C, 0x3F, 0x45, 0x46,		// Haswell
+	0x3D, 0x47, 0x4F, 0x56,		// Broadwell
+	0x4E, 0x5E, 0x55,		// Skylake
+	0x8E, 0x9E, 0xA5, 0xA6,		// Kaby Lake, Coffee Lake, Comet Lake
+	0
+};
+
+static const struct PmuEvent pmu_events[PMU_NEVENTS] = {
+	[PMU_CYCLES]		= { "cycles",		0x3C, 0x00, 0 },
+	[PMU_INSTRUCTIONS]	= { "instructions",	0xC0, 0x00, 1 },
+	[PMU_LLC_MISSES]	= { "LLC-misses",	0x2E, 0x41, 4 },
+	[PMU_BRANCH_MISSES]	= { "branch-misses",	0xC5, 0x00, 6 },
+	[PMU_DTLB_MISSES]	= { "dTLB-load-misses",	0x08, 0x01, -1,
+				    dtlb_walk_models },
+};
+
+static struct {
+	int version;		// architectural PMU version, 0 if none
+	int ncounters;		// general-purpose counters
+	int width;		// counter width in bits
+	int counter[PMU_NEVENTS];	// counter assigned to event, -1 if none
+	uint32_t supported;	// events the CPU implements
+	uint64_t tsc_start;
+} pmu;
+
+// Does this CPU's model use model-specific event 'ev''s encoding?
+static bool
+pmu_model_has(const struct PmuEvent *ev)
+{
+	uint32_t eax, family, model;
+	const uint8_t *m;
+
+	cpuid(1, &eax, NULL, NULL, NULL);
+	family = (eax >> 8) & 0xF;
+	model = ((eax >> 4) & 0xF) | (((eax >> 16) & 0xF) << 4);
+	if (family != 6)
+		return 0;
+	for (m = ev->models; m && *m; m++)
+		if (*m == model)
+			return 1;
+	return 0;
+}
+
+void
+pmu_init(void)
+{
+	uint32_t eax, ebx, maxleaf, vendor[3];
+	int i, n;
+
+	pmu.version = 0;
+	for (i = 0; i < PMU_NEVENTS; i++)
+		pmu.counter[i] = -1;
+
+	cpuid(0, &maxleaf, &vendor[0], &vendor[2], &vendor[1]);
+	if (memcmp(vendor, "GenuineIntel", 12) != 0 || maxleaf < 0xA)
+		return;
+	cpuid(0xA, &eax, &ebx, NULL, NULL);
+	pmu.version = eax & 0xFF;
+	pmu.ncounters = (eax >> 8) & 0xFF;
+	pmu.width = (eax >> 16) & 0xFF;
+	if (pmu.version == 0 || pmu.ncounters == 0) {
+		pmu.version = 0;
+		return;
+	}
+
+	// EBX bit i set means architectural event i is *not* available;
+	// EAX[31:24] says how many of those bits are meaningful.
+	for (i = 0; i < PMU_NEVENTS; i++) {
+		int bit = pmu_events[i].arch_bit;
+		if (bit < 0 ? pmu_model_has(&pmu_events[i])
+		    : bit < (eax >> 24) && !(ebx & (1 << bit)))
+			pmu.supported |= 1 << i;
+	}
+	for (i = n = 0; i < PMU_NEVENTS && n < pmu.ncounters; i++)
+		if (pmu.supported & (1 << i))
+			pmu.counter[i] = n++;
+
+	// Let rdpmc work at any privilege level.
+	lcr4(rcr4() | CR4_PCE);
+}
+
+void
+pmu_info(void)
+{
+	int i;
+
+	if (pmu.version == 0) {
+		cprintf("perf: no architectural PMU, only TSC cycles available\n");
+		return;
+	}
+	cprintf("perf: PMU version %d, %d counters, %d bits wide\n",
+		pmu.version, pmu.ncounters, pmu.width);
+	for (i = 0; i < PMU_NEVENTS; i++)
+		cprintf("  %-18s %s\n", pmu_events[i].name,
+			!(pmu.supported & (1 << i)) ? "not supported"
+			: pmu.counter[i] < 0 ? "no free counter"
+			: pmu_events[i].arch_bit < 0 ? "model-specific"
+			: "architectural");
+}
+
+void
+pmu_start(void)
+{
+	uint64_t enable = 0;
+	int i, c;
+
+	for (i = 0; i < PMU_NEVENTS; i++) {
+		if ((c = pmu.counter[i]) < 0)
+			continue;
+		wrmsr(MSR_PERFEVTSEL0 + c, 0);
+		wrmsr(MSR_PMC0 + c, 0);
+		wrmsr(MSR_PERFEVTSEL0 + c,
+		      pmu_events[i].event | (pmu_events[i].umask << 8)
+		      | PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+		enable |= 1ULL << c;
+	}
+	// Version 2 added a global enable that gates every counter.
+	if (pmu.version >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, enable);
+	pmu.tsc_start = read_tsc();
+}
+
+void
+pmu_stop(struct PmuSample *s)
+{
+	uint64_t mask;
+	int i, c;
+
+	s->ps_tsc = read_tsc() - pmu.tsc_start;
+	if (pmu.version >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, 0);
+
+	mask = pmu.width < 64 ? (1ULL << pmu.width) - 1 : ~0ULL;
+	s->ps_valid = 0;
+	for (i = 0; i < PMU_NEVENTS; i++) {
+		s->ps_count[i] = 0;
+		if ((c = pmu.counter[i]) < 0)
+			continue;
+		s->ps_count[i] = rdpmc(c) & mask;
+		wrmsr(MSR_PERFEVTSEL0 + c, 0);
+		s->ps_valid |= 1 << i;
+	}
+}
+
+void
+pmu_print(const char *what, const struct PmuSample *s)
+{
+	uint64_t ipc;
+	int i;
+
+	cprintf("\n Performance counter stats for '%s':\n\n", what);
+	for (i = 0; i < PMU_NEVENTS; i++) {
+		if (s->ps_valid & (1 << i))
+			cprintf("  %16llu  %s", s->ps_count[i], pmu_events[i].name);
+		else
+			cprintf("  %16s  %s", pmu.supported & (1 << i)
+				? "<not counted>" : "<not supported>",
+				pmu_events[i].name);
+		if (i == PMU_INSTRUCTIONS && (s->ps_valid & (1 << PMU_CYCLES))
+		    && (s->ps_valid & (1 << PMU_INSTRUCTIONS))
+		    && s->ps_count[PMU_CYCLES]) {
+			ipc = s->ps_count[i] * 100 / s->ps_count[PMU_CYCLES];
+			cprintf("  # %llu.%02llu insn per cycle",
+				ipc / 100, ipc % 100);
+		}
+		cprintf("\n");
+	}
+	cprintf("  %16llu  TSC cycles elapsed\n\n", s->ps_tsc);
+}
@@ -0,0 +1,40 @@
+#ifndef JOS_KERN_PMU_H
+#define JOS_KERN_PMU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Architectural performance monitoring MSRs (Intel SDM vol. 3, ch. 18)
+#define MSR_PERFEVTSEL0		0x186
+#define MSR_PMC0		0x0C1
+#define MSR_PERF_GLOBAL_CTRL	0x38F
+
+#define PERFEVTSEL_USR		(1 << 16)	// count at CPL > 0
+#define PERFEVTSEL_OS		(1 << 17)	// count at CPL 0
+#define PERFEVTSEL_EN		(1 << 22)	// enable counter
+
+// Events reported by 'perf', in the order they claim counters.
+enum {
+	PMU_CYCLES = 0,
+	PMU_INSTRUCTIONS,
+	PMU_LLC_MISSES,
+	PMU_BRANCH_MISSES,
+	PMU_DTLB_MISSES,
+	PMU_NEVENTS
+};
+
+struct PmuSample {
+	uint64_t ps_tsc;			// elapsed TSC cycles
+	uint64_t ps_count[PMU_NEVENTS];
+	uint32_t ps_valid;			// bit i set if ps_count[i] was counted
+};
+
+void pmu_init(void);
+void pmu_info(void);
+void pmu_start(void);
+void pmu_stop(struct PmuSample *s);
+void pmu_print(const char *what, const struct PmuSample *s);
+
+#endif	// !JOS_KERN_PMU_H
@@ -1,26 +1,33 @@
 // Simple implementation of cprintf console output for the kernel,
-// based on printfmt() and the kernel console's cputchar().
+// based on printfmt() and the kernel log, which the console prints.
 
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
-int number = 0;
+#include <kern/cpu.h>
+#include <kern/klog.h>
+
+// printfmt's count for %n, per CPU
+int number[NCPU];
 
 static void
-putch(int ch, int *cnt)
+putch(int ch, struct KlogWriter *w)
 {
-	cputchar(ch);
-    (*cnt)++;
-    number++;
+	klog_putc(w, ch);
+    number[cpunum()]++;
 }
 
 int
 vcprintf(const char *fmt, va_list ap)
 {
-	int cnt = 0;
+	struct KlogWriter w;
+	int cnt;
 
-	vprintfmt((void*)putch, &cnt, fmt, ap);
+	klog_begin(&w);
+	vprintfmt((void*)putch, &w, fmt, ap);
+	cnt = klog_end(&w);
+	klog_flush();
 	return cnt;
 }
 
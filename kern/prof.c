@@ -0,0 +1,218 @@
+// Statistical kernel profiler.
+//
+// Every timer tick records the interrupted EIP plus the return addresses
+// of the first few frames on the stack.  Identical stacks share a bucket,
+// so memory use is bounded no matter how long the profiler runs.
+// prof_dump() emits the buckets in the "collapsed stack" format used by
+// flame graph tools: one line per stack, root first, frames separated
+// by ';', followed by a space and the sample count.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+
+#include <kern/prof.h>
+#include <kern/timer.h>
+#include <kern/kdebug.h>
+#include <kern/console.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+struct ProfBucket {
+	uint32_t pb_count;
+	uint32_t pb_depth;
+	uintptr_t pb_pcs[PROF_DEPTH];
+};
+
+static struct ProfBucket prof_buckets[PROF_NBUCKET];
+
+// Every CPU's timer interrupt samples into the one table.  Taken with
+// interrupts disabled; guards prof_buckets, prof.samples and
+// prof.dropped.
+static struct Spinlock prof_lock = SPINLOCK_INITIALIZER("prof");
+
+static struct {
+	bool running;
+	unsigned hz;
+	uint32_t samples;	// samples stored in a bucket
+	uint32_t dropped;	// samples lost because the table was full
+	uint64_t tsc_start;	// when the current run started
+	uint64_t tsc_total;	// accumulated over finished runs
+} prof;
+
+// Walk the saved-%ebp chain starting at 'ebp', but only while the frame
+// stays inside the kernel stack: a sample may land anywhere, including
+// in code that has not set up its frame yet.
+static int
+prof_walk(uintptr_t eip, uint32_t *ebp, uintptr_t *pcs)
+{
+	uintptr_t top = thiscpu->cpu_kstacktop;
+	int n;
+
+	pcs[0] = eip;
+	for (n = 1; n < PROF_DEPTH; n++) {
+		if ((uintptr_t) ebp < top - KSTKSIZE
+		    || (uintptr_t) ebp > top - 8
+		    || ((uintptr_t) ebp & 3))
+			break;
+		pcs[n] = ebp[1];
+		if (ebp[0] <= (uintptr_t) ebp)
+			break;
+		ebp = (uint32_t *) ebp[0];
+	}
+	return n;
+}
+
+static uint32_t
+prof_hash(const uintptr_t *pcs, int n)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	int i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ pcs[i]) * 16777619u;
+	return h;
+}
+
+void
+prof_tick(struct Trapframe *tf)
+{
+	uintptr_t pcs[PROF_DEPTH];
+	struct ProfBucket *b;
+	uint32_t h, i;
+	int n;
+
+	if (!prof.running)
+		return;
+
+	n = prof_walk(tf->tf_eip, (uint32_t *) tf->tf_regs.reg_ebp, pcs);
+	h = prof_hash(pcs, n);
+
+	// Open addressing with linear probing; give up after a short run
+	// rather than stall the interrupt when the table is nearly full.
+	spin_lock(&prof_lock);
+	// prof_stop() may have run since we looked.
+	for (i = 0; prof.running && i < 16; i++) {
+		b = &prof_buckets[(h + i) & (PROF_NBUCKET - 1)];
+		if (b->pb_count == 0) {
+			b->pb_depth = n;
+			memmove(b->pb_pcs, pcs, n * sizeof(pcs[0]));
+		} else if (b->pb_depth != n
+			   || memcmp(b->pb_pcs, pcs, n * sizeof(pcs[0])) != 0)
+			continue;
+		b->pb_count++;
+		prof.samples++;
+		spin_unlock(&prof_lock);
+		return;
+	}
+	if (prof.running)
+		prof.dropped++;
+	spin_unlock(&prof_lock);
+}
+
+void
+prof_start(unsigned hz)
+{
+	if (prof.running)
+		prof_stop();
+	prof.hz = hz;
+	prof.tsc_start = read_tsc();
+	prof.running = 1;
+	timer_periodic(hz);
+}
+
+void
+prof_stop(void)
+{
+	uint32_t eflags;
+
+	if (!prof.running)
+		return;
+	timer_periodic(0);
+	prof.running = 0;
+	prof.tsc_total += read_tsc() - prof.tsc_start;
+	// Wait out any sample another CPU is still storing, so that the
+	// table stays still from here on.
+	eflags = read_eflags();
+	__asm __volatile("cli");
+	spin_lock(&prof_lock);
+	spin_unlock(&prof_lock);
+	write_eflags(eflags);
+}
+
+void
+prof_reset(void)
+{
+	bool running = prof.running;
+
+	prof_stop();
+	memset(prof_buckets, 0, sizeof(prof_buckets));
+	prof.samples = prof.dropped = 0;
+	prof.tsc_total = 0;
+	if (running)
+		prof_start(prof.hz);
+}
+
+void
+prof_status(void)
+{
+	uint64_t cycles = prof.tsc_total;
+	int i, used = 0;
+
+	if (prof.running)
+		cycles += read_tsc() - prof.tsc_start;
+	for (i = 0; i < PROF_NBUCKET; i++)
+		if (prof_buckets[i].pb_count)
+			used++;
+	cprintf("profiler %s at %u Hz: %u samples in %d/%d stacks, "
+		"%u dropped, %llu cycles\n",
+		prof.running ? "running" : "stopped", prof.hz,
+		prof.samples, used, PROF_NBUCKET, prof.dropped, cycles);
+}
+
+// The dump can be tens of kilobytes, far too much for the CGA console,
+// so it goes straight to the serial port when there is one (unless
+// someone is capturing console output, e.g. the binary monitor).
+static void
+prof_putch(int ch, void *arg)
+{
+	if (serial_exists && !cons_capturing())
+		serial_putc(ch);
+	else
+		cputchar(ch);
+}
+
+static void
+prof_print_pc(uintptr_t pc)
+{
+	struct Eipdebuginfo info;
+
+	if (debuginfo_eip(pc, &info) == 0)
+		printfmt(prof_putch, NULL, "%.*s",
+			 info.eip_fn_namelen, info.eip_fn_name);
+	else
+		printfmt(prof_putch, NULL, "0x%08x", pc);
+}
+
+void
+prof_dump(void)
+{
+	bool running = prof.running;
+	struct ProfBucket *b;
+	int i;
+
+	// Freeze the table so the dump is a consistent snapshot.
+	prof_stop();
+	for (b = prof_buckets; b < prof_buckets + PROF_NBUCKET; b++) {
+		if (b->pb_count == 0)
+			continue;
+		for (i = b->pb_depth - 1; i >= 0; i--) {
+			prof_print_pc(b->pb_pcs[i]);
+			prof_putch(i ? ';' : ' ', NULL);
+		}
+		printfmt(prof_putch, NULL, "%u\n", b->pb_count);
+	}
+	if (running)
+		prof_start(prof.hz);
+}
@@ -0,0 +1,24 @@
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Trapframe;
+
+#define PROF_DEPTH	8	// PCs recorded per sample, interrupted EIP first
+#define PROF_NBUCKET	1024	// distinct stacks we can tell apart (power of 2)
+#define PROF_HZ		1000	// default sampling rate
+
+void prof_start(unsigned hz);
+void prof_stop(void);
+void prof_reset(void);
+void prof_status(void);
+void prof_dump(void);
+
+// Called from the timer interrupt.
+void prof_tick(struct Trapframe *tf);
+
+#endif	// !JOS_KERN_PROF_H
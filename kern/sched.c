@@ -0,0 +1,407 @@
+// Per-CPU priority run queues, with idle CPUs stealing work.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/error.h>
+
+#include <kern/sched.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/idle.h>
+#include <kern/tlb.h>
+#include <kern/monitor.h>
+
+struct RunQueue {
+	struct Spinlock rq_lock;	// guards the lists, rq_nr and rq_resched
+	uint32_t rq_bitmap;		// bit p set if rq_head[p] is non-empty
+	struct Env *rq_head[SCHED_NPRIO];
+	struct Env *rq_tail[SCHED_NPRIO];
+	volatile uint32_t rq_nr;	// queued; peers read it without the lock
+	volatile int rq_curprio;	// priority running, SCHED_NPRIO if idle
+	volatile bool rq_resched;	// the running env should give way
+	bool rq_active;			// this CPU runs environments
+	struct Timer rq_slice;		// ends the running env's time slice
+
+	uint32_t rq_switches;		// switches to a different environment
+	uint32_t rq_kept;		// reschedules that kept the same one
+	uint32_t rq_preempts;		// wakeups that preempted this CPU
+	uint32_t rq_steals;		// environments taken from peers
+	uint32_t rq_stolen;		// environments peers took from here
+	uint32_t rq_idles;		// times this CPU ran out of work
+	uint64_t rq_nrsum;		// rq_nr, summed at each switch
+	uint64_t rq_wait;		// cycles from joining a queue to running
+	uint64_t rq_wait_max;
+	uint64_t rq_switch;		// cycles from sched_yield() to env_run()
+	uint64_t rq_switch_max;
+} __attribute__((aligned(CACHELINE)));
+
+static struct RunQueue runqueues[NCPU];
+
+static void sched_halt(struct RunQueue *rq) __attribute__((noreturn));
+
+static void
+sched_slice_end(void *arg)
+{
+	struct RunQueue *rq = arg;
+
+	rq->rq_resched = 1;
+}
+
+void
+sched_init(void)
+{
+	struct RunQueue *rq;
+
+	for (rq = runqueues; rq < runqueues + NCPU; rq++) {
+		spin_init(&rq->rq_lock, "runqueue");
+		rq->rq_curprio = SCHED_NPRIO;
+		timer_setup(&rq->rq_slice, sched_slice_end, rq);
+	}
+}
+
+// Append 'e' to its priority's list.  Called with rq_lock held.
+static void
+rq_add(struct RunQueue *rq, struct Env *e)
+{
+	int p = e->env_prio;
+
+	e->env_rqnext = NULL;
+	e->env_rqtsc = read_tsc();
+	if (rq->rq_tail[p])
+		rq->rq_tail[p]->env_rqnext = e;
+	else
+		rq->rq_head[p] = e;
+	rq->rq_tail[p] = e;
+	rq->rq_bitmap |= 1 << p;
+	rq->rq_nr++;
+}
+
+// Remove and return the first of the most urgent environments, if it
+// is at least as urgent as 'maxprio'.  Called with rq_lock held.
+static struct Env *
+rq_take(struct RunQueue *rq, int maxprio)
+{
+	struct Env *e;
+	int p;
+
+	if (!rq->rq_bitmap)
+		return NULL;
+	p = __builtin_ctz(rq->rq_bitmap);
+	if (p > maxprio)
+		return NULL;
+	e = rq->rq_head[p];
+	if (!(rq->rq_head[p] = e->env_rqnext)) {
+		rq->rq_tail[p] = NULL;
+		rq->rq_bitmap &= ~(1 << p);
+	}
+	rq->rq_nr--;
+	return e;
+}
+
+// Claim 'e', just taken off a run queue, for this CPU.  If it was
+// destroyed while it waited, free it here and return 0.
+static bool
+sched_claim(struct Env *e)
+{
+	if (cmpxchg((volatile uint32_t *) &e->env_status,
+		    ENV_RUNNABLE, ENV_RUNNING) == ENV_RUNNABLE)
+		return 1;
+	env_free(e);
+	return 0;
+}
+
+// Take the most urgent environment from whichever peer has the most
+// queued.  The count is read without the lock, so it is only a guess.
+static struct Env *
+sched_steal(struct RunQueue *rq)
+{
+	struct RunQueue *peer, *busiest = NULL;
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		peer = &runqueues[i];
+		if (peer != rq && peer->rq_nr > 0
+		    && (!busiest || peer->rq_nr > busiest->rq_nr))
+			busiest = peer;
+	}
+	if (!busiest)
+		return NULL;
+
+	spin_lock(&busiest->rq_lock);
+	if ((e = rq_take(busiest, SCHED_NPRIO - 1)))
+		busiest->rq_stolen++;
+	spin_unlock(&busiest->rq_lock);
+	if (e)
+		rq->rq_steals++;
+	return e;
+}
+
+// The next environment for this CPU: its own most urgent, or failing
+// that, one stolen from a peer.
+static struct Env *
+sched_next(struct RunQueue *rq)
+{
+	struct Env *e;
+
+	spin_lock(&rq->rq_lock);
+	e = rq_take(rq, SCHED_NPRIO - 1);
+	spin_unlock(&rq->rq_lock);
+	if (!e)
+		e = sched_steal(rq);
+	return e;
+}
+
+// Start a new time slice for 'e' and run it.  't0' is when this CPU
+// entered sched_yield().
+static void __attribute__((noreturn))
+sched_run(struct RunQueue *rq, struct Env *e, uint64_t t0)
+{
+	uint64_t now = read_tsc();
+
+	if (e == curenv)
+		rq->rq_kept++;
+	else {
+		rq->rq_switches++;
+		rq->rq_nrsum += rq->rq_nr;
+		rq->rq_wait += now - e->env_rqtsc;
+		rq->rq_wait_max = MAX(rq->rq_wait_max, now - e->env_rqtsc);
+		rq->rq_switch += now - t0;
+		rq->rq_switch_max = MAX(rq->rq_switch_max, now - t0);
+	}
+	rq->rq_curprio = e->env_prio;
+	timer_add(&rq->rq_slice, timer_ns() + SCHED_SLICE_NS);
+	env_run(e);
+}
+
+//
+// Choose an environment to run on this CPU and run it.  The current
+// environment keeps the CPU unless something at least as urgent is
+// waiting; if it is still runnable it goes to the back of its list.
+// With nothing to run, the CPU idles until there is.
+//
+// Called with the current environment's registers saved in its
+// env_tf, or with no current environment.
+//
+void
+sched_yield(void)
+{
+	struct RunQueue *rq;
+	struct Env *cur, *e, *dying = NULL;
+	uint64_t t0 = read_tsc();
+
+	__asm __volatile("cli");
+	rq = &runqueues[cpunum()];
+	rq->rq_active = 1;
+	rq->rq_resched = 0;
+
+	cur = curenv;
+	if (cur && cur->env_status == ENV_DYING) {
+		env_free(cur);
+		cur = curenv = NULL;
+	}
+	if (cur && cur->env_status != ENV_RUNNING)
+		cur = NULL;
+
+	spin_lock(&rq->rq_lock);
+	e = rq_take(rq, cur ? cur->env_prio : SCHED_NPRIO - 1);
+	if (!e && cur) {
+		spin_unlock(&rq->rq_lock);
+		sched_run(rq, cur, t0);
+	}
+	if (cur) {
+		// Leave cur's address space before another CPU can take
+		// cur, and perhaps destroy it.
+		tlb_switch(env_tlbspace(e));
+		if (cmpxchg((volatile uint32_t *) &cur->env_status,
+			    ENV_RUNNING, ENV_RUNNABLE) == ENV_RUNNING)
+			rq_add(rq, cur);
+		else
+			dying = cur;
+		curenv = NULL;
+	}
+	spin_unlock(&rq->rq_lock);
+	if (dying)
+		env_free(dying);
+
+	for (;;) {
+		if (e && sched_claim(e))
+			sched_run(rq, e, t0);
+		if (!(e = sched_next(rq)))
+			sched_halt(rq);
+	}
+}
+
+// Is there anything for this idle CPU to run, or steal?
+static bool
+sched_ready(void *arg)
+{
+	struct RunQueue *rq = arg;
+	int i;
+
+	if (rq->rq_nr || rq->rq_resched)
+		return 1;
+	for (i = 0; i < ncpu; i++)
+		if (runqueues[i].rq_nr)
+			return 1;
+	return 0;
+}
+
+static void __attribute__((noreturn))
+sched_idle(void)
+{
+	struct RunQueue *rq = &runqueues[cpunum()];
+
+	for (;;) {
+		__asm __volatile("sti");
+		idle_wait(sched_ready, rq);
+		__asm __volatile("cli");
+		if (sched_ready(rq))
+			sched_yield();
+	}
+}
+
+// Nothing to run: idle on a fresh kernel stack, since nothing on the
+// current one is needed any more.
+static void
+sched_halt(struct RunQueue *rq)
+{
+	curenv = NULL;
+	rq->rq_curprio = SCHED_NPRIO;
+	rq->rq_idles++;
+	timer_cancel(&rq->rq_slice);
+	tlb_switch(&kern_tlbspace);
+
+	__asm __volatile("movl %0, %%esp\n"
+			 "\tmovl $0, %%ebp\n"
+			 "\tcall *%1\n"
+			 : : "r" (thiscpu->cpu_kstacktop), "r" (sched_idle));
+	panic("sched_idle returned");
+}
+
+// The least loaded CPU that runs environments, preferring the one 'e'
+// last ran on, whose caches may still hold its data.  -1 if no CPU
+// runs environments yet.
+static int
+sched_place(struct Env *e)
+{
+	struct RunQueue *rq;
+	uint32_t load, bestload = 0;
+	int i, best = -1;
+
+	for (i = 0; i < ncpu; i++) {
+		rq = &runqueues[i];
+		if (!rq->rq_active)
+			continue;
+		load = rq->rq_nr + (rq->rq_curprio < SCHED_NPRIO);
+		if (best < 0 || load < bestload
+		    || (load == bestload && i == e->env_cpunum)) {
+			best = i;
+			bestload = load;
+		}
+	}
+	return best;
+}
+
+//
+// Make the ENV_NOT_RUNNABLE environment 'e' runnable.  If it is more
+// urgent than what its new CPU is running, that CPU reschedules at
+// once: on its way back to user mode if it is this one, or on an
+// IRQ_RESCHED interrupt if it is another.
+//
+// Returns 0, or -E_INVAL if no CPU runs environments to take it; 'e'
+// then stays ENV_NOT_RUNNABLE.
+//
+int
+sched_wakeup(struct Env *e)
+{
+	struct RunQueue *rq;
+	uint32_t eflags;
+	bool kick = 0;
+	int cpu;
+
+	eflags = read_eflags();
+	__asm __volatile("cli");
+	if ((cpu = sched_place(e)) < 0) {
+		write_eflags(eflags);
+		return -E_INVAL;
+	}
+	if (cmpxchg((volatile uint32_t *) &e->env_status,
+		    ENV_NOT_RUNNABLE, ENV_RUNNABLE) != ENV_NOT_RUNNABLE) {
+		write_eflags(eflags);
+		return 0;
+	}
+	rq = &runqueues[cpu];
+	spin_lock(&rq->rq_lock);
+	rq_add(rq, e);
+	if (e->env_prio < rq->rq_curprio) {
+		if (rq->rq_curprio < SCHED_NPRIO)
+			rq->rq_preempts++;
+		rq->rq_resched = 1;
+		kick = 1;
+	}
+	spin_unlock(&rq->rq_lock);
+	if (kick && cpu != cpunum() && lapic)
+		lapic_ipi(cpus[cpu].cpu_apicid, IRQ_OFFSET + IRQ_RESCHED);
+	write_eflags(eflags);
+	return 0;
+}
+
+// Should the current environment give way before returning to it?
+bool
+sched_pending(void)
+{
+	return runqueues[cpunum()].rq_resched;
+}
+
+
+/***** Monitor commands *****/
+
+static int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	struct RunQueue *rq;
+	uint32_t sw;
+	int i;
+
+	if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+		for (rq = runqueues; rq < runqueues + NCPU; rq++) {
+			rq->rq_switches = rq->rq_kept = rq->rq_preempts = 0;
+			rq->rq_steals = rq->rq_stolen = rq->rq_idles = 0;
+			rq->rq_nrsum = rq->rq_wait = rq->rq_wait_max = 0;
+			rq->rq_switch = rq->rq_switch_max = 0;
+		}
+		return 0;
+	}
+	if (argc != 1) {
+		cprintf("usage: sched [reset]\n");
+		return 0;
+	}
+
+	cprintf("cpu %-8s %6s %5s %8s %6s %7s %6s %6s %6s"
+		" %9s %9s %9s %9s\n", "running", "queued", "avgq",
+		"switches", "kept", "preempt", "steals", "stolen", "idle",
+		"avg wait", "max wait", "avg sw", "max sw");
+	for (i = 0; i < ncpu; i++) {
+		rq = &runqueues[i];
+		sw = rq->rq_switches;
+		cprintf("%3d %-8s %6u %5u %8u %6u %7u %6u %6u %6u"
+			" %9llu %9llu %9llu %9llu\n", i,
+			!rq->rq_active ? "-"
+			: rq->rq_curprio < SCHED_NPRIO ? "env" : "idle",
+			rq->rq_nr, sw ? (uint32_t) (rq->rq_nrsum / sw) : 0,
+			sw, rq->rq_kept, rq->rq_preempts, rq->rq_steals,
+			rq->rq_stolen, rq->rq_idles,
+			sw ? rq->rq_wait / sw : 0, rq->rq_wait_max,
+			sw ? rq->rq_switch / sw : 0, rq->rq_switch_max);
+	}
+	cprintf("(times in TSC cycles; wait is from becoming runnable to "
+		"running)\n");
+	return 0;
+}
+MONITOR_COMMAND("sched", "Display per-CPU run queue statistics: sched [reset]", mon_sched);
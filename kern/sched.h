@@ -0,0 +1,34 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SCHED_H
+#define JOS_KERN_SCHED_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/env.h>
+#include <kern/timer.h>
+
+// Each CPU that runs environments has its own run queue: one FIFO list
+// per priority, and a bitmap of which lists are non-empty, so that the
+// most urgent environment is found with one bit scan whatever the
+// number queued.  A CPU only ever takes its own queue's lock, except
+// that a CPU with nothing to run takes the busiest peer's to steal from
+// it; no CPU holds two at once.
+//
+// An environment runs for up to SCHED_SLICE_NS before giving way to the
+// next one of the same priority.  Waking an environment that is more
+// urgent than what its CPU is running preempts at once.
+
+#define SCHED_NPRIO		32	// priorities 0..31; one bitmap word
+#define SCHED_PRIO_DEFAULT	16
+#define SCHED_SLICE_NS		(10 * NSEC_PER_MSEC)
+
+void	sched_init(void);
+int	sched_wakeup(struct Env *e);
+bool	sched_pending(void);
+void	sched_yield(void) __attribute__((noreturn));
+
+#endif	// !JOS_KERN_SCHED_H
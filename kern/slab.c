@@ -0,0 +1,366 @@
+/* See COPYRIGHT for copyright information. */
+
+// Slab allocator for small kernel objects, and malloc()/free() on top
+// of it.
+//
+// Each object cache carves single pages into equal-sized objects.
+// Allocation and free normally touch only the current CPU's magazine
+// of cached objects; the slab layer behind it is visited once per
+// SLAB_MAGSIZE/2 operations.  Slabs are colored: successive slabs of a
+// cache start their objects at different cache-line offsets within
+// the page's slack, so hot objects from different slabs don't all
+// compete for the same cache sets.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+#include <inc/malloc.h>
+
+#include <kern/pmap.h>
+#include <kern/slab.h>
+#include <kern/monitor.h>
+
+#define SLAB_NIL	0xFFFF		// end of a slab's free list
+
+static struct SlabCache cache_cache;	// where SlabCaches come from
+static LIST_HEAD(SlabCache_list, SlabCache) caches;
+static struct RwLock caches_lock = RWLOCK_INITIALIZER("slab_caches");
+
+// malloc size classes: SLAB_MINSIZE, 2*SLAB_MINSIZE, ..., SLAB_MAXSIZE
+#define NSIZES		7
+static struct SlabCache *size_caches[NSIZES];
+static const char * const size_names[NSIZES] = {
+	"size-16", "size-32", "size-64", "size-128",
+	"size-256", "size-512", "size-1024",
+};
+
+static void
+slab_cache_setup(struct SlabCache *cp, const char *name, size_t size,
+		 size_t align, void (*ctor)(void *))
+{
+	size_t hdr, n, step, slack;
+	int i;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	assert((align & (align - 1)) == 0);
+	size = ROUNDUP(size, align);
+
+	// As many objects as fit after the header and its free-list links.
+	n = (PGSIZE - sizeof(struct Slab)) / (size + sizeof(uint16_t));
+	while (n > 0 && ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t),
+				align) + n * size > PGSIZE)
+		n--;
+	if (n == 0)
+		panic("slab_cache_create: %s objects (%u bytes) are too big",
+		      name, size);
+	hdr = ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), align);
+	slack = PGSIZE - hdr - n * size;
+	step = MAX(align, (size_t) CACHELINE);
+
+	memset(cp, 0, sizeof(*cp));
+	cp->sc_name = name;
+	cp->sc_size = size;
+	cp->sc_align = align;
+	cp->sc_ctor = ctor;
+	cp->sc_nobjs = n;
+	cp->sc_offset = hdr;
+	cp->sc_ncolors = slack / step + 1;
+	LIST_INIT(&cp->sc_full);
+	LIST_INIT(&cp->sc_partial);
+	LIST_INIT(&cp->sc_empty);
+	spin_init(&cp->sc_lock, name);
+	for (i = 0; i < NCPU; i++)
+		cp->sc_mag[i].sm_count = 0;
+	write_lock(&caches_lock);
+	LIST_INSERT_HEAD(&caches, cp, sc_link);
+	write_unlock(&caches_lock);
+}
+
+//
+// Create a cache of 'size'-byte objects aligned to 'align' bytes.
+// If 'ctor' is not NULL, it is called on each object when its slab is
+// created, not on every allocation.  Returns NULL if out of memory.
+//
+struct SlabCache *
+slab_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct SlabCache *cp;
+
+	if (!(cp = slab_alloc(&cache_cache)))
+		return NULL;
+	slab_cache_setup(cp, name, size, align, ctor);
+	return cp;
+}
+
+// Create the cache of caches and the malloc size classes.
+void
+slab_init(void)
+{
+	size_t size;
+	int i;
+
+	LIST_INIT(&caches);
+	slab_cache_setup(&cache_cache, "slab_cache",
+			 sizeof(struct SlabCache), CACHELINE, NULL);
+	for (i = 0, size = SLAB_MINSIZE; i < NSIZES; i++, size *= 2)
+		if (!(size_caches[i] = slab_cache_create(size_names[i], size,
+							 MIN(size, (size_t) CACHELINE),
+							 NULL)))
+			panic("slab_init: out of memory");
+}
+
+
+/***** Slab layer *****/
+
+// The slab layer behind the magazines shares its lists between CPUs.
+// Callers have interrupts disabled and hold the cache's sc_lock.
+
+// Add a new, empty slab to 'cp'.
+static int
+slab_grow(struct SlabCache *cp)
+{
+	struct Page *pp;
+	struct Slab *sl;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return -E_NO_MEM;
+	pp->pp_flags |= PP_SLAB;
+	sl = page2kva(pp);
+	sl->sl_cache = cp;
+	sl->sl_base = (char *) sl + cp->sc_offset
+		+ cp->sc_color * MAX(cp->sc_align, (size_t) CACHELINE);
+	cp->sc_color = (cp->sc_color + 1) % cp->sc_ncolors;
+	sl->sl_inuse = 0;
+	sl->sl_free = 0;
+	for (i = 0; i < cp->sc_nobjs; i++)
+		sl->sl_next[i] = i + 1 < cp->sc_nobjs ? i + 1 : SLAB_NIL;
+	if (cp->sc_ctor)
+		for (i = 0, obj = sl->sl_base; i < cp->sc_nobjs;
+		     i++, obj += cp->sc_size)
+			cp->sc_ctor(obj);
+	LIST_INSERT_HEAD(&cp->sc_empty, sl, sl_link);
+	cp->sc_nslabs++;
+	return 0;
+}
+
+// Give an unused slab's page back.  The slab must be off all lists.
+static void
+slab_destroy(struct SlabCache *cp, struct Slab *sl)
+{
+	struct Page *pp = pa2page(PADDR(sl));
+
+	cp->sc_nslabs--;
+	pp->pp_flags &= ~PP_SLAB;
+	page_free(pp);
+}
+
+// Take one object from the slabs, preferring partly used slabs so
+// that empty ones can be given back.
+static void *
+slab_take(struct SlabCache *cp)
+{
+	struct Slab *sl;
+	void *obj;
+
+	if (!(sl = LIST_FIRST(&cp->sc_partial))) {
+		if (!(sl = LIST_FIRST(&cp->sc_empty))) {
+			if (slab_grow(cp) < 0)
+				return NULL;
+			sl = LIST_FIRST(&cp->sc_empty);
+		}
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&cp->sc_partial, sl, sl_link);
+	}
+
+	obj = sl->sl_base + sl->sl_free * cp->sc_size;
+	sl->sl_free = sl->sl_next[sl->sl_free];
+	sl->sl_inuse++;
+	cp->sc_inuse++;
+	if (sl->sl_free == SLAB_NIL) {
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&cp->sc_full, sl, sl_link);
+	}
+	return obj;
+}
+
+// Return one object to its slab.  Keeps at most one empty slab per
+// cache and gives the rest back to the page allocator.
+static void
+slab_put(struct SlabCache *cp, void *obj)
+{
+	struct Slab *sl = ROUNDDOWN(obj, PGSIZE);
+	uint32_t off = (char *) obj - sl->sl_base;
+	uint16_t i = off / cp->sc_size;
+
+	if (sl->sl_cache != cp || off % cp->sc_size != 0 || i >= cp->sc_nobjs)
+		panic("slab_free: %08x is not a %s object", obj, cp->sc_name);
+
+	if (sl->sl_free == SLAB_NIL) {
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&cp->sc_partial, sl, sl_link);
+	}
+	sl->sl_next[i] = sl->sl_free;
+	sl->sl_free = i;
+	sl->sl_inuse--;
+	cp->sc_inuse--;
+	if (sl->sl_inuse == 0) {
+		LIST_REMOVE(sl, sl_link);
+		if (LIST_EMPTY(&cp->sc_empty))
+			LIST_INSERT_HEAD(&cp->sc_empty, sl, sl_link);
+		else
+			slab_destroy(cp, sl);
+	}
+}
+
+
+/***** Per-CPU magazines *****/
+
+//
+// Allocate an object from 'cp'.  Returns NULL if out of memory.
+//
+void *
+slab_alloc(struct SlabCache *cp)
+{
+	struct SlabMagazine *m;
+	void *obj = NULL;
+	uint32_t eflags = read_eflags();
+
+	__asm __volatile("cli");
+	m = &cp->sc_mag[cpunum()];
+	if (m->sm_count == 0) {
+		spin_lock(&cp->sc_lock);
+		while (m->sm_count < SLAB_MAGSIZE / 2
+		       && (obj = slab_take(cp)))
+			m->sm_objs[m->sm_count++] = obj;
+		spin_unlock(&cp->sc_lock);
+		if (m->sm_count)
+			m->sm_refill++;
+	}
+	if (m->sm_count > 0) {
+		obj = m->sm_objs[--m->sm_count];
+		m->sm_alloc++;
+	}
+	write_eflags(eflags);
+	return obj;
+}
+
+//
+// Return 'obj' to 'cp'.
+//
+void
+slab_free(struct SlabCache *cp, void *obj)
+{
+	struct SlabMagazine *m;
+	uint32_t eflags = read_eflags();
+	int i;
+
+	__asm __volatile("cli");
+	m = &cp->sc_mag[cpunum()];
+	if (m->sm_count == SLAB_MAGSIZE) {
+		// Flush the older half; the newer half is still warm.
+		spin_lock(&cp->sc_lock);
+		for (i = 0; i < SLAB_MAGSIZE / 2; i++)
+			slab_put(cp, m->sm_objs[i]);
+		spin_unlock(&cp->sc_lock);
+		m->sm_count -= SLAB_MAGSIZE / 2;
+		memmove(m->sm_objs, m->sm_objs + SLAB_MAGSIZE / 2,
+			m->sm_count * sizeof(m->sm_objs[0]));
+		m->sm_flush++;
+	}
+	m->sm_objs[m->sm_count++] = obj;
+	m->sm_free++;
+	write_eflags(eflags);
+}
+
+
+/***** malloc *****/
+
+//
+// Allocate 'size' bytes from the smallest size class that fits, or,
+// above SLAB_MAXSIZE, a power-of-two run of whole pages.
+// Returns NULL if size is 0 or memory is exhausted.
+//
+void *
+malloc(size_t size)
+{
+	struct Page *pp;
+	int i, order;
+
+	if (size == 0)
+		return NULL;
+	if (size <= SLAB_MAXSIZE) {
+		for (i = 0; (SLAB_MINSIZE << i) < size; i++)
+			;
+		return slab_alloc(size_caches[i]);
+	}
+
+	for (order = 0; (PGSIZE << order) < size; order++)
+		if (order == PAGE_MAXORDER)
+			return NULL;
+	if (!(pp = page_alloc_order(order, 0)))
+		return NULL;
+	pp->pp_flags |= PP_MALLOC;
+	return page2kva(pp);
+}
+
+void
+free(void *addr)
+{
+	struct Page *pp;
+
+	if (addr == NULL)
+		return;
+	pp = pa2page(PADDR(addr));
+	if (pp->pp_flags & PP_SLAB)
+		slab_free(((struct Slab *) ROUNDDOWN(addr, PGSIZE))->sl_cache,
+			  addr);
+	else if ((pp->pp_flags & PP_MALLOC) && PGOFF(addr) == 0) {
+		pp->pp_flags &= ~PP_MALLOC;
+		if (pp->pp_order == 0)
+			page_free(pp);
+		else
+			page_free_order(pp, pp->pp_order);
+	} else
+		panic("free: %08x was not allocated by malloc", addr);
+}
+
+
+/***** Monitor commands *****/
+
+static int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	struct SlabCache *cp;
+	struct SlabMagazine *m;
+	uint32_t cached, allocs, frees, refills, flushes;
+	int i;
+
+	cprintf("%-12s %7s %5s %7s %7s %5s %9s %9s %7s %7s\n",
+		"cache", "objsize", "/slab", "active", "total", "slabs",
+		"allocs", "frees", "refills", "flushes");
+	read_lock(&caches_lock);
+	LIST_FOREACH(cp, &caches, sc_link) {
+		cached = allocs = frees = refills = flushes = 0;
+		for (i = 0; i < NCPU; i++) {
+			m = &cp->sc_mag[i];
+			cached += m->sm_count;
+			allocs += m->sm_alloc;
+			frees += m->sm_free;
+			refills += m->sm_refill;
+			flushes += m->sm_flush;
+		}
+		cprintf("%-12s %7u %5u %7u %7u %5u %9u %9u %7u %7u\n",
+			cp->sc_name, cp->sc_size, cp->sc_nobjs,
+			cp->sc_inuse - cached, cp->sc_nslabs * cp->sc_nobjs,
+			cp->sc_nslabs, allocs, frees, refills, flushes);
+	}
+	read_unlock(&caches_lock);
+	return 0;
+}
+MONITOR_COMMAND("slabinfo", "Display slab cache statistics", mon_slabinfo);
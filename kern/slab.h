@@ -0,0 +1,67 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define SLAB_MAGSIZE	32		// objects per per-CPU magazine
+#define SLAB_MINSIZE	16		// smallest malloc size class
+#define SLAB_MAXSIZE	1024		// larger mallocs get whole pages
+
+// A slab is one page: this header, a free-list link per object, then
+// the objects themselves, starting at a per-slab color offset.
+struct Slab {
+	LIST_ENTRY(Slab) sl_link;	// on its cache's full/partial/empty list
+	struct SlabCache *sl_cache;
+	char *sl_base;			// first object
+	uint16_t sl_inuse;		// objects not on sl_free
+	uint16_t sl_free;		// first free object index, or SLAB_NIL
+	uint16_t sl_next[];		// next free object index, by index
+};
+LIST_HEAD(Slab_list, Slab);
+
+// Each CPU keeps a stack of free objects in front of the slab layer.
+struct SlabMagazine {
+	int sm_count;
+	void *sm_objs[SLAB_MAGSIZE];
+	uint32_t sm_alloc;		// allocations served
+	uint32_t sm_free;		// frees taken
+	uint32_t sm_refill;		// batches pulled from slabs
+	uint32_t sm_flush;		// batches pushed back to slabs
+} __attribute__((aligned(CACHELINE)));
+
+struct SlabCache {
+	const char *sc_name;
+	size_t sc_size;			// object size, rounded to sc_align
+	size_t sc_align;
+	void (*sc_ctor)(void *obj);	// run once per object, at slab creation
+	uint16_t sc_nobjs;		// objects per slab
+	uint16_t sc_offset;		// offset of object 0 at color 0
+	uint16_t sc_ncolors;		// distinct slab color offsets
+	uint16_t sc_color;		// color of the next new slab
+	struct Spinlock sc_lock;	// guards the slab layer below
+	uint32_t sc_nslabs;
+	uint32_t sc_inuse;		// objects outside slab free lists
+	struct Slab_list sc_full, sc_partial, sc_empty;
+	LIST_ENTRY(SlabCache) sc_link;	// on the list of all caches
+	struct SlabMagazine sc_mag[NCPU];
+};
+
+void slab_init(void);
+
+// Objects from a cache created with a constructor must be freed in
+// their constructed state.
+struct SlabCache *slab_cache_create(const char *name, size_t size,
+				    size_t align, void (*ctor)(void *));
+void *slab_alloc(struct SlabCache *cp);
+void slab_free(struct SlabCache *cp, void *obj);
+
+#endif /* !JOS_KERN_SLAB_H */
@@ -0,0 +1,342 @@
+// Ticket, MCS and reader-writer spinlocks, with contention statistics.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/spinlock.h>
+#include <kern/cpu.h>
+#include <kern/monitor.h>
+
+// Keep the compiler from moving memory accesses across a lock
+// operation.  x86 does not reorder stores with other stores or loads
+// with other loads, so at release a plain store after this is enough.
+#define barrier()	__asm __volatile("" : : : "memory")
+
+// Every lock that has been taken, most recent first.  Locks are only
+// ever added, so the list can be walked without a lock.
+static struct LockStat *volatile lockstat_list;
+
+static void
+lockstat_init(struct LockStat *ls, const char *name, const char *type)
+{
+	memset(ls, 0, sizeof(*ls));
+	ls->ls_name = name;
+	ls->ls_type = type;
+}
+
+static void
+lockstat_list_add(struct LockStat *ls)
+{
+	struct LockStat *head;
+
+	if (xchg(&ls->ls_listed, 1))
+		return;
+	do {
+		head = lockstat_list;
+		ls->ls_next = head;
+	} while (cmpxchg((volatile uint32_t *) &lockstat_list,
+			 (uint32_t) head, (uint32_t) ls) != (uint32_t) head);
+}
+
+// Account for an acquisition that started waiting at 't0' (0 if it did
+// not have to wait) and finished at 'now'.  Called with the lock held.
+static void
+lockstat_acquired(struct LockStat *ls, uint64_t t0, uint64_t now)
+{
+	if (!ls->ls_listed)
+		lockstat_list_add(ls);
+	ls->ls_acquire++;
+	ls->ls_exclusive++;
+	if (t0) {
+		ls->ls_contended++;
+		ls->ls_wait += now - t0;
+	}
+}
+
+// Account for a hold that began at 't0'.  Called with the lock held.
+static void
+lockstat_released(struct LockStat *ls, uint64_t t0)
+{
+	uint64_t held = read_tsc() - t0;
+
+	ls->ls_hold += held;
+	if (held > ls->ls_hold_max)
+		ls->ls_hold_max = held;
+}
+
+
+/***** Ticket locks *****/
+
+void
+spin_init(struct Spinlock *lk, const char *name)
+{
+	lk->lk_owner = lk->lk_next = 0;
+	lk->lk_cpu = 0;
+	lockstat_init(&lk->lk_stat, name, "spin");
+}
+
+void
+spin_lock(struct Spinlock *lk)
+{
+	uint32_t old;
+	uint16_t ticket;
+	uint64_t t0 = 0;
+
+	if (spin_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding",
+		      cpunum(), lk->lk_stat.ls_name);
+
+	// Take a ticket: the high half of the word is lk_next.
+	old = xadd((volatile uint32_t *) &lk->lk_owner, 1 << 16);
+	ticket = old >> 16;
+	if ((uint16_t) old != ticket) {
+		t0 = read_tsc();
+		while (lk->lk_owner != ticket)
+			__asm __volatile("pause");
+	}
+	barrier();
+
+	lk->lk_cpu = cpunum() + 1;
+	lk->lk_tsc = read_tsc();
+	lockstat_acquired(&lk->lk_stat, t0, lk->lk_tsc);
+}
+
+// Take the lock if nobody holds it or waits for it.  Returns 1 if the
+// lock was taken.
+bool
+spin_trylock(struct Spinlock *lk)
+{
+	uint32_t old = *(volatile uint32_t *) &lk->lk_owner;
+
+	// Free means lk_owner == lk_next; take the next ticket only then.
+	if ((uint16_t) old != (old >> 16)
+	    || cmpxchg((volatile uint32_t *) &lk->lk_owner,
+		       old, old + (1 << 16)) != old)
+		return 0;
+	lk->lk_cpu = cpunum() + 1;
+	lk->lk_tsc = read_tsc();
+	lockstat_acquired(&lk->lk_stat, 0, lk->lk_tsc);
+	return 1;
+}
+
+void
+spin_unlock(struct Spinlock *lk)
+{
+	if (!spin_holding(lk))
+		panic("CPU %d cannot release %s: not holding",
+		      cpunum(), lk->lk_stat.ls_name);
+
+	lockstat_released(&lk->lk_stat, lk->lk_tsc);
+	lk->lk_cpu = 0;
+	barrier();
+	// Only the holder writes lk_owner, and a 16-bit store leaves the
+	// lk_next half of the word alone.
+	lk->lk_owner++;
+}
+
+
+/***** MCS locks *****/
+
+void
+mcs_init(struct McsLock *lk, const char *name)
+{
+	lk->mcs_tail = NULL;
+	lk->mcs_cpu = 0;
+	lockstat_init(&lk->mcs_stat, name, "mcs");
+}
+
+void
+mcs_lock(struct McsLock *lk, struct McsNode *n)
+{
+	struct McsNode *prev;
+	uint64_t t0 = 0;
+
+	if (mcs_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding",
+		      cpunum(), lk->mcs_stat.ls_name);
+
+	n->mn_next = NULL;
+	n->mn_locked = 1;
+	prev = (struct McsNode *) xchg((volatile uint32_t *) &lk->mcs_tail,
+				       (uint32_t) n);
+	if (prev) {
+		// Queue behind 'prev', which clears our flag when it is done.
+		t0 = read_tsc();
+		prev->mn_next = n;
+		while (n->mn_locked)
+			__asm __volatile("pause");
+	}
+	barrier();
+
+	lk->mcs_cpu = cpunum() + 1;
+	lk->mcs_tsc = read_tsc();
+	lockstat_acquired(&lk->mcs_stat, t0, lk->mcs_tsc);
+}
+
+void
+mcs_unlock(struct McsLock *lk, struct McsNode *n)
+{
+	if (!mcs_holding(lk))
+		panic("CPU %d cannot release %s: not holding",
+		      cpunum(), lk->mcs_stat.ls_name);
+
+	lockstat_released(&lk->mcs_stat, lk->mcs_tsc);
+	lk->mcs_cpu = 0;
+	barrier();
+	if (!n->mn_next) {
+		// No known successor: free the lock, unless someone has
+		// just swapped themselves in as the tail.
+		if (cmpxchg((volatile uint32_t *) &lk->mcs_tail,
+			    (uint32_t) n, 0) == (uint32_t) n)
+			return;
+		// They have; wait for them to link in behind us.
+		while (!n->mn_next)
+			__asm __volatile("pause");
+	}
+	n->mn_next->mn_locked = 0;
+}
+
+
+/***** Reader-writer locks *****/
+
+void
+rw_init(struct RwLock *lk, const char *name)
+{
+	lk->rw_state = 0;
+	lk->rw_cpu = 0;
+	lockstat_init(&lk->rw_stat, name, "rw");
+}
+
+// Readers share the lock, so their statistics are updated atomically,
+// and hold times are only kept for writers.
+void
+read_lock(struct RwLock *lk)
+{
+	uint32_t s;
+	uint64_t t0 = 0;
+
+	if (lk->rw_cpu == cpunum() + 1)
+		panic("CPU %d cannot read %s: already writing",
+		      cpunum(), lk->rw_stat.ls_name);
+
+	for (;;) {
+		s = lk->rw_state;
+		if (!(s & (RW_WRITER | RW_WAITING))
+		    && cmpxchg(&lk->rw_state, s, s + RW_READER) == s)
+			break;
+		if (!t0)
+			t0 = read_tsc();
+		__asm __volatile("pause");
+	}
+	barrier();
+
+	if (!lk->rw_stat.ls_listed)
+		lockstat_list_add(&lk->rw_stat);
+	xadd(&lk->rw_stat.ls_acquire, 1);
+	if (t0)
+		xadd(&lk->rw_stat.ls_contended, 1);
+}
+
+void
+read_unlock(struct RwLock *lk)
+{
+	assert(lk->rw_state >= RW_READER);
+	xadd(&lk->rw_state, -RW_READER);
+}
+
+void
+write_lock(struct RwLock *lk)
+{
+	uint32_t s;
+	uint64_t t0 = 0;
+
+	if (lk->rw_cpu == cpunum() + 1)
+		panic("CPU %d cannot acquire %s: already holding",
+		      cpunum(), lk->rw_stat.ls_name);
+
+	for (;;) {
+		s = lk->rw_state;
+		// Nobody in, at most writers waiting: take it, which
+		// clears RW_WAITING.  Another waiting writer sets it again.
+		if ((s & ~RW_WAITING) == 0
+		    && cmpxchg(&lk->rw_state, s, RW_WRITER) == s)
+			break;
+		if (!(s & RW_WAITING))
+			cmpxchg(&lk->rw_state, s, s | RW_WAITING);
+		if (!t0)
+			t0 = read_tsc();
+		__asm __volatile("pause");
+	}
+	barrier();
+
+	lk->rw_cpu = cpunum() + 1;
+	lk->rw_tsc = read_tsc();
+	lockstat_acquired(&lk->rw_stat, t0, lk->rw_tsc);
+}
+
+void
+write_unlock(struct RwLock *lk)
+{
+	if (lk->rw_cpu != cpunum() + 1)
+		panic("CPU %d cannot release %s: not writing",
+		      cpunum(), lk->rw_stat.ls_name);
+
+	lockstat_released(&lk->rw_stat, lk->rw_tsc);
+	lk->rw_cpu = 0;
+	// Clear RW_WRITER, keeping any RW_WAITING another writer set.
+	xadd(&lk->rw_state, -RW_WRITER);
+}
+
+
+/***** Monitor commands *****/
+
+#define LOCKSTAT_MAX	64
+
+static int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct LockStat *ls, *sorted[LOCKSTAT_MAX];
+	int i, n = 0;
+
+	if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+		for (ls = lockstat_list; ls; ls = ls->ls_next) {
+			ls->ls_acquire = ls->ls_contended = 0;
+			ls->ls_exclusive = 0;
+			ls->ls_wait = ls->ls_hold = ls->ls_hold_max = 0;
+		}
+		return 0;
+	}
+	if (argc != 1) {
+		cprintf("usage: lockstat [reset]\n");
+		return 0;
+	}
+
+	// Most time spent waiting first.
+	for (ls = lockstat_list; ls && n < LOCKSTAT_MAX; ls = ls->ls_next) {
+		for (i = n++; i > 0 && sorted[i-1]->ls_wait < ls->ls_wait; i--)
+			sorted[i] = sorted[i-1];
+		sorted[i] = ls;
+	}
+
+	cprintf("%-14s %-4s %10s %9s %5s %10s %10s %10s\n", "lock", "type",
+		"acquired", "contended", "%", "avg wait", "avg hold",
+		"max hold");
+	for (i = 0; i < n; i++) {
+		ls = sorted[i];
+		cprintf("%-14s %-4s %10u %9u %4u%% %10llu %10llu %10llu\n",
+			ls->ls_name, ls->ls_type, ls->ls_acquire,
+			ls->ls_contended,
+			ls->ls_acquire
+			? (uint32_t) (100ULL * ls->ls_contended / ls->ls_acquire)
+			: 0,
+			ls->ls_contended ? ls->ls_wait / ls->ls_contended : 0,
+			ls->ls_exclusive ? ls->ls_hold / ls->ls_exclusive : 0,
+			ls->ls_hold_max);
+	}
+	cprintf("(times in TSC cycles; reader hold times are not kept)\n");
+	return 0;
+}
+MONITOR_COMMAND("lockstat", "Display lock contention statistics: lockstat [reset]", mon_lockstat);
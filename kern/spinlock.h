@@ -0,0 +1,119 @@
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/cpu.h>
+
+// Kernel spinning locks.
+//
+// struct Spinlock is a ticket lock: CPUs get the lock in the order
+// they asked for it, and waiting is a read of one shared word.  It
+// suits short critical sections with little contention.
+//
+// struct McsLock is a queued (Mellor-Crummey and Scott) lock: each
+// waiter spins on a flag in its own struct McsNode, which the caller
+// supplies (usually on its stack) and must pass to both mcs_lock() and
+// mcs_unlock().  Handing the lock over touches only the next waiter's
+// cache line, so it stays cheap under heavy contention.
+//
+// struct RwLock lets any number of readers in at once, or one writer.
+// A waiting writer keeps new readers out, so writers are not starved.
+//
+// None of these disable interrupts.  A lock that an interrupt handler
+// takes must be held with interrupts disabled everywhere, or the
+// handler can spin forever on a lock its own CPU holds.  Locks are not
+// recursive.
+//
+// Every lock keeps a struct LockStat.  A lock joins the list that the
+// 'lockstat' command reports on the first time it is taken.
+
+struct LockStat {
+	const char *ls_name;
+	const char *ls_type;		// "spin", "mcs" or "rw"
+	uint32_t ls_acquire;		// acquisitions
+	uint32_t ls_contended;		// acquisitions that had to wait
+	uint64_t ls_wait;		// TSC cycles spent waiting
+	uint32_t ls_exclusive;		// acquisitions not shared with others
+	uint64_t ls_hold;		// TSC cycles held (exclusively)
+	uint64_t ls_hold_max;		// longest hold
+	uint32_t ls_listed;		// on the lockstat list
+	struct LockStat *ls_next;
+};
+
+#define LOCKSTAT_INITIALIZER(name, type)	{ (name), (type) }
+
+struct Spinlock {
+	volatile uint16_t lk_owner;	// ticket being served; must be first
+	volatile uint16_t lk_next;	// next ticket to hand out
+	int lk_cpu;			// holding CPU + 1, or 0 if free
+	uint64_t lk_tsc;		// when it was acquired
+	struct LockStat lk_stat;
+};
+
+#define SPINLOCK_INITIALIZER(name) \
+	{ 0, 0, 0, 0, LOCKSTAT_INITIALIZER(name, "spin") }
+
+struct McsNode {
+	struct McsNode *volatile mn_next;	// next waiter
+	volatile uint32_t mn_locked;		// 1 while we must wait
+} __attribute__((aligned(CACHELINE)));
+
+struct McsLock {
+	struct McsNode *volatile mcs_tail;	// last waiter, NULL if free
+	int mcs_cpu;
+	uint64_t mcs_tsc;
+	struct LockStat mcs_stat;
+};
+
+#define MCSLOCK_INITIALIZER(name) \
+	{ NULL, 0, 0, LOCKSTAT_INITIALIZER(name, "mcs") }
+
+struct RwLock {
+	// RW_WRITER if a writer holds the lock, plus RW_WAITING if a
+	// writer waits for it, plus RW_READER times the number of readers.
+	volatile uint32_t rw_state;
+	int rw_cpu;			// writing CPU + 1
+	uint64_t rw_tsc;
+	struct LockStat rw_stat;
+};
+
+#define RW_WRITER	0x1
+#define RW_WAITING	0x2
+#define RW_READER	0x4
+
+#define RWLOCK_INITIALIZER(name) \
+	{ 0, 0, 0, LOCKSTAT_INITIALIZER(name, "rw") }
+
+void spin_init(struct Spinlock *lk, const char *name);
+void spin_lock(struct Spinlock *lk);
+bool spin_trylock(struct Spinlock *lk);
+void spin_unlock(struct Spinlock *lk);
+
+void mcs_init(struct McsLock *lk, const char *name);
+void mcs_lock(struct McsLock *lk, struct McsNode *n);
+void mcs_unlock(struct McsLock *lk, struct McsNode *n);
+
+void rw_init(struct RwLock *lk, const char *name);
+void read_lock(struct RwLock *lk);
+void read_unlock(struct RwLock *lk);
+void write_lock(struct RwLock *lk);
+void write_unlock(struct RwLock *lk);
+
+// Does this CPU hold the lock?
+static inline bool
+spin_holding(struct Spinlock *lk)
+{
+	return lk->lk_cpu == cpunum() + 1;
+}
+
+static inline bool
+mcs_holding(struct McsLock *lk)
+{
+	return lk->mcs_cpu == cpunum() + 1;
+}
+
+#endif	// !JOS_KERN_SPINLOCK_H
@@ -0,0 +1,525 @@
+/* See COPYRIGHT for copyright information. */
+
+// Time keeping and kernel timeouts.
+//
+// timer_ns() is a monotonic nanosecond clock read from the TSC, which
+// timer_init() calibrates against the PIT.
+//
+// Timeouts live on a per-CPU hierarchical timer wheel (Varghese and
+// Lauck): arming or cancelling one is a list insert or remove, and
+// each tick touches one slot, plus, every TIMER_WHEEL_SIZE ticks, the
+// timers of one slot on the next level up, which are redistributed
+// ("cascaded") into finer slots as their deadlines draw near.
+//
+// There is no periodic tick.  The timer interrupt is one-shot,
+// programmed on the local APIC timer when there is one and on PIT
+// counter 0 otherwise, for the next time the wheel has work to do, so
+// an idle CPU sleeps until a deadline or a device wakes it.  While the
+// profiler wants a periodic interrupt, the wheel runs off that instead.
+// Each CPU has its own timer, so timer_periodic() switches every CPU,
+// by IRQ_CLOCK; a CPU that missed that catches up the next time it
+// arms its timer.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/timer.h>
+#include <kern/kclock.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/prof.h>
+#include <kern/idle.h>
+#include <kern/monitor.h>
+
+#define WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define MAX_TICKS	((1ULL << (TIMER_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+// How long timer_init() watches the TSC to calibrate it, and how many
+// times (keeping the shortest, least disturbed run).
+#define CALIBRATE_US	10000
+#define CALIBRATE_RUNS	3
+
+struct TimerBase {
+	uint64_t tb_tick;		// next tick to process
+	uint64_t tb_armed;		// deadline the hardware is set for, or 0
+	unsigned tb_hz;			// periodic rate running here, or 0
+	uint64_t tb_map[TIMER_LEVELS];	// non-empty slots
+	struct Timer_list tb_wheel[TIMER_LEVELS][TIMER_WHEEL_SIZE];
+
+	// Statistics
+	uint32_t tb_pending;		// timers on the wheel
+	uint32_t tb_fired;
+	uint32_t tb_cancelled;
+	uint32_t tb_cascaded;		// timers moved down a level
+	uint32_t tb_intrs;		// timer interrupts
+} __attribute__((aligned(CACHELINE)));
+
+static struct TimerBase timer_bases[NCPU];
+
+uint64_t tsc_hz;
+static uint64_t tsc_boot;		// TSC at timer_ns() == 0
+static uint32_t tsc_mult;		// TSC cycles -> ns
+static int tsc_shift;
+static uint32_t hw_mult;		// ns -> one-shot timer counts
+static int hw_shift;
+static uint32_t hw_max;			// longest one-shot, in counts
+static volatile unsigned periodic_hz;	// profiler's rate, or 0 for one-shot
+
+// Find mult and shift so that mul_shift(x, mult, shift) is about
+// x * to / from, as precisely as 32 bits of mult allow.
+static void
+clock_scale(uint64_t from, uint64_t to, uint32_t *mult, int *shift)
+{
+	uint64_t m;
+	int s;
+
+	for (s = 32; s > 1; s--)
+		if ((m = (to << s) / from) <= 0xFFFFFFFF)
+			break;
+	assert(m <= 0xFFFFFFFF);
+	*mult = m;
+	*shift = s;
+}
+
+static uint64_t
+tsc_calibrate(void)
+{
+	uint64_t t0, t, best = ~0ULL;
+	int i;
+
+	for (i = 0; i < CALIBRATE_RUNS; i++) {
+		t0 = read_tsc();
+		pit_delay(CALIBRATE_US);
+		t = read_tsc() - t0;
+		if (t < best)
+			best = t;
+	}
+	return best * (1000000 / CALIBRATE_US);
+}
+
+void
+timer_init(void)
+{
+	struct TimerBase *tb;
+	int i, l, s;
+
+	tsc_hz = tsc_calibrate();
+	clock_scale(tsc_hz, NSEC_PER_SEC, &tsc_mult, &tsc_shift);
+	tsc_boot = read_tsc();
+
+	if (lapic) {
+		clock_scale(NSEC_PER_SEC, lapic_timer_hz, &hw_mult, &hw_shift);
+		hw_max = 0xFFFFFFFF;
+	} else {
+		clock_scale(NSEC_PER_SEC, TIMER_FREQ, &hw_mult, &hw_shift);
+		hw_max = 0xFFFF;
+	}
+
+	for (i = 0; i < NCPU; i++) {
+		tb = &timer_bases[i];
+		for (l = 0; l < TIMER_LEVELS; l++)
+			for (s = 0; s < TIMER_WHEEL_SIZE; s++)
+				LIST_INIT(&tb->tb_wheel[l][s]);
+	}
+	cprintf("TSC: %u.%03u MHz\n", (uint32_t) (tsc_hz / 1000000),
+		(uint32_t) (tsc_hz / 1000 % 1000));
+}
+
+// Nanoseconds since timer_init().
+uint64_t
+timer_ns(void)
+{
+	return mul_shift(read_tsc() - tsc_boot, tsc_mult, tsc_shift);
+}
+
+
+/***** The wheel *****/
+
+// Callers have interrupts disabled.
+
+static void
+wheel_insert(struct TimerBase *tb, struct Timer *t)
+{
+	uint64_t tick = t->t_tick, delta;
+	int level, slot;
+
+	if (tick < tb->tb_tick)
+		tick = tb->tb_tick;	// overdue: run on the next tick
+	delta = tick - tb->tb_tick;
+	if (delta > MAX_TICKS)
+		tick = tb->tb_tick + (delta = MAX_TICKS);
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < (1ULL << ((level + 1) * TIMER_WHEEL_BITS)))
+			break;
+	slot = (tick >> (level * TIMER_WHEEL_BITS)) & WHEEL_MASK;
+	LIST_INSERT_HEAD(&tb->tb_wheel[level][slot], t, t_link);
+	tb->tb_map[level] |= 1ULL << slot;
+}
+
+static void
+wheel_remove(struct TimerBase *tb, struct Timer *t)
+{
+	struct Timer_list *head;
+	int level, slot;
+
+	// An empty slot has a NULL head; if t is the head, its le_prev
+	// points into tb_wheel, which tells us which slot to check.
+	LIST_REMOVE(t, t_link);
+	head = (struct Timer_list *) t->t_link.le_prev;
+	t->t_link.le_prev = NULL;
+	if (head >= &tb->tb_wheel[0][0]
+	    && head < &tb->tb_wheel[TIMER_LEVELS][0] && LIST_EMPTY(head)) {
+		level = (head - &tb->tb_wheel[0][0]) / TIMER_WHEEL_SIZE;
+		slot = (head - &tb->tb_wheel[0][0]) % TIMER_WHEEL_SIZE;
+		tb->tb_map[level] &= ~(1ULL << slot);
+	}
+}
+
+// Detach every timer in a slot onto 'list'.
+static void
+wheel_take(struct TimerBase *tb, int level, int slot, struct Timer_list *list)
+{
+	struct Timer_list *head = &tb->tb_wheel[level][slot];
+
+	LIST_FIRST(list) = LIST_FIRST(head);
+	if (LIST_FIRST(list))
+		LIST_FIRST(list)->t_link.le_prev = &LIST_FIRST(list);
+	LIST_INIT(head);
+	tb->tb_map[level] &= ~(1ULL << slot);
+}
+
+// Move the timers in the current slot of 'level' down the wheel.
+// Returns the slot index, which is 0 when the level above is due too.
+static int
+wheel_cascade(struct TimerBase *tb, int level)
+{
+	struct Timer_list list;
+	struct Timer *t;
+	int slot = (tb->tb_tick >> (level * TIMER_WHEEL_BITS)) & WHEEL_MASK;
+
+	wheel_take(tb, level, slot, &list);
+	while ((t = LIST_FIRST(&list))) {
+		LIST_REMOVE(t, t_link);
+		wheel_insert(tb, t);
+		tb->tb_cascaded++;
+	}
+	return slot;
+}
+
+// Run every timer due at or before tick 'now'.
+static void
+wheel_run(struct TimerBase *tb, uint64_t now)
+{
+	struct Timer_list list;
+	struct Timer *t;
+	int slot, level;
+
+	while (tb->tb_tick <= now) {
+		// With nothing on level 0, nothing can run before the next
+		// cascade, so after a long sleep go straight there.
+		if (!tb->tb_map[0] && (tb->tb_tick & WHEEL_MASK)) {
+			tb->tb_tick = MIN(now + 1, (tb->tb_tick | WHEEL_MASK) + 1);
+			continue;
+		}
+
+		slot = tb->tb_tick & WHEEL_MASK;
+		for (level = 1; slot == 0 && level < TIMER_LEVELS; level++)
+			slot = wheel_cascade(tb, level);
+		slot = tb->tb_tick & WHEEL_MASK;
+
+		// Advance first, so that a timer re-armed from its own
+		// callback lands in a later slot.
+		tb->tb_tick++;
+		wheel_take(tb, 0, slot, &list);
+		while ((t = LIST_FIRST(&list))) {
+			LIST_REMOVE(t, t_link);
+			t->t_link.le_prev = NULL;
+			tb->tb_pending--;
+			tb->tb_fired++;
+			t->t_func(t->t_arg);
+		}
+	}
+}
+
+// Index of the lowest set bit of x, which is not 0.
+static int
+lowbit64(uint64_t x)
+{
+	if ((uint32_t) x)
+		return __builtin_ctz((uint32_t) x);
+	return 32 + __builtin_ctz((uint32_t) (x >> 32));
+}
+
+// The tick by which the wheel must next turn: the deadline of the
+// first timer on level 0 or, if sooner, the next time a non-empty slot
+// further up is cascaded (its timers are due no earlier than that).
+// There must be a timer pending.
+static uint64_t
+wheel_next(struct TimerBase *tb)
+{
+	uint64_t next = ~0ULL, map, base;
+	int level, shift, cur, k;
+
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		if (!(map = tb->tb_map[level]))
+			continue;
+		shift = level * TIMER_WHEEL_BITS;
+		base = tb->tb_tick >> shift;
+		cur = base & WHEEL_MASK;
+
+		// Slot offsets from the current one: bit k of 'map' is
+		// the slot k positions on.
+		if (cur)
+			map = (map >> cur) | (map << (TIMER_WHEEL_SIZE - cur));
+		// The current slot of an upper level was cascaded at the
+		// start of this round unless the round starts just now;
+		// anything in it since then waits a whole revolution.
+		if (level > 0 && (tb->tb_tick & ((1ULL << shift) - 1))
+		    && !(map &= ~1ULL))
+			k = TIMER_WHEEL_SIZE;
+		else
+			k = lowbit64(map);
+		next = MIN(next, (base + k) << shift);
+	}
+	return next;
+}
+
+
+/***** Programming the hardware *****/
+
+// Put this CPU's timer hardware in the mode timer_periodic() last
+// asked for.  Whatever one-shot was armed is gone either way.
+static void
+timer_sync(struct TimerBase *tb)
+{
+	unsigned hz = periodic_hz;
+
+	if (tb->tb_hz == hz)
+		return;
+	if (tb->tb_hz)
+		kclock_stop();
+	tb->tb_hz = hz;
+	tb->tb_armed = 0;
+	if (hz)
+		kclock_start(hz);
+}
+
+// Arrange for a timer interrupt at 'when', or soon after it.
+static void
+timer_arm(struct TimerBase *tb, uint64_t when)
+{
+	uint64_t now = timer_ns(), count;
+
+	timer_sync(tb);
+	tb->tb_armed = when;
+	if (tb->tb_hz)
+		return;
+	count = when > now ? mul_shift(when - now, hw_mult, hw_shift) : 0;
+	if (count < 1)
+		count = 1;
+	if (count > hw_max)
+		count = hw_max;		// wake up early and re-arm
+	if (lapic)
+		lapic_timer_oneshot(count);
+	else
+		kclock_oneshot(count);
+}
+
+// Re-arm the hardware for the next thing on the wheel, if anything.
+// With nothing pending, no timer interrupt comes at all.
+static void
+timer_rearm(struct TimerBase *tb)
+{
+	tb->tb_armed = 0;
+	if (tb->tb_pending)
+		timer_arm(tb, wheel_next(tb) << TIMER_TICK_SHIFT);
+}
+
+void
+timer_intr(struct Trapframe *tf)
+{
+	struct TimerBase *tb = &timer_bases[cpunum()];
+
+	prof_tick(tf);
+	tb->tb_intrs++;
+	wheel_run(tb, timer_ns() >> TIMER_TICK_SHIFT);
+	timer_rearm(tb);
+}
+
+//
+// Follow a change made by timer_periodic(), here on IRQ_CLOCK.
+// Interrupts must be off.
+//
+void
+timer_resync(void)
+{
+	struct TimerBase *tb = &timer_bases[cpunum()];
+
+	if (tb->tb_hz == periodic_hz)
+		return;
+	timer_sync(tb);
+	if (!tb->tb_hz)
+		timer_rearm(tb);
+}
+
+//
+// Interrupt 'hz' times a second on every CPU, for the profiler, or go
+// back to one-shot interrupts if 'hz' is 0.  The wheels keep running
+// either way.
+//
+void
+timer_periodic(unsigned hz)
+{
+	uint32_t eflags = read_eflags();
+	int i;
+
+	__asm __volatile("cli");
+	periodic_hz = hz;
+	timer_resync();
+	for (i = 0; i < ncpu && lapic; i++)
+		if (i != cpunum() && (&cpus[i] == bootcpu
+				      || cpus[i].cpu_status == CPU_STARTED))
+			lapic_ipi(cpus[i].cpu_apicid, IRQ_OFFSET + IRQ_CLOCK);
+	write_eflags(eflags);
+}
+
+
+/***** Interface *****/
+
+void
+timer_setup(struct Timer *t, void (*func)(void *), void *arg)
+{
+	memset(t, 0, sizeof(*t));
+	t->t_func = func;
+	t->t_arg = arg;
+}
+
+//
+// Arm 't' to fire at 'when' (in timer_ns() time) on this CPU.
+// If it is already armed, it is moved.
+//
+void
+timer_add(struct Timer *t, uint64_t when)
+{
+	struct TimerBase *tb;
+	uint32_t eflags = read_eflags();
+
+	__asm __volatile("cli");
+	if (timer_pending(t)) {
+		tb = &timer_bases[t->t_cpu];
+		wheel_remove(tb, t);
+		tb->tb_pending--;
+	}
+	t->t_cpu = cpunum();
+	t->t_when = when;
+	t->t_tick = (when + TIMER_TICK_NS - 1) >> TIMER_TICK_SHIFT;
+	tb = &timer_bases[t->t_cpu];
+	if (tb->tb_pending == 0)
+		// Nothing to run in the ticks since the wheel last
+		// turned, so skip them.
+		tb->tb_tick = MAX(tb->tb_tick, timer_ns() >> TIMER_TICK_SHIFT);
+	wheel_insert(tb, t);
+	tb->tb_pending++;
+	when = MAX(t->t_tick, tb->tb_tick) << TIMER_TICK_SHIFT;
+	if (!tb->tb_armed || when < tb->tb_armed)
+		timer_arm(tb, when);
+	write_eflags(eflags);
+}
+
+//
+// Disarm 't'.  Returns true if it was armed, false if it had already
+// fired or was never armed.  Must be called on the CPU that armed it.
+//
+bool
+timer_cancel(struct Timer *t)
+{
+	struct TimerBase *tb = &timer_bases[t->t_cpu];
+	uint32_t eflags = read_eflags();
+	bool pending;
+
+	__asm __volatile("cli");
+	if ((pending = timer_pending(t))) {
+		wheel_remove(tb, t);
+		tb->tb_pending--;
+		tb->tb_cancelled++;
+	}
+	write_eflags(eflags);
+	return pending;
+}
+
+
+/***** Monitor commands *****/
+
+static int
+popcount64(uint64_t x)
+{
+	int n;
+
+	for (n = 0; x; n++)
+		x &= x - 1;
+	return n;
+}
+
+static int
+mon_timers(int argc, char **argv, struct Trapframe *tf)
+{
+	struct TimerBase *tb;
+	uint64_t now = timer_ns();
+	int i, l;
+
+	cprintf("clock %s, TSC %u kHz, up %llu.%06u s, %s interrupts\n",
+		lapic ? "LAPIC timer" : "PIT", (uint32_t) (tsc_hz / 1000),
+		now / NSEC_PER_SEC, (uint32_t) (now % NSEC_PER_SEC / 1000),
+		periodic_hz ? "periodic" : "one-shot");
+	cprintf("cpu %8s %8s %9s %9s %8s %8s %5s  slots used per level\n",
+		"pending", "fired", "cancelled", "cascaded", "intrs", "armed",
+		"hz");
+	for (i = 0; i < ncpu; i++) {
+		tb = &timer_bases[i];
+		cprintf("%3d %8u %8u %9u %9u %8u %8s %5u ", i, tb->tb_pending,
+			tb->tb_fired, tb->tb_cancelled, tb->tb_cascaded,
+			tb->tb_intrs, tb->tb_armed ? "yes" : "no", tb->tb_hz);
+		for (l = 0; l < TIMER_LEVELS; l++)
+			cprintf(" %2d", popcount64(tb->tb_map[l]));
+		cprintf("\n");
+	}
+	return 0;
+}
+MONITOR_COMMAND("timers", "Display the clock and timer wheel statistics", mon_timers);
+
+static void
+sleep_done(void *arg)
+{
+	*(volatile bool *) arg = 1;
+}
+
+static bool
+sleep_ready(void *arg)
+{
+	return *(volatile bool *) arg;
+}
+
+static int
+mon_sleep(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Timer t;
+	volatile bool done = 0;
+	uint64_t start;
+
+	if (argc != 2) {
+		cprintf("usage: sleep ms\n");
+		return 0;
+	}
+	timer_setup(&t, sleep_done, (void *) &done);
+	start = timer_ns();
+	timer_add(&t, start + strtol(argv[1], NULL, 0) * NSEC_PER_MSEC);
+	while (!done)
+		idle_wait(sleep_ready, (void *) &done);
+	cprintf("slept %llu us\n", (timer_ns() - start) / NSEC_PER_USEC);
+	return 0;
+}
+MONITOR_COMMAND("sleep", "Wait on a kernel timer for the given number of milliseconds", mon_sleep);
@@ -0,0 +1,69 @@
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+#include <inc/trap.h>
+
+// Timer wheel granularity: 2^TIMER_TICK_SHIFT ns, about a millisecond.
+// Timers never fire early, and usually less than a tick late.
+#define TIMER_TICK_SHIFT	20
+#define TIMER_TICK_NS		(1ULL << TIMER_TICK_SHIFT)
+
+// The wheel has TIMER_LEVELS levels of 2^TIMER_WHEEL_BITS slots; a slot
+// on level n spans 2^(n*TIMER_WHEEL_BITS) ticks.  Deadlines further out
+// than the top level reaches (about 13 days) are clamped to it.
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_LEVELS		5
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_MSEC		1000000ULL
+#define NSEC_PER_USEC		1000ULL
+
+// A kernel timeout.  Set it up with timer_setup() and arm it with
+// timer_add(); 't_func' is then called once, on the CPU that armed it,
+// from the timer interrupt with interrupts disabled.
+struct Timer {
+	LIST_ENTRY(Timer) t_link;	// slot list; le_prev NULL if idle
+	uint64_t t_when;		// deadline, in timer_ns() time
+	uint64_t t_tick;		// deadline rounded up to a tick
+	void (*t_func)(void *arg);
+	void *t_arg;
+	uint8_t t_cpu;			// whose wheel it is on
+};
+
+LIST_HEAD(Timer_list, Timer);
+
+extern uint64_t tsc_hz;			// TSC cycles per second
+
+void timer_init(void);
+uint64_t timer_ns(void);
+void timer_setup(struct Timer *t, void (*func)(void *), void *arg);
+void timer_add(struct Timer *t, uint64_t when);
+bool timer_cancel(struct Timer *t);
+void timer_periodic(unsigned hz);
+void timer_resync(void);
+void timer_intr(struct Trapframe *tf);
+
+static inline bool
+timer_pending(struct Timer *t)
+{
+	return t->t_link.le_prev != NULL;
+}
+
+// (x * mult) >> shift, without a 64-bit multiply or divide.
+// 'shift' is between 1 and 32.
+static inline uint64_t
+mul_shift(uint64_t x, uint32_t mult, int shift)
+{
+	uint64_t lo = (uint64_t) (uint32_t) x * mult;
+	uint64_t hi = (uint64_t) (uint32_t) (x >> 32) * mult;
+
+	return (lo >> shift) + (hi << (32 - shift));
+}
+
+#endif	// !JOS_KERN_TIMER_H
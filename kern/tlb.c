@@ -0,0 +1,369 @@
+// TLB maintenance, plus a benchmark for the cost of refilling the TLB
+// after an address-space switch.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+
+#include <kern/tlb.h>
+#include <kern/pmap.h>
+#include <kern/monitor.h>
+#include <kern/cpu.h>
+
+void
+tlbflush_global(void)
+{
+	uint32_t cr4 = rcr4();
+
+	// Toggling CR4.PGE invalidates all entries, global or not.
+	if (cr4 & CR4_PGE) {
+		lcr4(cr4 & ~CR4_PGE);
+		lcr4(cr4);
+	} else
+		tlbflush();
+}
+
+// Per-CPU queue of pending invalidations.  Queued addresses are page
+// aligned; the low bit marks a global mapping, which a %cr3 reload
+// does not flush.
+#define TLB_VA_GLOBAL	0x1
+
+struct TlbCpu {
+	struct TlbSpace *tc_space;	// address space loaded in %cr3
+	uint32_t tc_gen;		// tc_space->ts_gen the TLB last matched
+	uint32_t tc_local;		// ts_gen bumps since then queued here
+	int tc_n;
+	bool tc_full;			// queue overflowed: flush everything
+	bool tc_global;			// a global mapping was queued
+	uintptr_t tc_va[TLB_QUEUE_MAX];
+	uint32_t tc_shoot;		// CPUs (bitmask) to shoot down
+	bool tc_shoot_global;		// ... including global entries
+
+	uint32_t tc_queued;		// invalidations requested
+	uint32_t tc_invlpg;		// invlpg instructions issued
+	uint32_t tc_flush;		// full non-global flushes
+	uint32_t tc_gflush;		// full flushes including global pages
+	uint32_t tc_stale;		// queued pages a %cr3 load made moot
+	uint32_t tc_kept;		// switches that kept the TLB as it was
+	uint32_t tc_remote;		// switches that found others' changes
+	uint32_t tc_sent;		// shootdowns sent
+	uint32_t tc_recv;		// shootdowns served
+
+	// Shootdown requests from other CPUs, on a line of their own.
+	volatile uint32_t tc_req_flags __attribute__((aligned(CACHELINE)));
+	volatile uint32_t tc_req;	// requests made
+	volatile uint32_t tc_done;	// tc_req as of the last flush
+} __attribute__((aligned(CACHELINE)));
+
+// tc_req_flags
+#define TLB_REQ_FLUSH	0x1
+#define TLB_REQ_GLOBAL	0x2
+
+static struct TlbCpu tlb_cpus[NCPU];
+
+struct TlbSpace kern_tlbspace;
+
+static void
+tlb_queue_reset(struct TlbCpu *tc)
+{
+	tc->tc_n = 0;
+	tc->tc_full = 0;
+	tc->tc_global = 0;
+	tc->tc_local = 0;
+	if (tc->tc_space)
+		tc->tc_gen = tc->tc_space->ts_gen;
+}
+
+static __inline void
+atomic_or(volatile uint32_t *addr, uint32_t bits)
+{
+	__asm __volatile("lock; orl %1, %0"
+			 : "+m" (*addr) : "r" (bits) : "memory", "cc");
+}
+
+// The address space loaded on this CPU.
+struct TlbSpace *
+tlb_current(void)
+{
+	return tlb_cpus[cpunum()].tc_space;
+}
+
+//
+// The mapping at 'va' in 'ts' used to be 'old' (a PTE, or a PDE for a
+// 4MB page) and has been changed.  The TLB only caches present
+// translations, so a fresh mapping needs nothing.  Nor does a
+// non-global one in an address space a CPU has not loaded: the %cr3
+// load that brings it back will flush it.
+//
+void
+tlb_invalidate(struct TlbSpace *ts, uintptr_t va, pte_t old)
+{
+	struct TlbCpu *tc, *oc;
+	uint32_t eflags = read_eflags();
+	int i;
+
+	if (!(old & PTE_P))
+		return;
+	__asm __volatile("cli");
+	xadd(&ts->ts_gen, 1);
+	tc = &tlb_cpus[cpunum()];
+	if (tc->tc_space == ts || (old & PTE_G)) {
+		tc->tc_queued++;
+		if (tc->tc_space == ts)
+			tc->tc_local++;
+		if (old & PTE_G)
+			tc->tc_global = 1;
+		if (tc->tc_n < TLB_QUEUE_MAX)
+			tc->tc_va[tc->tc_n++] = ROUNDDOWN(va, PGSIZE)
+				| ((old & PTE_G) ? TLB_VA_GLOBAL : 0);
+		else
+			tc->tc_full = 1;
+	}
+
+	// A CPU that loads 'ts' after this reads the new mapping, so only
+	// those that have it loaded now can hold the old one.
+	for (i = 0; i < ncpu && lapic; i++) {
+		oc = &tlb_cpus[i];
+		if (oc == tc || !oc->tc_space)
+			continue;
+		if (old & PTE_G) {
+			tc->tc_shoot |= 1 << i;
+			tc->tc_shoot_global = 1;
+		} else if (oc->tc_space == ts)
+			tc->tc_shoot |= 1 << i;
+	}
+	write_eflags(eflags);
+}
+
+//
+// Serve the shootdown requests other CPUs have made of this one.
+// Called from the IRQ_TLB handler, and by a CPU that waits on a
+// shootdown of its own, so that two CPUs shooting at each other with
+// interrupts disabled do not wait forever.  Interrupts must be off.
+//
+void
+tlb_shootdown(void)
+{
+	struct TlbCpu *tc = &tlb_cpus[cpunum()];
+	uint32_t req, flags;
+
+	// Read tc_req before taking the flags: a sender sets its flags
+	// before bumping tc_req, so every request counted is in 'flags'.
+	req = tc->tc_req;
+	if (tc->tc_done == req)
+		return;
+	flags = xchg(&tc->tc_req_flags, 0);
+	if (flags & TLB_REQ_GLOBAL) {
+		tlbflush_global();
+		tc->tc_gflush++;
+		tlb_queue_reset(tc);
+	} else if (flags) {
+		tlbflush();
+		tc->tc_flush++;
+		if (!tc->tc_global)
+			tlb_queue_reset(tc);
+	}
+	tc->tc_recv++;
+	tc->tc_done = req;
+}
+
+// Send the shootdowns tlb_invalidate() noted, and wait for every
+// target to have flushed.
+static void
+tlb_shoot(struct TlbCpu *tc)
+{
+	uint32_t mask = tc->tc_shoot, ticket[NCPU];
+	struct TlbCpu *oc;
+	int i;
+
+	if (!mask)
+		return;
+	tc->tc_shoot = 0;
+	for (i = 0; i < ncpu; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+		oc = &tlb_cpus[i];
+		atomic_or(&oc->tc_req_flags, tc->tc_shoot_global
+			  ? TLB_REQ_GLOBAL : TLB_REQ_FLUSH);
+		ticket[i] = xadd(&oc->tc_req, 1) + 1;
+		lapic_ipi(cpus[i].cpu_apicid, IRQ_OFFSET + IRQ_TLB);
+		tc->tc_sent++;
+	}
+	tc->tc_shoot_global = 0;
+	for (i = 0; i < ncpu; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+		oc = &tlb_cpus[i];
+		while ((int32_t) (oc->tc_done - ticket[i]) < 0) {
+			tlb_shootdown();
+			__asm __volatile("pause");
+		}
+	}
+}
+
+//
+// Carry out this CPU's queued invalidations.
+//
+void
+tlb_flush_pending(void)
+{
+	struct TlbCpu *tc;
+	uint32_t eflags = read_eflags();
+	int i;
+
+	__asm __volatile("cli");
+	tc = &tlb_cpus[cpunum()];
+	if (tc->tc_full && tc->tc_global) {
+		tlbflush_global();
+		tc->tc_gflush++;
+	} else if (tc->tc_full) {
+		tlbflush();
+		tc->tc_flush++;
+	} else
+		for (i = 0; i < tc->tc_n; i++) {
+			invlpg((void *) (tc->tc_va[i] & ~TLB_VA_GLOBAL));
+			tc->tc_invlpg++;
+		}
+	tlb_queue_reset(tc);
+	tlb_shoot(tc);
+	write_eflags(eflags);
+}
+
+//
+// Make 'ts' the current address space, doing only the TLB work that
+// is not already stale.
+//
+void
+tlb_switch(struct TlbSpace *ts)
+{
+	struct TlbCpu *tc;
+	uint32_t eflags = read_eflags();
+	int i;
+
+	__asm __volatile("cli");
+	tc = &tlb_cpus[cpunum()];
+	if (tc->tc_space == ts) {
+		// Reloading %cr3 would throw away good entries.  But if
+		// 'ts' changed by more than this CPU's own queue covers,
+		// another CPU's change may still be cached here.
+		if (tc->tc_gen + tc->tc_local != ts->ts_gen) {
+			if (tc->tc_global) {
+				tlbflush_global();
+				tc->tc_gflush++;
+			} else {
+				tlbflush();
+				tc->tc_flush++;
+			}
+			tc->tc_remote++;
+			tlb_queue_reset(tc);
+			tlb_shoot(tc);
+		} else {
+			if (tc->tc_n || tc->tc_full)
+				tlb_flush_pending();
+			tc->tc_kept++;
+		}
+		write_eflags(eflags);
+		return;
+	}
+
+	// The %cr3 load flushes every non-global entry, queued or not.
+	lcr3(ts->ts_pgdir);
+	if (tc->tc_full && tc->tc_global) {
+		tlbflush_global();
+		tc->tc_gflush++;
+	} else
+		for (i = 0; i < tc->tc_n; i++)
+			if (tc->tc_va[i] & TLB_VA_GLOBAL) {
+				invlpg((void *) (tc->tc_va[i] & ~TLB_VA_GLOBAL));
+				tc->tc_invlpg++;
+			} else
+				tc->tc_stale++;
+	tc->tc_space = ts;
+	tlb_queue_reset(tc);
+	tlb_shoot(tc);
+	write_eflags(eflags);
+}
+
+// Model the TLB side of a context switch: reload %cr3, as switching
+// address spaces does, then touch one word in each of 'ntouch' kernel
+// pages 'stride' bytes apart.  Returns average cycles per switch.
+static uint64_t
+tlb_switch_cost(int ntouch, uint32_t stride, int iters)
+{
+	volatile uint32_t *p;
+	uint64_t t0;
+	int i, j;
+
+	t0 = read_tsc();
+	for (i = 0; i < iters; i++) {
+		lcr3(rcr3());
+		for (j = 0; j < ntouch; j++) {
+			p = (volatile uint32_t *) (KERNBASE + j * stride);
+			(void) *p;
+		}
+	}
+	return (read_tsc() - t0) / iters;
+}
+
+static int
+mon_tlbbench(int argc, char **argv, struct Trapframe *tf)
+{
+	int ntouch = argc > 1 ? strtol(argv[1], NULL, 0) : 16;
+	int iters = argc > 2 ? strtol(argv[2], NULL, 0) : 1000;
+	uint32_t cr4 = rcr4(), stride;
+	uint64_t global, local;
+	int maxtouch;
+
+	// Touch distinct large pages when PSE is on, so each access needs
+	// its own TLB entry.
+	stride = (cr4 & CR4_PSE) ? PTSIZE : PGSIZE;
+	// ... all within the direct map of physical memory.
+	maxtouch = MIN(64, (int) (ROUNDUP(npages * PGSIZE, PTSIZE) / stride));
+	if (ntouch < 1 || ntouch > maxtouch || iters < 1) {
+		cprintf("usage: tlbbench [pages (1-%d)] [iterations]\n",
+			maxtouch);
+		return 0;
+	}
+
+	lcr4(cr4 | CR4_PGE);
+	tlbflush_global();
+	(void) tlb_switch_cost(ntouch, stride, 1);	// warm the caches
+	global = tlb_switch_cost(ntouch, stride, iters);
+
+	lcr4(cr4 & ~CR4_PGE);
+	local = tlb_switch_cost(ntouch, stride, iters);
+	lcr4(cr4);
+
+	cprintf("tlbbench: %d switches, %d kernel pages of %dKB each\n",
+		iters, ntouch, stride / 1024);
+	cprintf("  global kernel mappings:     %8llu cycles/switch\n", global);
+	cprintf("  non-global kernel mappings: %8llu cycles/switch\n", local);
+	if (local > global)
+		cprintf("  refill cost avoided:        %8llu cycles/switch\n",
+			local - global);
+	return 0;
+}
+MONITOR_COMMAND("tlbbench", "Time TLB refill after %cr3 reload, with and without global pages", mon_tlbbench);
+
+static int
+mon_tlbstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct TlbCpu *tc;
+	int i;
+
+	cprintf("cpu   queued   invlpg  flushes  global    stale     kept"
+		"   remote     sent     recv\n");
+	for (i = 0; i < NCPU; i++) {
+		tc = &tlb_cpus[i];
+		if (!tc->tc_space)
+			continue;
+		cprintf("%3d %8u %8u %8u %7u %8u %8u %8u %8u %8u\n", i,
+			tc->tc_queued, tc->tc_invlpg, tc->tc_flush,
+			tc->tc_gflush, tc->tc_stale, tc->tc_kept,
+			tc->tc_remote, tc->tc_sent, tc->tc_recv);
+	}
+	return 0;
+}
+MONITOR_COMMAND("tlbstat", "Display deferred TLB invalidation counters", mon_tlbstat);
@@ -0,0 +1,48 @@
+#ifndef JOS_KERN_TLB_H
+#define JOS_KERN_TLB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+#include <kern/cpu.h>
+
+// Flush every TLB entry, global ones included.  A plain %cr3 reload
+// (tlbflush()) leaves global kernel mappings in place.
+void tlbflush_global(void);
+
+// Invalidations are deferred.  Whoever changes a present mapping
+// calls tlb_invalidate(), which queues the page on the current CPU;
+// tlb_flush_pending() then issues one invlpg per queued page, or a
+// single full flush once more than TLB_QUEUE_MAX have piled up.
+//
+// Each address space also counts its invalidations in ts_gen.  A CPU
+// remembers the generation its TLB last matched, so switching to an
+// address space can skip work: reloading %cr3 already discards every
+// queued non-global entry, and re-entering the loaded address space
+// with nothing changed needs no flush at all.
+//
+// Other CPUs that have the address space loaded, and every CPU for a
+// global mapping, must drop the old translation too.  tlb_invalidate()
+// notes which CPUs those are, and tlb_flush_pending() sends each an
+// IRQ_TLB shootdown and waits until it has flushed.  So do not call
+// it holding a lock that another CPU may spin on with interrupts off.
+#define TLB_QUEUE_MAX	32
+
+// TLB state of one address space (one page directory).
+struct TlbSpace {
+	physaddr_t ts_pgdir;		// physical address of the page directory
+	volatile uint32_t ts_gen;	// bumped by every invalidation
+};
+
+extern struct TlbSpace kern_tlbspace;
+
+struct TlbSpace *tlb_current(void);
+void tlb_switch(struct TlbSpace *ts);
+void tlb_invalidate(struct TlbSpace *ts, uintptr_t va, pte_t old);
+void tlb_flush_pending(void);
+void tlb_shootdown(void);
+
+#endif	// !JOS_KERN_TLB_H
@@ -0,0 +1,303 @@
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+#include <inc/assert.h>
+
+#include <kern/trap.h>
+#include <kern/console.h>
+#include <kern/monitor.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/timer.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/tlb.h>
+
+/* Interrupt descriptor table.  (Must be built at run time because
+ * shifted function addresses can't be represented in relocation records.)
+ */
+struct Gatedesc idt[256] = { { 0 } };
+struct Pseudodesc idt_pd = {
+	sizeof(idt) - 1, (uint32_t) idt
+};
+
+// Fast IRQ handlers, indexed by IRQ number
+static void (*irq_fast_handlers[MAX_IRQS])(struct IrqFrame *f);
+
+
+static const char *
+trapname(int trapno)
+{
+	static const char * const excnames[] = {
+		"Divide error",
+		"Debug",
+		"Non-Maskable Interrupt",
+		"Breakpoint",
+		"Overflow",
+		"BOUND Range Exceeded",
+		"Invalid Opcode",
+		"Device Not Available",
+		"Double Fault",
+		"Coprocessor Segment Overrun",
+		"Invalid TSS",
+		"Segment Not Present",
+		"Stack Fault",
+		"General Protection",
+		"Page Fault",
+		"(unknown trap)",
+		"x87 FPU Floating-Point Error",
+		"Alignment Check",
+		"Machine-Check",
+		"SIMD Floating-Point Exception"
+	};
+
+	if (trapno < sizeof(excnames)/sizeof(excnames[0]))
+		return excnames[trapno];
+	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + MAX_IRQS)
+		return "Hardware Interrupt";
+	return "(unknown trap)";
+}
+
+
+void
+trap_init(void)
+{
+	extern char trap_vectors[];
+	int i;
+
+	// Every vector gets an interrupt gate, so that IF is clear while
+	// the handler runs.  IRQs with a fast handler registered before
+	// now (e.g., by cons_init) get its stub instead.
+	for (i = 0; i < 256; i++)
+		SETGATE(idt[i], 0, GD_KT, trap_vectors + i * TRAP_STUBSIZE, 0);
+	for (i = 0; i < MAX_IRQS; i++)
+		if (irq_fast_handlers[i])
+			irq_set_fast(i, irq_fast_handlers[i]);
+
+	trap_init_percpu();
+}
+
+//
+// Route IRQ 'irq' to 'handler' through the minimal-save entry path,
+// which skips the full Trapframe.  The handler runs with interrupts
+// disabled and must not need more than a struct IrqFrame; in
+// particular it cannot see the interrupted code's callee-saved
+// registers, so anything that walks the stack stays on the slow path.
+// A NULL handler sends the IRQ back through trap().
+//
+void
+irq_set_fast(int irq, void (*handler)(struct IrqFrame *f))
+{
+	extern char trap_vectors[], irq_fast_vectors[];
+
+	assert(irq >= 0 && irq < MAX_IRQS);
+	irq_fast_handlers[irq] = handler;
+	if (handler) {
+		SETGATE(idt[IRQ_OFFSET + irq], 0, GD_KT,
+			irq_fast_vectors + irq * TRAP_STUBSIZE, 0);
+	} else {
+		SETGATE(idt[IRQ_OFFSET + irq], 0, GD_KT,
+			trap_vectors + (IRQ_OFFSET + irq) * TRAP_STUBSIZE, 0);
+	}
+}
+
+//
+// Build the GDT of CPU 'c', which must be the one running, and load
+// it along with the segment registers.  Besides the usual flat kernel
+// and user segments, each GDT has a segment (GD_CPU) whose base is
+// that CPU's struct CpuInfo; %fs selects it, which is how cpunum()
+// tells the CPUs apart.  The boot CPU calls this before anything else
+// and the others first thing in mp_main().
+//
+void
+gdt_init_percpu(struct CpuInfo *c)
+{
+	struct Pseudodesc pd;
+
+	c->cpu_gdt[0] = SEG_NULL;
+	c->cpu_gdt[GD_KT >> 3] = SEG(STA_X | STA_R, 0x0, 0xffffffff, 0);
+	c->cpu_gdt[GD_KD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 0);
+	c->cpu_gdt[GD_UT >> 3] = SEG(STA_X | STA_R, 0x0, 0xffffffff, 3);
+	c->cpu_gdt[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3);
+	c->cpu_gdt[GD_TSS >> 3] = SEG_NULL;	// trap_init_percpu() fills it
+	c->cpu_gdt[GD_CPU >> 3] = SEG(STA_W, (uint32_t) c,
+				      sizeof(struct CpuInfo) - 1, 0);
+
+	pd.pd_lim = sizeof(c->cpu_gdt) - 1;
+	pd.pd_base = (uint32_t) c->cpu_gdt;
+	__asm __volatile("lgdt %0" : : "m" (pd));
+	// The kernel never uses %gs; %fs is the per-CPU segment.
+	__asm __volatile("movw %%ax,%%gs" : : "a" (GD_KD));
+	__asm __volatile("movw %%ax,%%fs" : : "a" (GD_CPU));
+	__asm __volatile("movw %%ax,%%es" : : "a" (GD_KD));
+	__asm __volatile("movw %%ax,%%ds" : : "a" (GD_KD));
+	__asm __volatile("movw %%ax,%%ss" : : "a" (GD_KD));
+	// Load the kernel text segment into CS.
+	__asm __volatile("ljmp %0,$1f\n 1:\n" : : "i" (GD_KT));
+	// The kernel has no LDT.
+	lldt(0);
+}
+
+// Initialize and load this CPU's TSS and the IDT.
+void
+trap_init_percpu(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	// Setup a TSS so that we get the right stack
+	// when we trap to the kernel.
+	c->cpu_ts.ts_esp0 = c->cpu_kstacktop;
+	c->cpu_ts.ts_ss0 = GD_KD;
+	c->cpu_ts.ts_iomb = sizeof(struct Taskstate);
+
+	// Initialize the TSS slot of the gdt.
+	c->cpu_gdt[GD_TSS >> 3] = SEG16(STS_T32A, (uint32_t) (&c->cpu_ts),
+					sizeof(struct Taskstate) - 1, 0);
+	c->cpu_gdt[GD_TSS >> 3].sd_s = 0;
+
+	// Load the TSS selector (like other segment selectors, the
+	// bottom three bits are special; we leave them 0)
+	ltr(GD_TSS);
+
+	// Load the IDT
+	lidt(&idt_pd);
+}
+
+void
+print_trapframe(struct Trapframe *tf)
+{
+	cprintf("TRAP frame at %p\n", tf);
+	print_regs(&tf->tf_regs);
+	cprintf("  es   0x----%04x\n", tf->tf_es);
+	cprintf("  ds   0x----%04x\n", tf->tf_ds);
+	cprintf("  trap 0x%08x %s\n", tf->tf_trapno, trapname(tf->tf_trapno));
+	if (tf->tf_trapno == T_PGFLT)
+		cprintf("  cr2  0x%08x\n", rcr2());
+	cprintf("  err  0x%08x\n", tf->tf_err);
+	cprintf("  eip  0x%08x\n", tf->tf_eip);
+	cprintf("  cs   0x----%04x\n", tf->tf_cs);
+	cprintf("  flag 0x%08x\n", tf->tf_eflags);
+	if ((tf->tf_cs & 3) != 0) {
+		cprintf("  esp  0x%08x\n", tf->tf_esp);
+		cprintf("  ss   0x----%04x\n", tf->tf_ss);
+	}
+}
+
+void
+print_regs(struct PushRegs *regs)
+{
+	cprintf("  edi  0x%08x\n", regs->reg_edi);
+	cprintf("  esi  0x%08x\n", regs->reg_esi);
+	cprintf("  ebp  0x%08x\n", regs->reg_ebp);
+	cprintf("  oesp 0x%08x\n", regs->reg_oesp);
+	cprintf("  ebx  0x%08x\n", regs->reg_ebx);
+	cprintf("  edx  0x%08x\n", regs->reg_edx);
+	cprintf("  ecx  0x%08x\n", regs->reg_ecx);
+	cprintf("  eax  0x%08x\n", regs->reg_eax);
+}
+
+static void
+trap_dispatch(struct Trapframe *tf)
+{
+	switch (tf->tf_trapno) {
+	case IRQ_OFFSET + IRQ_TIMER:
+		timer_intr(tf);
+		return;
+
+	case IRQ_OFFSET + IRQ_KBD:
+		kbd_intr();
+		return;
+
+	case IRQ_OFFSET + IRQ_SERIAL:
+		serial_intr();
+		return;
+
+	case IRQ_OFFSET + IRQ_ERROR:
+		lapic_error();
+		return;
+
+	case IRQ_OFFSET + IRQ_RESCHED:
+		// Only here to make us look at sched_pending().
+		lapic_eoi();
+		return;
+
+	case IRQ_OFFSET + IRQ_TLB:
+		tlb_shootdown();
+		lapic_eoi();
+		return;
+
+	case IRQ_OFFSET + IRQ_CLOCK:
+		lapic_eoi();
+		timer_resync();
+		return;
+
+	}
+
+	// Unexpected trap: The user process or the kernel has a bug.
+	print_trapframe(tf);
+	if ((tf->tf_cs & 3) == 0)
+		panic("unhandled trap in kernel");
+	env_destroy(curenv);
+}
+
+void
+trap(struct Trapframe *tf)
+{
+	int irq = tf->tf_trapno - IRQ_OFFSET;
+	uint64_t t0;
+
+	// The environment may have set DF and some versions
+	// of GCC rely on DF being clear
+	asm volatile("cld" ::: "cc");
+
+	if ((tf->tf_cs & 3) == 3) {
+		// Trapped from user mode.
+		assert(curenv);
+
+		// Garbage collect if current enviroment is a zombie
+		if (curenv->env_status == ENV_DYING)
+			sched_yield();
+
+		// Copy trap frame (which is currently on the stack)
+		// into 'curenv->env_tf', so that running the environment
+		// will restart at the trap point.
+		curenv->env_tf = *tf;
+		// The trapframe on the stack should be ignored from here on.
+		tf = &curenv->env_tf;
+	}
+
+	if (irq < 0 || irq >= MAX_IRQS)
+		trap_dispatch(tf);
+	// The hardware sometimes raises spurious IRQ 7s and 15s because
+	// of noise on the IRQ line or other reasons.  We don't care.
+	else if (!irq_spurious(irq)) {
+		t0 = read_tsc();
+		trap_dispatch(tf);
+		irq_eoi(irq);
+		irq_account(irq, read_tsc() - t0);
+	}
+
+	// Back to user mode: to the same environment, unless a wakeup or
+	// the end of its time slice says another should run.
+	if (curenv && tf == &curenv->env_tf) {
+		if (sched_pending() || curenv->env_status != ENV_RUNNING)
+			sched_yield();
+		env_run(curenv);
+	}
+}
+
+// Called from _irqfast, with interrupts disabled, for IRQs that have
+// a fast handler.
+void
+irq_fast(struct IrqFrame *f)
+{
+	int irq = f->if_irq;
+	uint64_t t0;
+
+	if (irq_spurious(irq))
+		return;
+	t0 = read_tsc();
+	irq_fast_handlers[irq](f);
+	irq_eoi(irq);
+	irq_account(irq, read_tsc() - t0);
+}
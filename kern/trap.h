@@ -0,0 +1,43 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TRAP_H
+#define JOS_KERN_TRAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+// Spacing of the generated entry stubs in kern/trapentry.S
+#define TRAP_STUBSIZE	16
+
+#ifndef __ASSEMBLER__
+
+#include <inc/trap.h>
+#include <inc/mmu.h>
+
+// What the minimal-save IRQ entry path pushes: only the registers a C
+// function may clobber.
+struct IrqFrame {
+	uint32_t if_eax;
+	uint32_t if_ecx;
+	uint32_t if_edx;
+	uint32_t if_irq;
+	/* below here defined by x86 hardware */
+	uintptr_t if_eip;
+	uint16_t if_cs;
+	uint16_t if_padding;
+	uint32_t if_eflags;
+} __attribute__((packed));
+
+/* The kernel's interrupt descriptor table */
+extern struct Gatedesc idt[];
+extern struct Pseudodesc idt_pd;
+
+void trap_init(void);
+void trap_init_percpu(void);
+void irq_set_fast(int irq, void (*handler)(struct IrqFrame *f));
+void print_regs(struct PushRegs *regs);
+void print_trapframe(struct Trapframe *tf);
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* JOS_KERN_TRAP_H */
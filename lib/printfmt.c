@@ -8,7 +8,15 @@
 #include <inc/stdarg.h>
 #include <inc/error.h>
 
+#ifdef JOS_KERNEL
+#include <kern/cpu.h>
+// Every CPU formats at once, so each counts characters for %n itself.
+extern int number[NCPU];
+#define NUMBER	number[cpunum()]
+#else
 extern int number;
+#define NUMBER	number
+#endif
 
 /*
  * Space or zero padding and a field width are supported for the numeric
@@ -100,7 +108,7 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 	int base, lflag, width, precision, altflag;
 	char padc;
 	int sign = 0;
-	number = 0;
+	NUMBER = 0;
 
 	while (1) {
 		while ((ch = *(unsigned char *) fmt++) != '%') {
@@ -276,8 +284,8 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 				printfmt(putch, putdat, "%s", null_error);
 			else
 			{
-				*a = number;
-				if(number > 127 || number < 0) printfmt(putch, putdat, "%s", overflow_error);
+				*a = NUMBER;
+				if(NUMBER > 127 || NUMBER < 0) printfmt(putch, putdat, "%s", overflow_error);
 			}
             // Your code here
 			
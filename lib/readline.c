@@ -1,19 +1,31 @@
 #include <inc/stdio.h>
 #include <inc/error.h>
 
+#ifdef JOS_KERNEL
+#include <kern/cpu.h>
+#endif
+
 #define BUFLEN 1024
+#ifdef JOS_KERNEL
+// Each CPU can run the monitor (e.g., after a panic), so each gets its
+// own line buffer.
+static char bufs[NCPU][BUFLEN];
+#else
 static char buf[BUFLEN];
+#endif
 
-char *
-readline(const char *prompt)
+static char *
+getline(const char *prompt, int echoing)
 {
-	int i, c, echoing;
+	int i, c;
+#ifdef JOS_KERNEL
+	char *buf = bufs[cpunum()];
+#endif
 
 	if (prompt != NULL)
 		cprintf("%s", prompt);
 
 	i = 0;
-	echoing = iscons(0);
 	while (1) {
 		c = getchar();
 		if (c < 0) {
@@ -36,3 +48,15 @@ readline(const char *prompt)
 	}
 }
 
+char *
+readline(const char *prompt)
+{
+	return getline(prompt, iscons(0));
+}
+
+// Read a line without echoing it, e.g. a pasted script.
+char *
+readline_noecho(const char *prompt)
+{
+	return getline(prompt, 0);
+}